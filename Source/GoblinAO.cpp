@@ -14,10 +14,22 @@ namespace Goblin {
         const RayDifferential& ray, 
         const Sample& sample, const RNG& rng,
         RenderingTLS* tls) const {
-        Color Li = Color::Black;
         float epsilon;
         Intersection intersection;
-        if(scene->intersect(ray, &epsilon, &intersection)) {
+        bool hit = scene->intersect(ray, &epsilon, &intersection);
+        return shade(scene, ray, hit, epsilon, intersection, sample, rng, tls);
+    }
+
+    bool AORenderer::supportRayPacket() const {
+        return true;
+    }
+
+    Color AORenderer::shade(const ScenePtr& scene, 
+        const RayDifferential& ray, bool hit, float epsilon, 
+        Intersection& intersection, const Sample& sample, const RNG& rng,
+        RenderingTLS* tls) const {
+        Color Li = Color::Black;
+        if(hit) {
             const Fragment& fragment = intersection.fragment;
             uint32_t samplesNum = mAOSampleIndex.sampleNum;
             uint32_t occludedNum = 0;
@@ -13,6 +13,11 @@ namespace Goblin {
         Color Li(const ScenePtr& scene, const RayDifferential& ray, 
             const Sample& sample, const RNG& rng,
             RenderingTLS* tls) const;
+        bool supportRayPacket() const;
+        Color shade(const ScenePtr& scene, const RayDifferential& ray,
+            bool hit, float epsilon, Intersection& intersection,
+            const Sample& sample, const RNG& rng, 
+            RenderingTLS* tls) const;
     private:
         void querySampleQuota(const ScenePtr& scene, 
             SampleQuota* sampleQuota);
@@ -19,6 +19,7 @@ namespace Goblin {
         bool intersect(const Ray& ray) const;
         bool intersect(const Ray& ray, float* tMin, float* tMax) const;
         int longestAxis() const;
+        float surfaceArea() const;
         Vector3 center() const;
         const Vector3& operator[](int i) const;
         Vector3& operator[](int i);
@@ -39,6 +40,11 @@ namespace Goblin {
         pMin(min(p1.x, p2.x), min(p1.y, p2.y), min(p1.z, p2.z)),
         pMax(max(p1.x, p2.x), max(p1.y, p2.y), max(p1.z, p2.z)) {}
 
+    inline float BBox::surfaceArea() const {
+        Vector3 d = pMax - pMin;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
     inline Vector3 BBox::center() const {
         return 0.5f * (pMin + pMax);
     }
@@ -38,7 +38,7 @@ namespace Goblin {
     void BDPTTask::run(TLSPtr& tls) {
         RenderingTLS* renderingTLS =
             static_cast<RenderingTLS*>(tls.get());
-        ImageTile* tile = renderingTLS->getTile();
+        Film* film = mCamera->getFilm();
 
         Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, mRNG);
         int batchAmount = sampler.maxSamplesPerRequest();
@@ -48,7 +48,7 @@ namespace Goblin {
         while ((sampleNum = sampler.requestSamples(samples)) > 0) {
             for (int s = 0; s <sampleNum; ++s) {
                 mBDPT->evalContribution(mScene, samples[s], *mRNG,
-                    mLightPath, mEyePath, mMISNodes, tile);
+                    mLightPath, mEyePath, mMISNodes, film);
             }
             totalSampleCount += sampleNum;
         }
@@ -88,7 +88,7 @@ namespace Goblin {
         std::vector<PathVertex>& lightPath,
         std::vector<PathVertex>& eyePath,
         std::vector<BDPTMISNode>& misNodes,
-        ImageTile* tile) const {
+        Film* film) const {
         // construct path randomwalk from light
         const vector<Light*>& lights = scene->getLights();
         if (lights.size() == 0) {
@@ -152,7 +152,7 @@ namespace Goblin {
                     1.0f :
                     evalMIS(scene, camera, lightPath, s, eyePath, t,
                     Gconnect, misNodes);
-                tile->addSample(filmPixel.x, filmPixel.y,
+                film->addSplat(filmPixel.x, filmPixel.y,
                     weight * unweightedContribution);
             }
         }
@@ -543,21 +543,30 @@ namespace Goblin {
                 mMaxPathLength, &progress));
         }
 
+        film->initSplatBuffer();
         RenderingTLSManager tlsManager(film);
-        ThreadPool threadPool(mThreadNum, &tlsManager);
-        threadPool.enqueue(bdptTasks);
-        threadPool.waitForAll();
+        renderPasses(bdptTasks, &tlsManager, &progress);
         //clean up
         for (size_t i = 0; i < bdptTasks.size(); ++i) {
             delete bdptTasks[i];
         }
         bdptTasks.clear();
+        drawDebugData(tlsManager.getDebugData(), camera);
+        outputFilm(film, tlsManager);
+    }
+
+    void BDPT::writeFilm(Film* film,
+        const RenderingTLSManager& tlsManager) const {
+        // splats are normalized by the samples of all passes so far
         ImageRect filmRect;
         film->getImageRect(filmRect);
         float filmArea = (float)(filmRect.xCount * filmRect.yCount);
-        film->scaleImage(filmArea / tlsManager.getTotalSampleCount());
-        drawDebugData(tlsManager.getDebugData(), camera);
-        film->writeImage(false);
+        film->writeImage(false,
+            filmArea / tlsManager.getTotalSampleCount());
+    }
+
+    bool BDPT::supportCropPartition() const {
+        return false;
     }
 
     void BDPT::querySampleQuota(const ScenePtr& scene,
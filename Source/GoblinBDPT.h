@@ -21,13 +21,18 @@ namespace Goblin {
             RenderingTLS* tls = NULL) const;
 
         void render(const ScenePtr& scene);
+
+        void writeFilm(Film* film,
+            const RenderingTLSManager& tlsManager) const;
+
+        bool supportCropPartition() const;
         
         void evalContribution(const ScenePtr& scene,
             const Sample& sample, const RNG& rng,
             std::vector<PathVertex>& lightPath,
             std::vector<PathVertex>& eyePath,
             std::vector<BDPTMISNode>& misNodes,
-            ImageTile* tile) const;
+            Film* film) const;
 
         void querySampleQuota(const ScenePtr& scene,
             SampleQuota* sampleQuota);
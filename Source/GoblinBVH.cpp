@@ -1,11 +1,28 @@
 #include "GoblinBVH.h"
+#include "GoblinParamSet.h"
 #include "GoblinRay.h"
+#include "GoblinSampler.h"
+#include "GoblinThreadPool.h"
 #include "GoblinUtils.h"
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <xmmintrin.h>
 
 namespace Goblin {
 
     struct BVHPrimitiveInfo {
+        BVHPrimitiveInfo() {}
         BVHPrimitiveInfo(const BBox& b, int i):
             bbox(b), primitiveIndexNum(i), center(0.5f * (b.pMin + b.pMax)) {}
         BBox bbox;
@@ -31,151 +48,2651 @@ namespace Goblin {
         }
     };
 
-    BVH::BVH(const PrimitiveList& primitives, int maxPrimitivesNum,
-        const std::string& splitMethod):
-        Aggregate(primitives),
-        mMaxPrimitivesNum(maxPrimitivesNum) {
-        if(mRefinedPrimitives.size() == 0) {
+    // the SAH cost of traversing an interior node relative to
+    // the cost of intersecting one primitive
+    static const float sTraversalCost = 0.125f;
+    static const int sSAHBucketsNum = 12;
+
+    struct SAHBucket {
+        SAHBucket(): count(0) {}
+        uint32_t count;
+        BBox bbox;
+    };
+
+    static inline int computeBucket(const BVHPrimitiveInfo& info, int dim,
+        float axisStart, float invAxisLength) {
+        int b = (int)(sSAHBucketsNum * 
+            (info.center[dim] - axisStart) * invAxisLength);
+        return clamp(b, 0, sSAHBucketsNum - 1);
+    }
+
+    struct BucketComparator {
+        BucketComparator(int d, int s, float start, float invLength):
+            dim(d), splitBucket(s), axisStart(start),
+            invAxisLength(invLength) {}
+        int dim;
+        int splitBucket;
+        float axisStart;
+        float invAxisLength;
+        bool operator()(const BVHPrimitiveInfo& b) const {
+            return computeBucket(b, dim, axisStart, invAxisLength) <=
+                splitBucket;
+        }
+    };
+
+    // ranges larger than this get their bounds, binning and partition
+    // passes split across the build thread pool
+    static const uint32_t sParallelPassSize = 65536;
+    // subtrees smaller than this are always built by a single task
+    static const uint32_t sMinSubtreeTaskSize = 1024;
+    // mLeafTrianglePacks entry for leaves without triangle pack
+    static const uint32_t sNoTrianglePack = 0xffffffff;
+    // the traversal stacks hold 64 entries and take one per level (two
+    // under the deepest interior node for the quantized layout), the
+    // builders keep every leaf at or above this depth
+    static const uint32_t sMaxLeafDepth = 60;
+
+    static inline uint32_t ceilLog2(uint32_t n) {
+        uint32_t log = 0;
+        while(((uint64_t)1 << log) < n) {
+            ++log;
+        }
+        return log;
+    }
+
+    // whether a node has to be split by equal count to keep the leaves
+    // under it within sMaxLeafDepth, a node that doesn't can take any
+    // split since its children get at least one primitive less
+    static inline bool mustBalance(uint32_t depth, uint32_t primitivesNum) {
+        return depth + ceilLog2(primitivesNum) >= sMaxLeafDepth;
+    }
+
+    struct BVHSubtree {
+        BVHSubtree(uint32_t s, uint32_t e, uint32_t d):
+            start(s), end(e), depth(d) {}
+        uint32_t start;
+        uint32_t end;
+        uint32_t depth;
+        BVHNodeList nodes;
+    };
+
+    struct BVHBuildState {
+        BVHBuildState(ThreadPool* pool, uint32_t taskSize):
+            threadPool(pool), subtreeTaskSize(taskSize) {}
+        ~BVHBuildState() {
+            for(size_t i = 0; i < subtrees.size(); ++i) {
+                delete subtrees[i];
+            }
+        }
+        ThreadPool* threadPool;
+        uint32_t subtreeTaskSize;
+        // top level placeholder node index -> deferred subtree index
+        std::map<uint32_t, size_t> subtreeIndex;
+        std::vector<BVHSubtree*> subtrees;
+    };
+
+    class BVHInfoTask : public Task {
+    public:
+        BVHInfoTask(const PrimitiveList& primitives, 
+            std::vector<BVHPrimitiveInfo>& buildData,
+            uint32_t start, uint32_t end):
+            mPrimitives(primitives), mBuildData(buildData),
+            mStart(start), mEnd(end) {}
+        void run(TLSPtr& tls) {
+            for(uint32_t i = mStart; i < mEnd; ++i) {
+                mBuildData[i] = 
+                    BVHPrimitiveInfo(mPrimitives[i]->getAABB(), i);
+            }
+        }
+    private:
+        const PrimitiveList& mPrimitives;
+        std::vector<BVHPrimitiveInfo>& mBuildData;
+        uint32_t mStart;
+        uint32_t mEnd;
+    };
+
+    class BVHBoundsTask : public Task {
+    public:
+        BVHBoundsTask(const std::vector<BVHPrimitiveInfo>& buildData,
+            uint32_t start, uint32_t end):
+            mBuildData(buildData), mStart(start), mEnd(end) {}
+        void run(TLSPtr& tls) {
+            for(uint32_t i = mStart; i < mEnd; ++i) {
+                mBBox.expand(mBuildData[i].bbox);
+                mCentersUnion.expand(mBuildData[i].center);
+            }
+        }
+        const BBox& getBBox() const { return mBBox; }
+        const BBox& getCentersUnion() const { return mCentersUnion; }
+    private:
+        const std::vector<BVHPrimitiveInfo>& mBuildData;
+        uint32_t mStart;
+        uint32_t mEnd;
+        BBox mBBox;
+        BBox mCentersUnion;
+    };
+
+    class BVHBinningTask : public Task {
+    public:
+        BVHBinningTask(const std::vector<BVHPrimitiveInfo>& buildData,
+            uint32_t start, uint32_t end, int dim, float axisStart,
+            float invAxisLength):
+            mBuildData(buildData), mStart(start), mEnd(end), mDim(dim),
+            mAxisStart(axisStart), mInvAxisLength(invAxisLength) {}
+        void run(TLSPtr& tls) {
+            for(uint32_t i = mStart; i < mEnd; ++i) {
+                int b = computeBucket(mBuildData[i], mDim, mAxisStart,
+                    mInvAxisLength);
+                mBuckets[b].count++;
+                mBuckets[b].bbox.expand(mBuildData[i].bbox);
+            }
+        }
+        const SAHBucket& getBucket(int i) const { return mBuckets[i]; }
+    private:
+        const std::vector<BVHPrimitiveInfo>& mBuildData;
+        uint32_t mStart;
+        uint32_t mEnd;
+        int mDim;
+        float mAxisStart;
+        float mInvAxisLength;
+        SAHBucket mBuckets[sSAHBucketsNum];
+    };
+
+    // stable partition in two passes: count the primitives that go
+    // to the left side per chunk, then scatter them to the prefix 
+    // summed offsets in a temp buffer
+    template<typename Predicate>
+    class BVHPartitionTask : public Task {
+    public:
+        BVHPartitionTask(const std::vector<BVHPrimitiveInfo>& buildData,
+            std::vector<BVHPrimitiveInfo>& output, uint32_t start,
+            uint32_t end, const Predicate& predicate):
+            mBuildData(buildData), mOutput(output), mStart(start),
+            mEnd(end), mPredicate(predicate), mLeftCount(0),
+            mLeftOffset(0), mRightOffset(0), mScatter(false) {}
+        void run(TLSPtr& tls) {
+            if(!mScatter) {
+                for(uint32_t i = mStart; i < mEnd; ++i) {
+                    if(mPredicate(mBuildData[i])) {
+                        mLeftCount++;
+                    }
+                }
+                return;
+            }
+            uint32_t left = mLeftOffset;
+            uint32_t right = mRightOffset;
+            for(uint32_t i = mStart; i < mEnd; ++i) {
+                if(mPredicate(mBuildData[i])) {
+                    mOutput[left++] = mBuildData[i];
+                } else {
+                    mOutput[right++] = mBuildData[i];
+                }
+            }
+        }
+        uint32_t getLeftCount() const { return mLeftCount; }
+        uint32_t getRightCount() const { 
+            return mEnd - mStart - mLeftCount;
+        }
+        void setScatterOffsets(uint32_t left, uint32_t right) {
+            mLeftOffset = left;
+            mRightOffset = right;
+            mScatter = true;
+        }
+    private:
+        const std::vector<BVHPrimitiveInfo>& mBuildData;
+        std::vector<BVHPrimitiveInfo>& mOutput;
+        uint32_t mStart;
+        uint32_t mEnd;
+        Predicate mPredicate;
+        uint32_t mLeftCount;
+        uint32_t mLeftOffset;
+        uint32_t mRightOffset;
+        bool mScatter;
+    };
+
+    class BVHSubtreeTask : public Task {
+    public:
+        BVHSubtreeTask(const BVH* bvh, 
+            std::vector<BVHPrimitiveInfo>& buildData, BVHSubtree* subtree):
+            mBVH(bvh), mBuildData(buildData), mSubtree(subtree) {}
+        void run(TLSPtr& tls) {
+            mBVH->buildLinearBVH(mBuildData, mSubtree->start, 
+                mSubtree->end, mSubtree->depth, mSubtree->nodes, NULL);
+        }
+    private:
+        const BVH* mBVH;
+        std::vector<BVHPrimitiveInfo>& mBuildData;
+        BVHSubtree* mSubtree;
+    };
+
+    static void runTasks(ThreadPool* threadPool, 
+        const std::vector<Task*>& tasks) {
+        threadPool->enqueue(tasks);
+        threadPool->waitForAll();
+    }
+
+    static void deleteTasks(std::vector<Task*>& tasks) {
+        for(size_t i = 0; i < tasks.size(); ++i) {
+            delete tasks[i];
+        }
+        tasks.clear();
+    }
+
+    static uint32_t getChunksNum(ThreadPool* threadPool, uint32_t n) {
+        uint32_t chunksNum = 4 * threadPool->getCoreNum();
+        return max(min(chunksNum, n / sMinSubtreeTaskSize), (uint32_t)1);
+    }
+
+    static inline uint32_t chunkStart(uint32_t start, uint32_t end,
+        uint32_t chunk, uint32_t chunksNum) {
+        return start + (uint32_t)((uint64_t)(end - start) * 
+            chunk / chunksNum);
+    }
+
+    static void computeBounds(const std::vector<BVHPrimitiveInfo>& buildData,
+        uint32_t start, uint32_t end, ThreadPool* threadPool,
+        BBox* bbox, BBox* centersUnion) {
+        if(threadPool == NULL || end - start <= sParallelPassSize) {
+            for(uint32_t i = start; i < end; ++i) {
+                bbox->expand(buildData[i].bbox);
+                centersUnion->expand(buildData[i].center);
+            }
             return;
         }
+        uint32_t chunksNum = getChunksNum(threadPool, end - start);
+        std::vector<Task*> tasks;
+        for(uint32_t i = 0; i < chunksNum; ++i) {
+            tasks.push_back(new BVHBoundsTask(buildData, 
+                chunkStart(start, end, i, chunksNum),
+                chunkStart(start, end, i + 1, chunksNum)));
+        }
+        runTasks(threadPool, tasks);
+        for(size_t i = 0; i < tasks.size(); ++i) {
+            BVHBoundsTask* task = static_cast<BVHBoundsTask*>(tasks[i]);
+            bbox->expand(task->getBBox());
+            centersUnion->expand(task->getCentersUnion());
+        }
+        deleteTasks(tasks);
+    }
+
+    // large ranges are partitioned stably so the resulting tree
+    // doesn't depend on whether the pass ran in parallel or not
+    template<typename Predicate>
+    static uint32_t partitionBuildData(
+        std::vector<BVHPrimitiveInfo>& buildData, uint32_t start,
+        uint32_t end, const Predicate& predicate, ThreadPool* threadPool) {
+        BVHPrimitiveInfo* first = &buildData[start];
+        BVHPrimitiveInfo* last = &buildData[end - 1] + 1;
+        if(end - start <= sParallelPassSize) {
+            return std::partition(first, last, predicate) - &buildData[0];
+        } 
+        if(threadPool == NULL) {
+            return std::stable_partition(first, last, predicate) -
+                &buildData[0];
+        }
+        std::vector<BVHPrimitiveInfo> output(end - start);
+        uint32_t chunksNum = getChunksNum(threadPool, end - start);
+        std::vector<Task*> tasks;
+        for(uint32_t i = 0; i < chunksNum; ++i) {
+            tasks.push_back(new BVHPartitionTask<Predicate>(buildData,
+                output, chunkStart(start, end, i, chunksNum),
+                chunkStart(start, end, i + 1, chunksNum), predicate));
+        }
+        runTasks(threadPool, tasks);
+        uint32_t leftCount = 0;
+        for(size_t i = 0; i < tasks.size(); ++i) {
+            leftCount += static_cast<BVHPartitionTask<Predicate>*>(
+                tasks[i])->getLeftCount();
+        }
+        uint32_t leftOffset = 0;
+        uint32_t rightOffset = leftCount;
+        for(size_t i = 0; i < tasks.size(); ++i) {
+            BVHPartitionTask<Predicate>* task = 
+                static_cast<BVHPartitionTask<Predicate>*>(tasks[i]);
+            task->setScatterOffsets(leftOffset, rightOffset);
+            leftOffset += task->getLeftCount();
+            rightOffset += task->getRightCount();
+        }
+        runTasks(threadPool, tasks);
+        deleteTasks(tasks);
+        std::copy(output.begin(), output.end(), first);
+        return start + leftCount;
+    }
+
+    // 30 bit morton codes (10 bits per axis) are enough to tell apart
+    // primitives of moderate size meshes, larger ones go for 63 bits
+    static const uint32_t sMaxMorton30PrimitivesNum = 1 << 20;
+    static const int sRadixBits = 8;
+    static const int sRadixBucketsNum = 1 << sRadixBits;
+
+    template<typename MortonCode>
+    struct MortonPrimitive {
+        MortonCode code;
+        uint32_t index;
+    };
+
+    template<typename MortonCode>
+    static inline int mortonBitsPerAxis() {
+        return sizeof(MortonCode) == 4 ? 10 : 21;
+    }
+
+    // spread the lower bits of x so there are two zero bits between
+    // each of them
+    static inline uint32_t leftShift3(uint32_t x) {
+        x &= 0x3ff;
+        x = (x | (x << 16)) & 0x30000ff;
+        x = (x | (x << 8)) & 0x300f00f;
+        x = (x | (x << 4)) & 0x30c30c3;
+        x = (x | (x << 2)) & 0x9249249;
+        return x;
+    }
+
+    static inline uint64_t leftShift3(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | (x << 32)) & 0x1f00000000ffffULL;
+        x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+        x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+        x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+        x = (x | (x << 2)) & 0x1249249249249249ULL;
+        return x;
+    }
+
+    // x takes the highest bit of every 3 bit group, then y, then z
+    template<typename MortonCode>
+    static inline MortonCode encodeMorton(const Vector3& center,
+        const BBox& centersUnion) {
+        float cellsNum = (float)(1 << mortonBitsPerAxis<MortonCode>());
+        MortonCode code = 0;
+        for(int axis = 0; axis < 3; ++axis) {
+            float extent = centersUnion.pMax[axis] - centersUnion.pMin[axis];
+            float offset = extent > 0.0f ?
+                (center[axis] - centersUnion.pMin[axis]) / extent : 0.0f;
+            MortonCode cell = (MortonCode)clamp(offset * cellsNum, 
+                0.0f, cellsNum - 1.0f);
+            code |= leftShift3(cell) << (2 - axis);
+        }
+        return code;
+    }
+
+    template<typename MortonCode>
+    class MortonCodeTask : public Task {
+    public:
+        MortonCodeTask(const std::vector<BVHPrimitiveInfo>& buildData,
+            std::vector<MortonPrimitive<MortonCode> >& mortonPrims,
+            const BBox& centersUnion, uint32_t start, uint32_t end):
+            mBuildData(buildData), mMortonPrims(mortonPrims),
+            mCentersUnion(centersUnion), mStart(start), mEnd(end) {}
+        void run(TLSPtr& tls) {
+            encode();
+        }
+        void encode() {
+            for(uint32_t i = mStart; i < mEnd; ++i) {
+                mMortonPrims[i].code = encodeMorton<MortonCode>(
+                    mBuildData[i].center, mCentersUnion);
+                mMortonPrims[i].index = i;
+            }
+        }
+    private:
+        const std::vector<BVHPrimitiveInfo>& mBuildData;
+        std::vector<MortonPrimitive<MortonCode> >& mMortonPrims;
+        BBox mCentersUnion;
+        uint32_t mStart;
+        uint32_t mEnd;
+    };
+
+    // one digit pass of the LSD radix sort over a chunk: count the
+    // digits first, then scatter to the prefix summed offsets
+    template<typename MortonCode>
+    class RadixSortTask : public Task {
+    public:
+        RadixSortTask(const std::vector<MortonPrimitive<MortonCode> >& input,
+            std::vector<MortonPrimitive<MortonCode> >& output,
+            uint32_t start, uint32_t end):
+            mInput(input), mOutput(output), mStart(start), mEnd(end),
+            mShift(0), mScatter(false) {}
+        void run(TLSPtr& tls) {
+            if(mScatter) {
+                scatter();
+            } else {
+                count();
+            }
+        }
+        void count() {
+            for(int b = 0; b < sRadixBucketsNum; ++b) {
+                mCounts[b] = 0;
+            }
+            for(uint32_t i = mStart; i < mEnd; ++i) {
+                mCounts[digit(mInput[i].code)]++;
+            }
+        }
+        void scatter() {
+            for(uint32_t i = mStart; i < mEnd; ++i) {
+                mOutput[mOffsets[digit(mInput[i].code)]++] = mInput[i];
+            }
+        }
+        void setPass(int shift, bool scatter) {
+            mShift = shift;
+            mScatter = scatter;
+        }
+        uint32_t getCount(int b) const { return mCounts[b]; }
+        void setOffset(int b, uint32_t offset) { mOffsets[b] = offset; }
+    private:
+        int digit(MortonCode code) const {
+            return (int)((code >> mShift) & (sRadixBucketsNum - 1));
+        }
+    private:
+        const std::vector<MortonPrimitive<MortonCode> >& mInput;
+        std::vector<MortonPrimitive<MortonCode> >& mOutput;
+        uint32_t mStart;
+        uint32_t mEnd;
+        int mShift;
+        bool mScatter;
+        uint32_t mCounts[sRadixBucketsNum];
+        uint32_t mOffsets[sRadixBucketsNum];
+    };
+
+    // stable LSD radix sort by morton code, every pass counts and
+    // scatters the chunks in parallel. chunks scatter in order for
+    // each digit so the result doesn't depend on the chunk count
+    template<typename MortonCode>
+    static void radixSort(std::vector<MortonPrimitive<MortonCode> >& prims,
+        ThreadPool* threadPool) {
+        uint32_t n = prims.size();
+        std::vector<MortonPrimitive<MortonCode> > temp(n);
+        bool parallel = threadPool != NULL && n > sParallelPassSize;
+        uint32_t chunksNum = parallel ? getChunksNum(threadPool, n) : 1;
+        int bitsNum = 3 * mortonBitsPerAxis<MortonCode>();
+        for(int shift = 0; shift < bitsNum; shift += sRadixBits) {
+            std::vector<Task*> tasks;
+            for(uint32_t i = 0; i < chunksNum; ++i) {
+                tasks.push_back(new RadixSortTask<MortonCode>(prims, temp,
+                    chunkStart(0, n, i, chunksNum),
+                    chunkStart(0, n, i + 1, chunksNum)));
+                static_cast<RadixSortTask<MortonCode>*>(tasks[i])->setPass(
+                    shift, false);
+            }
+            if(parallel) {
+                runTasks(threadPool, tasks);
+            } else {
+                static_cast<RadixSortTask<MortonCode>*>(tasks[0])->count();
+            }
+            uint32_t offset = 0;
+            for(int b = 0; b < sRadixBucketsNum; ++b) {
+                for(uint32_t i = 0; i < chunksNum; ++i) {
+                    RadixSortTask<MortonCode>* task = 
+                        static_cast<RadixSortTask<MortonCode>*>(tasks[i]);
+                    task->setOffset(b, offset);
+                    offset += task->getCount(b);
+                }
+            }
+            for(uint32_t i = 0; i < chunksNum; ++i) {
+                static_cast<RadixSortTask<MortonCode>*>(tasks[i])->setPass(
+                    shift, true);
+            }
+            if(parallel) {
+                runTasks(threadPool, tasks);
+            } else {
+                static_cast<RadixSortTask<MortonCode>*>(tasks[0])->scatter();
+            }
+            deleteTasks(tasks);
+            prims.swap(temp);
+        }
+    }
+
+    BVH::BVH(const PrimitiveList& primitives, int maxPrimitivesNum,
+        const std::string& splitMethod, int buildThreadsNum):
+        Aggregate(primitives),
+        mMaxPrimitivesNum(maxPrimitivesNum), mWidth(2),
+        mBuildThreadsNum(buildThreadsNum), mRebuildThreshold(1.5f),
+        mSpatialSplitBudget(0.3f), mQuantizeBits(0), mBenchmarkRaysNum(0),
+        mTreeletLayout(false), mVerbose(false), mAllTriangles(false),
+        mBuildCost(0.0f) {
+        init(splitMethod, NULL);
+    }
+
+    BVH::BVH(const PrimitiveList& primitives, const ParamSet& params,
+        ThreadPool* buildThreadPool):
+        Aggregate(primitives),
+        mMaxPrimitivesNum(params.getInt("max_primitives", 8)),
+        mWidth(params.getInt("width", 2)),
+        mBuildThreadsNum(params.getInt("build_thread_num", 0)),
+        mRebuildThreshold(params.getFloat("rebuild_threshold", 1.5f)),
+        mSpatialSplitBudget(params.getFloat("spatial_split_budget", 0.3f)),
+        mQuantizeBits(params.getInt("quantize_bits", 0)),
+        mBenchmarkRaysNum(params.getInt("benchmark_rays", 0)),
+        mTreeletLayout(params.getString("node_layout", "dfs") == "treelet"),
+        mVerbose(params.getBool("verbose")),
+        mAllTriangles(false), mBuildCost(0.0f),
+        mCacheDir(params.getString("cache_dir", "")) {
+        init(params.getString("split_method", "sah"), buildThreadPool);
+    }
+
+    void BVHBuildStats::add(const BVHBuildStats& stats) {
+        bvhsNum += stats.bvhsNum;
+        cachedNum += stats.cachedNum;
+        primitivesNum += stats.primitivesNum;
+        referencesNum += stats.referencesNum;
+        nodesNum += stats.nodesNum;
+        seconds += stats.seconds;
+    }
+
+    const BVHBuildStats& BVH::getBuildStats() const {
+        return mBuildStats;
+    }
+
+    void BVH::init(const std::string& splitMethod,
+        ThreadPool* buildThreadPool) {
+        // leaf primitive count is stored in 8 bits
+        mMaxPrimitivesNum = clamp(mMaxPrimitivesNum, 1, 255);
         if(splitMethod == "middle") {
             mSplitMethod = Middle;
         } else if(splitMethod == "equal_count") {
             mSplitMethod = EqualCount;
+        } else if(splitMethod == "sah") {
+            mSplitMethod = SAH;
+        } else if(splitMethod == "lbvh") {
+            mSplitMethod = LBVH;
+        } else if(splitMethod == "sbvh") {
+            mSplitMethod = SBVH;
         } else {
             mSplitMethod = EqualCount;
         }
-        // collect BVHPrimitiveInfo list for the recusive BVH construction
-        std::vector<BVHPrimitiveInfo> buildInfoList;
-        buildInfoList.reserve(mRefinedPrimitives.size());
-        for(size_t i = 0; i < mRefinedPrimitives.size(); ++i) {
-            BBox b = mRefinedPrimitives[i]->getAABB();
-            buildInfoList.push_back(BVHPrimitiveInfo(b, i));
-        } 
-        //buildDataSummary(buildInfoList);
-        PrimitiveList orderedPrims;
-        orderedPrims.reserve(mRefinedPrimitives.size());
-        mBVHNodes.reserve(2 * mRefinedPrimitives.size() - 1);
-        uint32_t offset = 0;
-        buildLinearBVH(buildInfoList, 0, buildInfoList.size(),
-            &offset, orderedPrims);
-        mRefinedPrimitives.swap(orderedPrims);
-        //compactSummary();
+        if(mWidth != 2 && mWidth != 4 && mWidth != 8) {
+            std::cerr << "unsupported bvh width " << mWidth << 
+                ", use binary bvh instead" << std::endl;
+            mWidth = 2;
+        }
+        mBuildThreadsNum = max(mBuildThreadsNum, 0);
+        mSpatialSplitBudget = max(mSpatialSplitBudget, 0.0f);
+        if(mQuantizeBits != 8 && mQuantizeBits != 16) {
+            mQuantizeBits = 0;
+        }
+        if(mQuantizeBits != 0 && mWidth != 2) {
+            std::cerr << "quantized bvh nodes only support width 2, " <<
+                "use full float bounds instead" << std::endl;
+            mQuantizeBits = 0;
+        }
+        mBenchmarkRaysNum = max(mBenchmarkRaysNum, 0);
+        if(mTreeletLayout && (mWidth != 2 || mQuantizeBits != 0)) {
+            std::cerr << "treelet node layout only supports width 2 " <<
+                "float nodes, use dfs layout instead" << std::endl;
+            mTreeletLayout = false;
+        }
+        build(buildThreadPool);
+    }
+
+    void BVH::build(ThreadPool* buildThreadPool) {
+        if(mRefinedPrimitives.size() == 0) {
+            return;
+        }
+        boost::posix_time::ptime buildStart = 
+            boost::posix_time::microsec_clock::local_time();
+        BVHNodeList().swap(mBVHNodes);
+        std::vector<QuantizedBVHNode<uint8_t> >().swap(mQuantized8Nodes);
+        std::vector<QuantizedBVHNode<uint16_t> >().swap(mQuantized16Nodes);
+        if(mSplitMethod == SBVH) {
+            removeDuplicatedReferences();
+        }
+        uint32_t primitivesNum = mRefinedPrimitives.size();
+        // small aggregates (instances, single mesh wrapper, area light
+        // shapes...) are not worth spinning up the worker threads
+        boost::scoped_ptr<ThreadPool> ownThreadPool;
+        ThreadPool* threadPool = NULL;
+        uint32_t subtreeTaskSize = 0;
+        if(primitivesNum > sMinSubtreeTaskSize) {
+            threadPool = buildThreadPool;
+            if(threadPool == NULL) {
+                ownThreadPool.reset(new ThreadPool(mBuildThreadsNum));
+                threadPool = ownThreadPool.get();
+            }
+            unsigned int coreNum = threadPool->getCoreNum();
+            if(coreNum > 1) {
+                subtreeTaskSize = max(primitivesNum / (4 * coreNum),
+                    sMinSubtreeTaskSize);
+            }
+        }
+        // triangles get tested 4 at a time in leaves, SAH takes this
+        // into account so it's willing to create larger leaves
+        mAllTriangles = true;
+        for(uint32_t i = 0; i < primitivesNum && mAllTriangles; ++i) {
+            Vector3 p0, p1, p2;
+            mAllTriangles = mRefinedPrimitives[i]->getTriangle(&p0, &p1, &p2);
+        }
+        // collect BVHPrimitiveInfo list for the recusive BVH construction
+        std::vector<BVHPrimitiveInfo> buildInfoList(primitivesNum);
+        if(threadPool && primitivesNum > sParallelPassSize) {
+            uint32_t chunksNum = getChunksNum(threadPool, 
+                primitivesNum);
+            std::vector<Task*> tasks;
+            for(uint32_t i = 0; i < chunksNum; ++i) {
+                tasks.push_back(new BVHInfoTask(mRefinedPrimitives, 
+                    buildInfoList, 
+                    chunkStart(0, primitivesNum, i, chunksNum),
+                    chunkStart(0, primitivesNum, i + 1, chunksNum)));
+            }
+            runTasks(threadPool, tasks);
+            deleteTasks(tasks);
+        } else {
+            for(uint32_t i = 0; i < primitivesNum; ++i) {
+                BBox b = mRefinedPrimitives[i]->getAABB();
+                buildInfoList[i] = BVHPrimitiveInfo(b, i);
+            } 
+        }
+        //buildDataSummary(buildInfoList);
+        // the tree only depends on the primitive bounds (and triangles for
+        // sbvh) and the build options, a cached one built from the same
+        // input can be reused
+        uint64_t cacheKey = 0;
+        bool cached = false;
+        if(!mCacheDir.empty()) {
+            cacheKey = computeCacheKey(buildInfoList);
+            cached = loadCache(cacheKey, buildInfoList);
+        }
+        if(!cached) {
+            if(mSplitMethod == SBVH) {
+                buildSBVH(buildInfoList);
+            } else if(mSplitMethod == LBVH) {
+                if(primitivesNum <= sMaxMorton30PrimitivesNum) {
+                    buildLBVH<uint32_t>(buildInfoList, threadPool);
+                } else {
+                    buildLBVH<uint64_t>(buildInfoList, threadPool);
+                }
+            } else {
+                buildRecursiveBVH(buildInfoList, threadPool, 
+                    subtreeTaskSize);
+            }
+            if(!mCacheDir.empty()) {
+                saveCache(cacheKey, buildInfoList);
+            }
+        }
+        // leaves cover continuous build data range in DFS order,
+        // spatial splits can put the same primitive in several leaves
+        uint32_t referencesNum = buildInfoList.size();
+        PrimitiveList orderedPrims(referencesNum);
+        for(uint32_t i = 0; i < referencesNum; ++i) {
+            uint32_t pIndex = buildInfoList[i].primitiveIndexNum;
+            orderedPrims[i] = mRefinedPrimitives[pIndex];
+        }
+        mRefinedPrimitives.swap(orderedPrims);
+        //compactSummary();
+        buildTrianglePacks();
+        computeRayFlags();
+        std::vector<Ray> benchmarkRays;
+        if(mBenchmarkRaysNum > 0) {
+            generateBenchmarkRays(benchmarkRays);
+        }
+        // seconds spent on benchmark in the middle of build
+        float benchmarkSeconds = 0.0f;
+        if(mTreeletLayout) {
+            // report the dfs layout to compare against
+            if(mBenchmarkRaysNum > 0) {
+                benchmarkSeconds += benchmarkTraversal("dfs", benchmarkRays);
+            }
+            reorderTreelets();
+        }
+        // the binary nodes are not needed anymore after collapsing
+        if(mWidth == 4) {
+            collapse(mQBVHNodes);
+            BVHNodeList().swap(mBVHNodes);
+        } else if(mWidth == 8) {
+            collapse(mOBVHNodes);
+            BVHNodeList().swap(mBVHNodes);
+        }
+        if(mQuantizeBits > 0) {
+            // report the full float nodes to compare against
+            if(mBenchmarkRaysNum > 0) {
+                benchmarkSeconds += benchmarkTraversal("float", benchmarkRays);
+            }
+            if(mQuantizeBits == 8) {
+                quantize(mQuantized8Nodes);
+            } else {
+                quantize(mQuantized16Nodes);
+            }
+            BVHNodeList().swap(mBVHNodes);
+        }
+        mBuildCost = computeSAHCost();
+        boost::posix_time::time_duration buildTime = 
+            boost::posix_time::microsec_clock::local_time() - buildStart;
+        size_t nodesNum = mWidth == 4 ? mQBVHNodes.size() :
+            (mWidth == 8 ? mOBVHNodes.size() : mBVHNodes.size());
+        if(mQuantizeBits == 8) {
+            nodesNum = mQuantized8Nodes.size();
+        } else if(mQuantizeBits == 16) {
+            nodesNum = mQuantized16Nodes.size();
+        }
+        mBuildStats = BVHBuildStats();
+        mBuildStats.bvhsNum = 1;
+        mBuildStats.cachedNum = cached ? 1 : 0;
+        mBuildStats.primitivesNum = primitivesNum;
+        mBuildStats.referencesNum = referencesNum;
+        mBuildStats.nodesNum = nodesNum;
+        mBuildStats.seconds =
+            0.001f * buildTime.total_milliseconds() - benchmarkSeconds;
+        if(mVerbose) {
+            std::cout << "bvh build: " << primitivesNum << " primitives ";
+            if(referencesNum != primitivesNum) {
+                std::cout << referencesNum << " references ";
+            }
+            std::cout << nodesNum << " nodes(width " << mWidth;
+            if(mQuantizeBits > 0) {
+                std::cout << ", " << mQuantizeBits << " bits";
+            }
+            std::cout << ") in " << mBuildStats.seconds << " seconds" <<
+                std::endl;
+        }
+        if(mBenchmarkRaysNum > 0) {
+            std::ostringstream layout;
+            layout << "width " << mWidth;
+            if(mQuantizeBits > 0) {
+                layout << " " << mQuantizeBits << " bits";
+            }
+            if(mTreeletLayout) {
+                layout << " treelet";
+            }
+            benchmarkTraversal(layout.str(), benchmarkRays);
+        }
+    }
+
+    void BVH::buildRecursiveBVH(std::vector<BVHPrimitiveInfo>& buildData,
+        ThreadPool* threadPool, uint32_t subtreeTaskSize) {
+        uint32_t primitivesNum = buildData.size();
+        // build the top of the tree here and defer the subtrees below
+        // subtreeTaskSize to tasks, each one building into its own
+        // node list that gets stitched back in DFS order afterward
+        BVHBuildState state(threadPool, subtreeTaskSize);
+        BVHNodeList topNodes;
+        topNodes.reserve(2 * primitivesNum - 1);
+        buildLinearBVH(buildData, 0, primitivesNum, 0, topNodes, &state);
+        if(state.subtrees.size() == 0) {
+            mBVHNodes.swap(topNodes);
+        } else {
+            std::vector<Task*> tasks;
+            for(size_t i = 0; i < state.subtrees.size(); ++i) {
+                tasks.push_back(new BVHSubtreeTask(this, buildData,
+                    state.subtrees[i]));
+            }
+            runTasks(threadPool, tasks);
+            deleteTasks(tasks);
+            mBVHNodes.reserve(2 * primitivesNum - 1);
+            flattenSubtrees(topNodes, 0, state);
+        }
+    }
+
+    template<typename MortonCode>
+    void BVH::buildLBVH(std::vector<BVHPrimitiveInfo>& buildData,
+        ThreadPool* threadPool) {
+        uint32_t primitivesNum = buildData.size();
+        BBox bbox;
+        BBox centersUnion;
+        computeBounds(buildData, 0, primitivesNum, threadPool,
+            &bbox, &centersUnion);
+        std::vector<MortonPrimitive<MortonCode> > mortonPrims(primitivesNum);
+        bool parallel = threadPool != NULL && 
+            primitivesNum > sParallelPassSize;
+        uint32_t chunksNum = parallel ? 
+            getChunksNum(threadPool, primitivesNum) : 1;
+        std::vector<Task*> tasks;
+        for(uint32_t i = 0; i < chunksNum; ++i) {
+            tasks.push_back(new MortonCodeTask<MortonCode>(buildData,
+                mortonPrims, centersUnion,
+                chunkStart(0, primitivesNum, i, chunksNum),
+                chunkStart(0, primitivesNum, i + 1, chunksNum)));
+        }
+        if(parallel) {
+            runTasks(threadPool, tasks);
+        } else {
+            static_cast<MortonCodeTask<MortonCode>*>(tasks[0])->encode();
+        }
+        deleteTasks(tasks);
+        radixSort(mortonPrims, threadPool);
+        // primitives along the morton curve end up in DFS leaf order
+        std::vector<BVHPrimitiveInfo> sortedData(primitivesNum);
+        for(uint32_t i = 0; i < primitivesNum; ++i) {
+            sortedData[i] = buildData[mortonPrims[i].index];
+        }
+        buildData.swap(sortedData);
+        mBVHNodes.reserve(2 * primitivesNum - 1);
+        emitLBVH(buildData, mortonPrims, 0, primitivesNum, 0,
+            3 * mortonBitsPerAxis<MortonCode>() - 1);
+    }
+
+    template<typename MortonCode>
+    uint32_t BVH::emitLBVH(const std::vector<BVHPrimitiveInfo>& buildData,
+        const std::vector<MortonPrimitive<MortonCode> >& mortonPrims,
+        uint32_t start, uint32_t end, uint32_t depth, int bitIndex) {
+        uint32_t primitivesNum = end - start;
+        // skip the bits all the primitives in range agree on
+        while(bitIndex >= 0 && 
+            ((mortonPrims[start].code ^ mortonPrims[end - 1].code) >> 
+            bitIndex & 1) == 0) {
+            --bitIndex;
+        }
+        uint32_t nodeOffset = mBVHNodes.size();
+        mBVHNodes.push_back(CompactBVHNode());
+        if(primitivesNum <= (uint32_t)mMaxPrimitivesNum) {
+            BBox bbox;
+            for(uint32_t i = start; i < end; ++i) {
+                bbox.expand(buildData[i].bbox);
+            }
+            initLeaf(mBVHNodes[nodeOffset], bbox, buildData, start, end);
+            return nodeOffset;
+        }
+        // split where the highest differing bit flips, or in the middle
+        // when the primitives share the same code or the tree gets too
+        // deep to afford another unbalanced split
+        uint32_t mid = (start + end) / 2;
+        int dim = 0;
+        if(bitIndex >= 0 && !mustBalance(depth, primitivesNum)) {
+            uint32_t lo = start;
+            uint32_t hi = end - 1;
+            while(lo + 1 < hi) {
+                uint32_t m = (lo + hi) / 2;
+                if((mortonPrims[m].code >> bitIndex) & 1) {
+                    hi = m;
+                } else {
+                    lo = m;
+                }
+            }
+            mid = hi;
+            dim = 2 - bitIndex % 3;
+        }
+        uint32_t firstChild = emitLBVH(buildData, mortonPrims, start, mid,
+            depth + 1, bitIndex - 1);
+        uint32_t secondChild = emitLBVH(buildData, mortonPrims, mid, end,
+            depth + 1, bitIndex - 1);
+        BBox bbox = mBVHNodes[firstChild].bbox;
+        bbox.expand(mBVHNodes[secondChild].bbox);
+        mBVHNodes[nodeOffset].initInteror(bbox, secondChild, dim);
+        return nodeOffset;
+    }
+
+    // spatial splits are only tried when the overlap of the object
+    // split children is larger than this fraction of the root area
+    static const float sSpatialSplitAlpha = 1e-5f;
+    static const int sSpatialBinsNum = 32;
+
+    struct BVHSpatialBuildState {
+        BVHSpatialBuildState(float area, uint32_t maxRefs):
+            rootArea(area), maxReferencesNum(maxRefs), referencesNum(0) {}
+        float rootArea;
+        uint32_t maxReferencesNum;
+        uint32_t referencesNum;
+        // leaf references in DFS order
+        std::vector<BVHPrimitiveInfo> orderedRefs;
+    };
+
+    struct SpatialBin {
+        SpatialBin(): enter(0), exit(0) {}
+        uint32_t enter;
+        uint32_t exit;
+        BBox bbox;
+    };
+
+    struct BVHSplitCandidate {
+        BVHSplitCandidate(): cost(INFINITY), dim(0), bucket(0),
+            position(0.0f), leftCount(0), rightCount(0) {}
+        float cost;
+        int dim;
+        int bucket;
+        float position;
+        uint32_t leftCount;
+        uint32_t rightCount;
+        BBox leftBox;
+        BBox rightBox;
+    };
+
+    static inline bool isEmpty(const BBox& b) {
+        return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || 
+            b.pMin.z > b.pMax.z;
+    }
+
+    static inline BBox intersectBBox(const BBox& a, const BBox& b) {
+        BBox result;
+        for(int i = 0; i < 3; ++i) {
+            result.pMin[i] = max(a.pMin[i], b.pMin[i]);
+            result.pMax[i] = min(a.pMax[i], b.pMax[i]);
+        }
+        return result;
+    }
+
+    void BVH::removeDuplicatedReferences() {
+        std::set<const Primitive*> visited;
+        PrimitiveList primitives;
+        primitives.reserve(mRefinedPrimitives.size());
+        for(size_t i = 0; i < mRefinedPrimitives.size(); ++i) {
+            if(visited.insert(mRefinedPrimitives[i]).second) {
+                primitives.push_back(mRefinedPrimitives[i]);
+            }
+        }
+        mRefinedPrimitives.swap(primitives);
+    }
+
+    // bounds of the part of the reference in between the planes
+    // axis dim = lo and hi, triangles get clipped exactly
+    static BBox clipReference(const BBox& refBox, const Vector3* triangle,
+        int dim, float lo, float hi) {
+        BBox b;
+        if(triangle) {
+            for(int i = 0; i < 3; ++i) {
+                const Vector3& v0 = triangle[i];
+                const Vector3& v1 = triangle[(i + 1) % 3];
+                float d0 = v0[dim];
+                float d1 = v1[dim];
+                if(lo <= d0 && d0 <= hi) {
+                    b.expand(v0);
+                }
+                float planes[2] = {lo, hi};
+                for(int p = 0; p < 2; ++p) {
+                    float d = planes[p];
+                    if((d0 < d && d < d1) || (d1 < d && d < d0)) {
+                        Vector3 t = v0 + ((d - d0) / (d1 - d0)) * (v1 - v0);
+                        t[dim] = d;
+                        b.expand(t);
+                    }
+                }
+            }
+        } else {
+            // no tighter way to clip a general primitive than its bounds
+            b = refBox;
+        }
+        b.pMin[dim] = max(b.pMin[dim], lo);
+        b.pMax[dim] = min(b.pMax[dim], hi);
+        // the reference might have been clipped by earlier splits
+        return intersectBBox(b, refBox);
+    }
+
+    void BVH::buildSBVH(std::vector<BVHPrimitiveInfo>& buildData) {
+        uint32_t primitivesNum = buildData.size();
+        BBox bbox;
+        for(uint32_t i = 0; i < primitivesNum; ++i) {
+            bbox.expand(buildData[i].bbox);
+        }
+        BVHSpatialBuildState state(bbox.surfaceArea(), (uint32_t)(
+            (1.0f + mSpatialSplitBudget) * primitivesNum));
+        state.referencesNum = primitivesNum;
+        state.orderedRefs.reserve(state.maxReferencesNum);
+        mBVHNodes.reserve(2 * state.maxReferencesNum - 1);
+        std::vector<BVHPrimitiveInfo> refs(buildData);
+        buildSpatialBVH(refs, 0, state);
+        buildData.swap(state.orderedRefs);
+    }
+
+    uint32_t BVH::buildSpatialBVH(std::vector<BVHPrimitiveInfo>& refs,
+        uint32_t depth, BVHSpatialBuildState& state) {
+        uint32_t nodeOffset = mBVHNodes.size();
+        mBVHNodes.push_back(CompactBVHNode());
+        uint32_t refsNum = refs.size();
+        BBox bbox;
+        BBox centersUnion;
+        computeBounds(refs, 0, refsNum, NULL, &bbox, &centersUnion);
+        float nodeArea = bbox.surfaceArea();
+        BVHSplitCandidate objectSplit;
+        BVHSplitCandidate spatialSplit;
+        bool balance = mustBalance(depth, refsNum);
+        if(refsNum > 1 && nodeArea > 0.0f && !balance) {
+            findObjectSplit(refs, centersUnion, nodeArea, &objectSplit);
+            // spatial split pays off when the object split children
+            // overlap, typically long thin triangles cross each other
+            float overlapArea = 0.0f;
+            if(objectSplit.cost < INFINITY) {
+                BBox overlap = intersectBBox(objectSplit.leftBox,
+                    objectSplit.rightBox);
+                overlapArea = isEmpty(overlap) ? 0.0f : overlap.surfaceArea();
+            }
+            if((objectSplit.cost == INFINITY ||
+                overlapArea > sSpatialSplitAlpha * state.rootArea) &&
+                state.referencesNum < state.maxReferencesNum) {
+                findSpatialSplit(refs, bbox, nodeArea, state, &spatialSplit);
+            }
+        }
+        float splitCost = min(objectSplit.cost, spatialSplit.cost);
+        if(refsNum == 1 || (refsNum <= (uint32_t)mMaxPrimitivesNum &&
+            (balance || intersectCost(refsNum) <= splitCost))) {
+            mBVHNodes[nodeOffset].initLeaf(bbox, state.orderedRefs.size(),
+                refsNum);
+            state.orderedRefs.insert(state.orderedRefs.end(), 
+                refs.begin(), refs.end());
+            return nodeOffset;
+        }
+        std::vector<BVHPrimitiveInfo> leftRefs;
+        std::vector<BVHPrimitiveInfo> rightRefs;
+        int dim = objectSplit.dim;
+        uint32_t referencesNum = state.referencesNum;
+        if(spatialSplit.cost < objectSplit.cost) {
+            splitSpatial(refs, spatialSplit, state, &leftRefs, &rightRefs);
+            dim = spatialSplit.dim;
+        }
+        // object split, or the spatial split ended up with all the
+        // references unsplit to one side
+        if(leftRefs.empty() || rightRefs.empty()) {
+            state.referencesNum = referencesNum;
+            dim = objectSplit.dim;
+            leftRefs.clear();
+            rightRefs.clear();
+            uint32_t mid;
+            if(objectSplit.cost < INFINITY) {
+                mid = std::partition(refs.begin(), refs.end(),
+                    BucketComparator(objectSplit.dim, objectSplit.bucket,
+                    centersUnion.pMin[objectSplit.dim], 
+                    1.0f / (centersUnion.pMax[objectSplit.dim] -
+                    centersUnion.pMin[objectSplit.dim]))) - refs.begin();
+            } else {
+                // no valid split candidate but too many references for
+                // a leaf, or too deep for an unbalanced split, fall back
+                // to equal count split
+                dim = centersUnion.longestAxis();
+                mid = refsNum / 2;
+                std::nth_element(refs.begin(), refs.begin() + mid,
+                    refs.end(), PointsComparator(dim));
+            }
+            leftRefs.assign(refs.begin(), refs.begin() + mid);
+            rightRefs.assign(refs.begin() + mid, refs.end());
+        }
+        // release the parent references before going down
+        std::vector<BVHPrimitiveInfo>().swap(refs);
+        buildSpatialBVH(leftRefs, depth + 1, state);
+        uint32_t secondChildOffset = buildSpatialBVH(rightRefs, depth + 1,
+            state);
+        mBVHNodes[nodeOffset].initInteror(bbox, secondChildOffset, dim);
+        return nodeOffset;
+    }
+
+    void BVH::findObjectSplit(const std::vector<BVHPrimitiveInfo>& refs,
+        const BBox& centersUnion, float nodeArea,
+        BVHSplitCandidate* split) const {
+        uint32_t refsNum = refs.size();
+        for(int dim = 0; dim < 3; ++dim) {
+            float axisStart = centersUnion.pMin[dim];
+            float axisLength = centersUnion.pMax[dim] - axisStart;
+            if(axisLength <= 0.0f) {
+                continue;
+            }
+            float invAxisLength = 1.0f / axisLength;
+            SAHBucket buckets[sSAHBucketsNum];
+            for(uint32_t i = 0; i < refsNum; ++i) {
+                int b = computeBucket(refs[i], dim, axisStart, 
+                    invAxisLength);
+                buckets[b].count++;
+                buckets[b].bbox.expand(refs[i].bbox);
+            }
+            BBox leftBoxes[sSAHBucketsNum - 1];
+            uint32_t leftCounts[sSAHBucketsNum - 1];
+            BBox leftBox;
+            uint32_t leftCount = 0;
+            for(int i = 0; i < sSAHBucketsNum - 1; ++i) {
+                leftBox.expand(buckets[i].bbox);
+                leftCount += buckets[i].count;
+                leftBoxes[i] = leftBox;
+                leftCounts[i] = leftCount;
+            }
+            BBox rightBox;
+            uint32_t rightCount = 0;
+            for(int i = sSAHBucketsNum - 1; i > 0; --i) {
+                rightBox.expand(buckets[i].bbox);
+                rightCount += buckets[i].count;
+                if(rightCount == 0 || rightCount == refsNum) {
+                    continue;
+                }
+                float cost = sTraversalCost + 
+                    (intersectCost(leftCounts[i - 1]) * 
+                    leftBoxes[i - 1].surfaceArea() +
+                    intersectCost(rightCount) * rightBox.surfaceArea()) /
+                    nodeArea;
+                if(cost < split->cost) {
+                    split->cost = cost;
+                    split->dim = dim;
+                    split->bucket = i - 1;
+                    split->leftCount = leftCounts[i - 1];
+                    split->rightCount = rightCount;
+                    split->leftBox = leftBoxes[i - 1];
+                    split->rightBox = rightBox;
+                }
+            }
+        }
+    }
+
+    void BVH::findSpatialSplit(const std::vector<BVHPrimitiveInfo>& refs,
+        const BBox& bbox, float nodeArea, const BVHSpatialBuildState& state,
+        BVHSplitCandidate* split) const {
+        uint32_t refsNum = refs.size();
+        for(int dim = 0; dim < 3; ++dim) {
+            float binStart = bbox.pMin[dim];
+            float binWidth = (bbox.pMax[dim] - binStart) / sSpatialBinsNum;
+            if(binWidth <= 0.0f) {
+                continue;
+            }
+            float invBinWidth = 1.0f / binWidth;
+            // chop each reference into the bins it overlaps, counting
+            // where it enters and exits for the sweep
+            SpatialBin bins[sSpatialBinsNum];
+            for(uint32_t i = 0; i < refsNum; ++i) {
+                const BVHPrimitiveInfo& ref = refs[i];
+                int first = clamp((int)((ref.bbox.pMin[dim] - binStart) *
+                    invBinWidth), 0, sSpatialBinsNum - 1);
+                int last = clamp((int)((ref.bbox.pMax[dim] - binStart) *
+                    invBinWidth), first, sSpatialBinsNum - 1);
+                Vector3 p[3];
+                const Vector3* triangle = mRefinedPrimitives[
+                    ref.primitiveIndexNum]->getTriangle(&p[0], &p[1], &p[2]) ?
+                    p : NULL;
+                for(int b = first; b <= last; ++b) {
+                    float lo = b == first ? -INFINITY : 
+                        binStart + b * binWidth;
+                    float hi = b == last ? INFINITY : 
+                        binStart + (b + 1) * binWidth;
+                    bins[b].bbox.expand(clipReference(ref.bbox, triangle, 
+                        dim, lo, hi));
+                }
+                bins[first].enter++;
+                bins[last].exit++;
+            }
+            BBox leftBoxes[sSpatialBinsNum - 1];
+            uint32_t leftCounts[sSpatialBinsNum - 1];
+            BBox leftBox;
+            uint32_t leftCount = 0;
+            for(int i = 0; i < sSpatialBinsNum - 1; ++i) {
+                leftBox.expand(bins[i].bbox);
+                leftCount += bins[i].enter;
+                leftBoxes[i] = leftBox;
+                leftCounts[i] = leftCount;
+            }
+            BBox rightBox;
+            uint32_t rightCount = 0;
+            for(int i = sSpatialBinsNum - 1; i > 0; --i) {
+                rightBox.expand(bins[i].bbox);
+                rightCount += bins[i].exit;
+                leftCount = leftCounts[i - 1];
+                if(leftCount == 0 || rightCount == 0) {
+                    continue;
+                }
+                // duplicated references have to fit in the budget
+                if(state.referencesNum + leftCount + rightCount - refsNum >
+                    state.maxReferencesNum) {
+                    continue;
+                }
+                float cost = sTraversalCost + 
+                    (intersectCost(leftCount) * 
+                    leftBoxes[i - 1].surfaceArea() +
+                    intersectCost(rightCount) * rightBox.surfaceArea()) /
+                    nodeArea;
+                if(cost < split->cost) {
+                    split->cost = cost;
+                    split->dim = dim;
+                    split->position = binStart + i * binWidth;
+                    split->leftCount = leftCount;
+                    split->rightCount = rightCount;
+                    split->leftBox = leftBoxes[i - 1];
+                    split->rightBox = rightBox;
+                }
+            }
+        }
+    }
+
+    void BVH::splitSpatial(const std::vector<BVHPrimitiveInfo>& refs,
+        const BVHSplitCandidate& split, BVHSpatialBuildState& state,
+        std::vector<BVHPrimitiveInfo>* leftRefs,
+        std::vector<BVHPrimitiveInfo>* rightRefs) const {
+        int dim = split.dim;
+        float position = split.position;
+        float leftArea = split.leftBox.surfaceArea();
+        float rightArea = split.rightBox.surfaceArea();
+        float leftCount = (float)split.leftCount;
+        float rightCount = (float)split.rightCount;
+        for(size_t i = 0; i < refs.size(); ++i) {
+            const BVHPrimitiveInfo& ref = refs[i];
+            if(ref.bbox.pMax[dim] <= position) {
+                leftRefs->push_back(ref);
+                continue;
+            } else if(ref.bbox.pMin[dim] >= position) {
+                rightRefs->push_back(ref);
+                continue;
+            }
+            Vector3 p[3];
+            const Vector3* triangle = mRefinedPrimitives[
+                ref.primitiveIndexNum]->getTriangle(&p[0], &p[1], &p[2]) ?
+                p : NULL;
+            BVHPrimitiveInfo left(clipReference(ref.bbox, triangle, dim,
+                -INFINITY, position), ref.primitiveIndexNum);
+            BVHPrimitiveInfo right(clipReference(ref.bbox, triangle, dim,
+                position, INFINITY), ref.primitiveIndexNum);
+            if(isEmpty(right.bbox)) {
+                leftRefs->push_back(ref);
+                continue;
+            } else if(isEmpty(left.bbox)) {
+                rightRefs->push_back(ref);
+                continue;
+            }
+            // reference unsplitting: keep the whole reference on one
+            // side when that costs less than the duplication
+            BBox leftUnion = split.leftBox;
+            leftUnion.expand(ref.bbox);
+            BBox rightUnion = split.rightBox;
+            rightUnion.expand(ref.bbox);
+            float splitCost = leftArea * leftCount + rightArea * rightCount;
+            float leftCost = leftUnion.surfaceArea() * leftCount +
+                rightArea * (rightCount - 1.0f);
+            float rightCost = leftArea * (leftCount - 1.0f) +
+                rightUnion.surfaceArea() * rightCount;
+            if(leftCost < splitCost && leftCost <= rightCost) {
+                leftRefs->push_back(ref);
+            } else if(rightCost < splitCost) {
+                rightRefs->push_back(ref);
+            } else {
+                leftRefs->push_back(left);
+                rightRefs->push_back(right);
+                state.referencesNum++;
+            }
+        }
+    }
+
+    BVH::~BVH() {}
+
+    static const char sCacheMagic[4] = {'G', 'B', 'V', 'H'};
+    // bump this whenever CompactBVHNode or the build algorithms change
+    static const uint32_t sCacheVersion = 3;
+
+    struct BVHCacheHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        uint32_t primitivesNum;
+        // more than primitivesNum with spatial splits
+        uint32_t referencesNum;
+        uint32_t nodesNum;
+    };
+
+    uint64_t BVH::computeCacheKey(
+        const std::vector<BVHPrimitiveInfo>& buildData) const {
+        uint32_t options[5] = {sCacheVersion, (uint32_t)buildData.size(),
+            (uint32_t)mSplitMethod, (uint32_t)mMaxPrimitivesNum, 
+            (uint32_t)mAllTriangles};
+        uint64_t key = hashBytes(options, sizeof(options), 
+            0xcbf29ce484222325ULL);
+        if(mSplitMethod == SBVH) {
+            key = hashBytes(&mSpatialSplitBudget, sizeof(float), key);
+        }
+        for(size_t i = 0; i < buildData.size(); ++i) {
+            const BBox& b = buildData[i].bbox;
+            float bounds[6] = {b.pMin.x, b.pMin.y, b.pMin.z,
+                b.pMax.x, b.pMax.y, b.pMax.z};
+            key = hashBytes(bounds, sizeof(bounds), key);
+        }
+        // spatial splits clip the triangles themselves, two meshes with
+        // the same bounds can still split differently
+        if(mSplitMethod == SBVH) {
+            for(size_t i = 0; i < mRefinedPrimitives.size(); ++i) {
+                Vector3 p[3];
+                if(mRefinedPrimitives[i]->getTriangle(&p[0], &p[1], &p[2])) {
+                    float vertices[9] = {p[0].x, p[0].y, p[0].z,
+                        p[1].x, p[1].y, p[1].z, p[2].x, p[2].y, p[2].z};
+                    key = hashBytes(vertices, sizeof(vertices), key);
+                }
+            }
+        }
+        return key;
+    }
+
+    std::string BVH::getCachePath(uint64_t key) const {
+        char filename[32];
+        sprintf(filename, "%016llx.bvh", (unsigned long long)key);
+        return (boost::filesystem::path(mCacheDir) / filename).string();
+    }
+
+    bool BVH::loadCache(uint64_t key, 
+        std::vector<BVHPrimitiveInfo>& buildData) {
+        std::string filename = getCachePath(key);
+        boost::system::error_code error;
+        if(!boost::filesystem::exists(filename, error)) {
+            return false;
+        }
+        uint32_t primitivesNum = buildData.size();
+        try {
+            using namespace boost::interprocess;
+            file_mapping file(filename.c_str(), read_only);
+            mapped_region region(file, read_only);
+            const char* data = static_cast<const char*>(
+                region.get_address());
+            size_t size = region.get_size();
+            BVHCacheHeader header;
+            if(size < sizeof(header)) {
+                return false;
+            }
+            memcpy(&header, data, sizeof(header));
+            size_t expectedSize = sizeof(header) + 
+                header.nodesNum * sizeof(CompactBVHNode) +
+                header.referencesNum * sizeof(uint32_t);
+            if(memcmp(header.magic, sCacheMagic, 4) != 0 ||
+                header.version != sCacheVersion || header.key != key ||
+                header.primitivesNum != primitivesNum || 
+                header.referencesNum < primitivesNum ||
+                header.nodesNum == 0 || size != expectedSize) {
+                std::cerr << "ignore mismatched bvh cache " << filename <<
+                    std::endl;
+                return false;
+            }
+            const CompactBVHNode* nodes = 
+                reinterpret_cast<const CompactBVHNode*>(data + 
+                sizeof(header));
+            const uint32_t* order = reinterpret_cast<const uint32_t*>(
+                nodes + header.nodesNum);
+            for(uint32_t i = 0; i < header.referencesNum; ++i) {
+                if(order[i] >= primitivesNum) {
+                    return false;
+                }
+            }
+            mBVHNodes.assign(nodes, nodes + header.nodesNum);
+            buildData.resize(header.referencesNum);
+            for(uint32_t i = 0; i < header.referencesNum; ++i) {
+                buildData[i].primitiveIndexNum = order[i];
+            }
+        } catch(const boost::interprocess::interprocess_exception& e) {
+            std::cerr << "failed to map bvh cache " << filename << ": " <<
+                e.what() << std::endl;
+            return false;
+        }
+        if(mVerbose) {
+            std::cout << "bvh cache: loaded " << filename << std::endl;
+        }
+        return true;
+    }
+
+    void BVH::saveCache(uint64_t key,
+        const std::vector<BVHPrimitiveInfo>& buildData) const {
+        std::string filename = getCachePath(key);
+        boost::system::error_code error;
+        boost::filesystem::create_directories(mCacheDir, error);
+        // write to a temp file then rename, so concurrent jobs sharing
+        // the cache never see a half written file
+        boost::filesystem::path tempPath = 
+            boost::filesystem::path(mCacheDir) / 
+            boost::filesystem::unique_path("%%%%%%%%.tmp");
+        std::ofstream out(tempPath.string().c_str(), std::ios::binary);
+        if(!out) {
+            std::cerr << "failed to write bvh cache " << filename <<
+                std::endl;
+            return;
+        }
+        BVHCacheHeader header;
+        memcpy(header.magic, sCacheMagic, 4);
+        header.version = sCacheVersion;
+        header.key = key;
+        header.primitivesNum = mRefinedPrimitives.size();
+        header.referencesNum = buildData.size();
+        header.nodesNum = mBVHNodes.size();
+        std::vector<uint32_t> order(buildData.size());
+        for(size_t i = 0; i < buildData.size(); ++i) {
+            order[i] = buildData[i].primitiveIndexNum;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&mBVHNodes[0]), 
+            mBVHNodes.size() * sizeof(CompactBVHNode));
+        out.write(reinterpret_cast<const char*>(&order[0]), 
+            order.size() * sizeof(uint32_t));
+        out.close();
+        if(!out) {
+            std::cerr << "failed to write bvh cache " << filename <<
+                std::endl;
+            boost::filesystem::remove(tempPath, error);
+            return;
+        }
+        boost::filesystem::rename(tempPath, filename, error);
+        if(error) {
+            boost::filesystem::remove(tempPath, error);
+        }
+    }
+
+    uint32_t BVH::buildLinearBVH(std::vector<BVHPrimitiveInfo> &buildData,
+        uint32_t start, uint32_t end, uint32_t depth, BVHNodeList& nodes,
+        BVHBuildState* state) const {
+        uint32_t nodeOffset = nodes.size();
+        nodes.push_back(CompactBVHNode());
+        uint32_t primitivesNum = end - start;
+        if(state && primitivesNum <= state->subtreeTaskSize) {
+            state->subtreeIndex[nodeOffset] = state->subtrees.size();
+            state->subtrees.push_back(new BVHSubtree(start, end, depth));
+            return nodeOffset;
+        }
+        ThreadPool* threadPool = state ? state->threadPool : NULL;
+
+        BBox bbox;
+        BBox centersUnion;
+        computeBounds(buildData, start, end, threadPool, 
+            &bbox, &centersUnion);
+        // leaf node case, SAH decides on its own whether it's worth
+        // to split when there are less than mMaxPrimitivesNum primitives
+        bool balance = mustBalance(depth, primitivesNum);
+        if(primitivesNum == 1 || ((mSplitMethod != SAH || balance) &&
+            primitivesNum <= (uint32_t)mMaxPrimitivesNum)) {
+            initLeaf(nodes[nodeOffset], bbox, buildData, start, end);
+        } else {
+            // pick the axis with largest variant to split
+            int dim = centersUnion.longestAxis();
+            // all primitives clutter in one point... should be a rare case
+            // just make this a leaf node then
+            if(centersUnion.pMin[dim] == centersUnion.pMax[dim]) {
+                initLeaf(nodes[nodeOffset], bbox, buildData, start, end);
+                return nodeOffset;
+            }
+            uint32_t mid = (start + end) / 2; 
+            // split interior node by specified split method, equal count
+            // once the tree gets too deep to afford an unbalanced split
+            switch (balance ? EqualCount : mSplitMethod) {
+            case SAH: {
+                if(!splitSAH(buildData, start, end, bbox, centersUnion,
+                    dim, threadPool, &mid)) {
+                    initLeaf(nodes[nodeOffset], bbox, buildData, 
+                        start, end);
+                    return nodeOffset;
+                }
+                // too many primitives for a leaf but no valid bucket 
+                // split, fall back to equal count split
+                if(start != mid && end != mid) {
+                    break;
+                }
+                mid = (start + end) / 2;
+                std::nth_element(&buildData[start], &buildData[mid],
+                    &buildData[end - 1] + 1, PointsComparator(dim));
+                break;
+            }
+            case Middle: {
+                float midPoint = 0.5f * (centersUnion.pMin[dim] +
+                    centersUnion.pMax[dim]);
+                mid = partitionBuildData(buildData, start, end,
+                    MidComparator(dim, midPoint), threadPool);
+                // can't split down further with middle method, let the 
+                // following split methods handle this case then
+                if(start!= mid && end != mid) {
+                    break;
+                }
+            }
+            case EqualCount: default: {
+                mid = (start + end) / 2;
+                std::nth_element(&buildData[start], &buildData[mid],
+                    &buildData[end - 1] + 1, PointsComparator(dim));
+                break;
+            }
+            }
+            //splitSummary(buildData, start, end, mid, dim);
+            buildLinearBVH(buildData, start, mid, depth + 1, nodes, state);
+            uint32_t secondChildOffset = buildLinearBVH(buildData, 
+                mid, end, depth + 1, nodes, state);
+            nodes[nodeOffset].initInteror(bbox, secondChildOffset, dim);
+        }
+        return nodeOffset;
+    }
+
+    uint32_t BVH::flattenSubtrees(const BVHNodeList& topNodes,
+        uint32_t topIndex, const BVHBuildState& state) {
+        uint32_t nodeOffset = mBVHNodes.size();
+        std::map<uint32_t, size_t>::const_iterator it = 
+            state.subtreeIndex.find(topIndex);
+        if(it != state.subtreeIndex.end()) {
+            // subtree nodes are in DFS order already, only need to
+            // relocate the second child offsets
+            const BVHNodeList& subtreeNodes = 
+                state.subtrees[it->second]->nodes;
+            for(size_t i = 0; i < subtreeNodes.size(); ++i) {
+                mBVHNodes.push_back(subtreeNodes[i]);
+                if(subtreeNodes[i].primitivesNum == 0) {
+                    mBVHNodes.back().secondChildOffset += nodeOffset;
+                }
+            }
+            return nodeOffset;
+        }
+        mBVHNodes.push_back(topNodes[topIndex]);
+        if(topNodes[topIndex].primitivesNum == 0) {
+            flattenSubtrees(topNodes, topIndex + 1, state);
+            uint32_t secondChildOffset = flattenSubtrees(topNodes,
+                topNodes[topIndex].secondChildOffset, state);
+            mBVHNodes[nodeOffset].secondChildOffset = secondChildOffset;
+        }
+        return nodeOffset;
+    }
+
+    // nodes of the treelet at the top of the tree that nearly every
+    // ray goes through, and of the treelets below it
+    static const uint32_t sTopTreeletNodesNum = 4096;
+    static const uint32_t sTreeletNodesNum = 64;
+
+    void BVH::reorderTreelets() {
+        uint32_t nodesNum = mBVHNodes.size();
+        if(nodesNum == 0) {
+            return;
+        }
+        BVHNodeList orderedNodes;
+        orderedNodes.reserve(nodesNum);
+        std::vector<uint32_t> newIndex(nodesNum);
+        std::vector<uint32_t> pendingRoots;
+        emitTreelet(0, sTopTreeletNodesNum, orderedNodes, newIndex,
+            pendingRoots);
+        // depth first over the treelets so the subtrees below the
+        // top treelet still end up in their own memory range
+        while(!pendingRoots.empty()) {
+            uint32_t rootNum = pendingRoots.back();
+            pendingRoots.pop_back();
+            emitTreelet(rootNum, sTreeletNodesNum, orderedNodes, newIndex,
+                pendingRoots);
+        }
+        for(uint32_t i = 0; i < nodesNum; ++i) {
+            CompactBVHNode& node = orderedNodes[i];
+            if(node.primitivesNum == 0) {
+                node.secondChildOffset = newIndex[node.secondChildOffset];
+            }
+        }
+        mBVHNodes.swap(orderedNodes);
+    }
+
+    void BVH::emitTreelet(uint32_t rootNum, uint32_t maxNodesNum,
+        BVHNodeList& orderedNodes, std::vector<uint32_t>& newIndex,
+        std::vector<uint32_t>& pendingRoots) const {
+        // chain heads with the largest surface area go first
+        std::priority_queue<std::pair<float, uint32_t> > heads;
+        heads.push(std::make_pair(mBVHNodes[rootNum].bbox.surfaceArea(),
+            rootNum));
+        uint32_t emittedNum = 0;
+        while(!heads.empty() && emittedNum < maxNodesNum) {
+            uint32_t nodeNum = heads.top().second;
+            heads.pop();
+            // the whole first child chain goes in one go,
+            // traversal expects the first child right after its parent
+            while(true) {
+                const CompactBVHNode& node = mBVHNodes[nodeNum];
+                newIndex[nodeNum] = orderedNodes.size();
+                orderedNodes.push_back(node);
+                emittedNum++;
+                if(node.primitivesNum > 0) {
+                    break;
+                }
+                heads.push(std::make_pair(
+                    mBVHNodes[node.secondChildOffset].bbox.surfaceArea(),
+                    node.secondChildOffset));
+                nodeNum = nodeNum + 1;
+            }
+        }
+        // heads left over root their own treelets, largest popped first
+        size_t first = pendingRoots.size();
+        while(!heads.empty()) {
+            pendingRoots.push_back(heads.top().second);
+            heads.pop();
+        }
+        std::reverse(pendingRoots.begin() + first, pendingRoots.end());
+    }
+
+    void BVH::initLeaf(CompactBVHNode& node, const BBox& bbox,
+        const std::vector<BVHPrimitiveInfo> &buildData,
+        uint32_t start, uint32_t end) const {
+        // leaves are laid out in DFS order so the ordered primitives
+        // of this leaf start at the same offset as its build data range
+        uint32_t firstPrimIndex = start;
+        uint32_t primitivesNum = end - start;
+        //leafSummary(buildData, start, end, firstPrimIndex, primitivesNum);
+        node.initLeaf(bbox, firstPrimIndex, primitivesNum);
+    }
+
+    float BVH::intersectCost(uint32_t primitivesNum) const {
+        return mAllTriangles ? 
+            (float)((primitivesNum + 3) / 4) : (float)primitivesNum;
+    }
+
+    bool BVH::splitSAH(std::vector<BVHPrimitiveInfo> &buildData,
+        uint32_t start, uint32_t end, const BBox& bbox,
+        const BBox& centersUnion, int dim, ThreadPool* threadPool,
+        uint32_t* mid) const {
+        uint32_t primitivesNum = end - start;
+        float totalArea = bbox.surfaceArea();
+        if(totalArea <= 0.0f) {
+            // degenerated bounding box, let equal count split handle it
+            *mid = start;
+            return true;
+        }
+        float axisStart = centersUnion.pMin[dim];
+        float invAxisLength = 1.0f / (centersUnion.pMax[dim] - axisStart);
+        SAHBucket buckets[sSAHBucketsNum];
+        if(threadPool == NULL || primitivesNum <= sParallelPassSize) {
+            for(uint32_t i = start; i < end; ++i) {
+                int b = computeBucket(buildData[i], dim, axisStart,
+                    invAxisLength);
+                buckets[b].count++;
+                buckets[b].bbox.expand(buildData[i].bbox);
+            }
+        } else {
+            uint32_t chunksNum = getChunksNum(threadPool, primitivesNum);
+            std::vector<Task*> tasks;
+            for(uint32_t i = 0; i < chunksNum; ++i) {
+                tasks.push_back(new BVHBinningTask(buildData,
+                    chunkStart(start, end, i, chunksNum),
+                    chunkStart(start, end, i + 1, chunksNum),
+                    dim, axisStart, invAxisLength));
+            }
+            runTasks(threadPool, tasks);
+            for(size_t i = 0; i < tasks.size(); ++i) {
+                BVHBinningTask* task = static_cast<BVHBinningTask*>(tasks[i]);
+                for(int b = 0; b < sSAHBucketsNum; ++b) {
+                    buckets[b].count += task->getBucket(b).count;
+                    buckets[b].bbox.expand(task->getBucket(b).bbox);
+                }
+            }
+            deleteTasks(tasks);
+        }
+        // sweep from both sides to get the area/count of the
+        // split candidate after bucket i
+        float leftCost[sSAHBucketsNum - 1];
+        BBox leftBox;
+        uint32_t leftCount = 0;
+        for(int i = 0; i < sSAHBucketsNum - 1; ++i) {
+            leftBox.expand(buckets[i].bbox);
+            leftCount += buckets[i].count;
+            leftCost[i] = leftCount == 0 ?
+                0.0f : intersectCost(leftCount) * leftBox.surfaceArea();
+        }
+        float minCost = INFINITY;
+        int minCostBucket = -1;
+        BBox rightBox;
+        uint32_t rightCount = 0;
+        for(int i = sSAHBucketsNum - 1; i > 0; --i) {
+            rightBox.expand(buckets[i].bbox);
+            rightCount += buckets[i].count;
+            if(rightCount == 0 || rightCount == primitivesNum) {
+                continue;
+            }
+            float cost = sTraversalCost + 
+                (leftCost[i - 1] + 
+                intersectCost(rightCount) * rightBox.surfaceArea()) /
+                totalArea;
+            if(cost < minCost) {
+                minCost = cost;
+                minCostBucket = i - 1;
+            }
+        }
+        // create leaf if we are allowed to and it's cheaper than split
+        float leafCost = intersectCost(primitivesNum);
+        if(minCostBucket == -1 || (primitivesNum <= 
+            (uint32_t)mMaxPrimitivesNum && leafCost <= minCost)) {
+            if(primitivesNum <= (uint32_t)mMaxPrimitivesNum) {
+                return false;
+            }
+            *mid = start;
+            return true;
+        }
+        *mid = partitionBuildData(buildData, start, end, 
+            BucketComparator(dim, minCostBucket, axisStart, invAxisLength),
+            threadPool);
+        return true;
+    }
+
+    // whether there might be primitives with all the ray mask bits
+    // set under the node with the rayFlags union
+    static inline bool matchRayFlags(uint32_t rayFlags, const Ray& ray) {
+        return (rayFlags & ray.mask) == ray.mask;
+    }
+
+    // same for a packet, a node missing a bit all the ray masks ask for
+    // has nothing for any of them. exact when the rays share one mask,
+    // packets mixing masks only cull on the bits they have in common
+    static inline bool matchRayFlags(uint32_t rayFlags,
+        const RayPacket& packet) {
+        return (rayFlags & packet.commonMask) == packet.commonMask;
+    }
+
+    // decode the quantized child bounds, see QuantizedBVHNode
+    template<typename T>
+    static inline BBox decodeBounds(const T q[6], const BBox& parent) {
+        const float invMaxQ = 1.0f / std::numeric_limits<T>::max();
+        BBox b;
+        for(int axis = 0; axis < 3; ++axis) {
+            float step = (parent.pMax[axis] - parent.pMin[axis]) * invMaxQ;
+            b.pMin[axis] = parent.pMin[axis] + q[axis] * step;
+            b.pMax[axis] = parent.pMax[axis] - q[3 + axis] * step;
+        }
+        return b;
+    }
+
+    // quantize b relative to parent rounding outward, return the decoded
+    // bounds that the children of b get encoded against in turn
+    template<typename T>
+    static inline BBox encodeBounds(const BBox& b, const BBox& parent,
+        T q[6]) {
+        const int maxQ = std::numeric_limits<T>::max();
+        const float invMaxQ = 1.0f / maxQ;
+        for(int axis = 0; axis < 3; ++axis) {
+            float step = (parent.pMax[axis] - parent.pMin[axis]) * invMaxQ;
+            int qMin = 0;
+            int qMax = 0;
+            if(step > 0.0f) {
+                qMin = clamp((int)floorf(
+                    (b.pMin[axis] - parent.pMin[axis]) / step), 0, maxQ);
+                qMax = clamp((int)floorf(
+                    (parent.pMax[axis] - b.pMax[axis]) / step), 0, maxQ);
+                // the decoded value can still end up inside b after
+                // float rounding, step outward until it doesn't
+                while(qMin > 0 && 
+                    parent.pMin[axis] + qMin * step > b.pMin[axis]) {
+                    --qMin;
+                }
+                while(qMax > 0 &&
+                    parent.pMax[axis] - qMax * step < b.pMax[axis]) {
+                    --qMax;
+                }
+            }
+            q[axis] = (T)qMin;
+            q[3 + axis] = (T)qMax;
+        }
+        return decodeBounds(q, parent);
+    }
+
+    // optimized version bbox/ray intersection test by precomputing
+    // invDir and using dirIsNeg indexing to avoid swap tMin/tMax
+    // if the ray direction is negative
+    static inline bool intersect(const BBox& bbox, const Ray& ray,
+        const Vector3& invDir, uint32_t dirIsNeg[3]) {
+        // intersect x tabs
+        float tMin = (bbox[dirIsNeg[0]].x - ray.o.x) * invDir.x;
+        float tMax = (bbox[1 - dirIsNeg[0]].x - ray.o.x) * invDir.x;
+        // intersect y tabs
+        float tYMin = (bbox[dirIsNeg[1]].y - ray.o.y) * invDir.y;
+        float tYMax = (bbox[1 - dirIsNeg[1]].y - ray.o.y) * invDir.y;
+        if(tYMax < tMin || tYMin > tMax) {
+            return false;
+        }
+        if(tYMin > tMin) {
+            tMin = tYMin;
+        }
+        if(tYMax < tMax) {
+            tMax = tYMax;
+        }
+        // intersect ztabs
+        float tZMin = (bbox[dirIsNeg[2]].z - ray.o.z) * invDir.z;
+        float tZMax = (bbox[1 - dirIsNeg[2]].z - ray.o.z) * invDir.z;
+        if(tZMax < tMin || tZMin > tMax) {
+            return false;
+        }
+        if(tZMin > tMin) {
+            tMin = tZMin;
+        }
+        if(tZMax < tMax) {
+            tMax = tZMax;
+        }
+
+        return (tMin < ray.maxt) && (tMax > ray.mint);
+    }
+
+    bool BVH::intersect(const Ray& ray, IntersectFilter f) const {
+        if(mWidth == 4) {
+            return intersectWide(mQBVHNodes, ray, f);
+        } else if(mWidth == 8) {
+            return intersectWide(mOBVHNodes, ray, f);
+        } else if(mQuantized8Nodes.size() > 0) {
+            return intersectQuantized(mQuantized8Nodes, ray, f);
+        } else if(mQuantized16Nodes.size() > 0) {
+            return intersectQuantized(mQuantized16Nodes, ray, f);
+        }
+        if(mBVHNodes.size() == 0) {
+            return false;
+        }
+        Vector3 invDir(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+        uint32_t dirIsNeg[3] = {
+            ray.d.x < 0.0f, 
+            ray.d.y < 0.0f, 
+            ray.d.z < 0.0f};
+        uint32_t nodeNum = 0;
+        uint32_t todoOffset = 0;
+        uint32_t todo[64];
+        while(true) {
+            const CompactBVHNode& node = mBVHNodes[nodeNum];
+            if(matchRayFlags(node.rayFlags, ray) &&
+                Goblin::intersect(node.bbox, ray, invDir, dirIsNeg)) {
+                if(node.primitivesNum > 0) {
+                    if(intersectLeaf(node.firstPrimIndex, 
+                        node.primitivesNum, ray, f)) {
+                        return true;
+                    }
+                    if(todoOffset == 0) {
+                        break;
+                    }
+                    nodeNum = todo[--todoOffset];
+                } else {
+                    if(dirIsNeg[node.axis]) {
+                        todo[todoOffset++] = nodeNum + 1;
+                        nodeNum = node.secondChildOffset;
+                    } else {
+                        todo[todoOffset++] = node.secondChildOffset;
+                        nodeNum = nodeNum + 1;
+                    }
+                }
+            } else {
+                if(todoOffset == 0) {
+                    break;
+                }
+                nodeNum = todo[--todoOffset];
+            }
+        }
+        return false;
+    }
+
+    bool BVH::intersect(const Ray& ray, float* epsilon, 
+        Intersection* intersection, IntersectFilter f) const {
+        if(mWidth == 4) {
+            return intersectWide(mQBVHNodes, ray, epsilon, intersection, f);
+        } else if(mWidth == 8) {
+            return intersectWide(mOBVHNodes, ray, epsilon, intersection, f);
+        } else if(mQuantized8Nodes.size() > 0) {
+            return intersectQuantized(mQuantized8Nodes, ray, epsilon,
+                intersection, f);
+        } else if(mQuantized16Nodes.size() > 0) {
+            return intersectQuantized(mQuantized16Nodes, ray, epsilon,
+                intersection, f);
+        }
+        if(mBVHNodes.size() == 0) {
+            return false;
+        }
+        Vector3 invDir(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+        uint32_t dirIsNeg[3] = {
+            ray.d.x < 0.0f, 
+            ray.d.y < 0.0f, 
+            ray.d.z < 0.0f};
+        uint32_t nodeNum = 0;
+        uint32_t todoOffset = 0;
+        uint32_t todo[64];
+        bool hit = false;
+        TriangleHit triangleHit;
+        while(true) {
+            const CompactBVHNode& node = mBVHNodes[nodeNum];
+            if(matchRayFlags(node.rayFlags, ray) &&
+                Goblin::intersect(node.bbox, ray, invDir, dirIsNeg)) {
+                if(node.primitivesNum > 0) {
+                    if(intersectLeaf(node.firstPrimIndex, node.primitivesNum,
+                        ray, epsilon, intersection, f, &triangleHit)) {
+                        hit = true;
+                    }
+                    if(todoOffset == 0) {
+                        break;
+                    }
+                    nodeNum = todo[--todoOffset];
+                } else {
+                    if(dirIsNeg[node.axis]) {
+                        todo[todoOffset++] = nodeNum + 1;
+                        nodeNum = node.secondChildOffset;
+                    } else {
+                        todo[todoOffset++] = node.secondChildOffset;
+                        nodeNum = nodeNum + 1;
+                    }
+                }
+            } else {
+                if(todoOffset == 0) {
+                    break;
+                }
+                nodeNum = todo[--todoOffset];
+            }
+        }
+        if(triangleHit.primitive && !computeTriangleHit(triangleHit, ray,
+            epsilon, intersection)) {
+            hit = false;
+        }
+        return hit;
+    }
+
+    template<int W>
+    static BBox getWorldAABB(const WideBVHNode<W>& node, 
+        const Transform& toWorld) {
+        BBox worldBound;
+        for(int i = 0; i < node.childrenNum; ++i) {
+            BBox b(Vector3(node.bounds[0][i], node.bounds[1][i], 
+                node.bounds[2][i]),
+                Vector3(node.bounds[3][i], node.bounds[4][i], 
+                node.bounds[5][i]));
+            worldBound.expand(toWorld.onBBox(b));
+        }
+        return worldBound;
+    }
+
+    template<typename T>
+    static BBox getWorldAABB(const QuantizedBVHNode<T>& node, 
+        const BBox& nodeBound, const Transform& toWorld) {
+        BBox worldBound;
+        for(int i = 0; i < node.childrenNum; ++i) {
+            worldBound.expand(toWorld.onBBox(
+                decodeBounds(node.bounds[i], nodeBound)));
+        }
+        return worldBound;
+    }
+
+    BBox BVH::getWorldAABB(const Transform& toWorld) const {
+        if(mWidth == 4 && mQBVHNodes.size() > 0) {
+            return Goblin::getWorldAABB(mQBVHNodes[0], toWorld);
+        } else if(mWidth == 8 && mOBVHNodes.size() > 0) {
+            return Goblin::getWorldAABB(mOBVHNodes[0], toWorld);
+        } else if(mQuantizeBits == 8 && mQuantized8Nodes.size() > 0) {
+            return Goblin::getWorldAABB(mQuantized8Nodes[0], 
+                mQuantizedBound, toWorld);
+        } else if(mQuantizeBits == 16 && mQuantized16Nodes.size() > 0) {
+            return Goblin::getWorldAABB(mQuantized16Nodes[0], 
+                mQuantizedBound, toWorld);
+        } else if(mWidth == 2 && mBVHNodes.size() > 0) {
+            return getWorldAABB(0, 3, toWorld);
+        }
+        return toWorld.onBBox(mAABB);
+    }
+
+    BBox BVH::getWorldAABB(uint32_t nodeNum, int depth, 
+        const Transform& toWorld) const {
+        const CompactBVHNode& node = mBVHNodes[nodeNum];
+        if(depth == 0 || node.primitivesNum > 0) {
+            return toWorld.onBBox(node.bbox);
+        }
+        BBox worldBound = getWorldAABB(nodeNum + 1, depth - 1, toWorld);
+        worldBound.expand(getWorldAABB(node.secondChildOffset, depth - 1,
+            toWorld));
+        return worldBound;
+    }
+
+    void BVH::computeRayFlags() {
+        mPrimitiveRayFlags.resize(mRefinedPrimitives.size());
+        for(size_t i = 0; i < mRefinedPrimitives.size(); ++i) {
+            mPrimitiveRayFlags[i] = mRefinedPrimitives[i]->getRayFlags();
+        }
+        mPrimitiveAlphaCoverages.clear();
+        for(size_t i = 0; i < mRefinedPrimitives.size(); ++i) {
+            uint64_t coverage = mRefinedPrimitives[i]->getAlphaCoverage();
+            if(coverage != 0 && mPrimitiveAlphaCoverages.empty()) {
+                mPrimitiveAlphaCoverages.resize(mRefinedPrimitives.size(), 0);
+            }
+            if(coverage != 0) {
+                mPrimitiveAlphaCoverages[i] = coverage;
+            }
+        }
+        // children always sit after their parent in DFS order
+        for(size_t n = mBVHNodes.size(); n-- > 0;) {
+            CompactBVHNode& node = mBVHNodes[n];
+            if(node.primitivesNum > 0) {
+                node.rayFlags = 0;
+                for(uint32_t i = 0; i < node.primitivesNum; ++i) {
+                    node.rayFlags |= 
+                        mPrimitiveRayFlags[node.firstPrimIndex + i];
+                }
+            } else {
+                node.rayFlags = mBVHNodes[n + 1].rayFlags |
+                    mBVHNodes[node.secondChildOffset].rayFlags;
+            }
+        }
+    }
+
+    void BVH::buildTrianglePacks() {
+        mTrianglePacks.clear();
+        mTrianglePacks.reserve(mRefinedPrimitives.size() / 2);
+        mLeafTrianglePacks.assign(mRefinedPrimitives.size(), sNoTrianglePack);
+        for(size_t n = 0; n < mBVHNodes.size(); ++n) {
+            const CompactBVHNode& node = mBVHNodes[n];
+            if(node.primitivesNum == 0) {
+                continue;
+            }
+            uint32_t packIndex = mTrianglePacks.size();
+            mTrianglePacks.resize(packIndex + (node.primitivesNum + 3) / 4);
+            if(fillTrianglePacks(node.firstPrimIndex, node.primitivesNum,
+                &mTrianglePacks[packIndex])) {
+                mLeafTrianglePacks[node.firstPrimIndex] = packIndex;
+            } else {
+                mTrianglePacks.resize(packIndex);
+            }
+        }
+    }
+
+    bool BVH::fillTrianglePacks(uint32_t firstPrimIndex, 
+        uint32_t primitivesNum, TrianglePack* packs) const {
+        for(uint32_t i = 0; i < primitivesNum; ++i) {
+            Vector3 p0, p1, p2;
+            if(!mRefinedPrimitives[firstPrimIndex + i]->getTriangle(
+                &p0, &p1, &p2)) {
+                return false;
+            }
+            // same edges as what Triangle::intersect computes
+            Vector3 e1 = p1 - p0;
+            Vector3 e2 = p2 - p0;
+            TrianglePack& pack = packs[i / 4];
+            for(int axis = 0; axis < 3; ++axis) {
+                pack.p0[axis][i % 4] = p0[axis];
+                pack.e1[axis][i % 4] = e1[axis];
+                pack.e2[axis][i % 4] = e2[axis];
+            }
+            pack.trianglesNum = i % 4 + 1;
+        }
+        // zero out the unused slots of the last pack
+        TrianglePack& last = packs[(primitivesNum - 1) / 4];
+        for(uint32_t i = last.trianglesNum; i < 4; ++i) {
+            for(int axis = 0; axis < 3; ++axis) {
+                last.p0[axis][i] = 0.0f;
+                last.e1[axis][i] = 0.0f;
+                last.e2[axis][i] = 0.0f;
+            }
+        }
+        return true;
+    }
+
+    bool BVH::refit() {
+        if(mRefinedPrimitives.size() == 0) {
+            return false;
+        }
+        boost::posix_time::ptime refitStart = 
+            boost::posix_time::microsec_clock::local_time();
+        if(mWidth == 4) {
+            mAABB = refitWide(mQBVHNodes, 0);
+        } else if(mWidth == 8) {
+            mAABB = refitWide(mOBVHNodes, 0);
+        } else if(mQuantizeBits == 8) {
+            std::vector<BBox> childBounds(2 * mQuantized8Nodes.size());
+            mQuantizedBound = refitQuantized(mQuantized8Nodes, 0, 
+                childBounds);
+            encodeQuantized(mQuantized8Nodes, 0, mQuantizedBound,
+                childBounds);
+            mAABB = mQuantizedBound;
+        } else if(mQuantizeBits == 16) {
+            std::vector<BBox> childBounds(2 * mQuantized16Nodes.size());
+            mQuantizedBound = refitQuantized(mQuantized16Nodes, 0, 
+                childBounds);
+            encodeQuantized(mQuantized16Nodes, 0, mQuantizedBound,
+                childBounds);
+            mAABB = mQuantizedBound;
+        } else {
+            // children always sit after their parent in DFS order,
+            // a backward sweep visits them before the parent
+            for(size_t n = mBVHNodes.size(); n-- > 0;) {
+                CompactBVHNode& node = mBVHNodes[n];
+                if(node.primitivesNum > 0) {
+                    node.bbox = refitLeaf(node.firstPrimIndex, 
+                        node.primitivesNum);
+                } else {
+                    node.bbox = mBVHNodes[n + 1].bbox;
+                    node.bbox.expand(mBVHNodes[node.secondChildOffset].bbox);
+                }
+            }
+            mAABB = mBVHNodes[0].bbox;
+        }
+        float cost = computeSAHCost();
+        boost::posix_time::time_duration refitTime = 
+            boost::posix_time::microsec_clock::local_time() - refitStart;
+        if(mVerbose) {
+            std::cout << "bvh refit: sah cost " << mBuildCost << " -> " << 
+                cost << " in " << 0.001f * refitTime.total_milliseconds() <<
+                " seconds" << std::endl;
+        }
+        // the topology built for the old primitive layout doesn't
+        // work well anymore, worth paying for a full rebuild
+        if(mBuildCost > 0.0f && cost > mRebuildThreshold * mBuildCost) {
+            if(mVerbose) {
+                std::cout << "bvh quality degraded over " << 
+                    mRebuildThreshold << "x, rebuild" << std::endl;
+            }
+            build();
+            return true;
+        }
+        return false;
+    }
+
+    BBox BVH::refitLeaf(uint32_t firstPrimIndex, 
+        uint32_t primitivesNum) {
+        BBox bbox;
+        for(uint32_t i = 0; i < primitivesNum; ++i) {
+            bbox.expand(mRefinedPrimitives[firstPrimIndex + i]->getAABB());
+        }
+        uint32_t packIndex = mLeafTrianglePacks[firstPrimIndex];
+        if(packIndex != sNoTrianglePack) {
+            fillTrianglePacks(firstPrimIndex, primitivesNum, 
+                &mTrianglePacks[packIndex]);
+        }
+        return bbox;
+    }
+
+    template<int W>
+    BBox BVH::refitWide(std::vector<WideBVHNode<W> >& wideNodes, 
+        uint32_t nodeNum) {
+        BBox nodeBound;
+        for(int i = 0; i < wideNodes[nodeNum].childrenNum; ++i) {
+            WideBVHNode<W>& node = wideNodes[nodeNum];
+            BBox b = node.primitivesNum[i] > 0 ?
+                refitLeaf(node.children[i], node.primitivesNum[i]) :
+                refitWide(wideNodes, node.children[i]);
+            for(int axis = 0; axis < 3; ++axis) {
+                node.bounds[axis][i] = b.pMin[axis];
+                node.bounds[3 + axis][i] = b.pMax[axis];
+            }
+            nodeBound.expand(b);
+        }
+        return nodeBound;
+    }
+
+    template<typename T>
+    BBox BVH::refitQuantized(
+        std::vector<QuantizedBVHNode<T> >& quantizedNodes, uint32_t nodeNum,
+        std::vector<BBox>& childBounds) {
+        // the child bounds are encoded relative to the parent, collect
+        // the real ones bottom up first and encode them top down after
+        BBox nodeBound;
+        for(int i = 0; i < quantizedNodes[nodeNum].childrenNum; ++i) {
+            const QuantizedBVHNode<T>& node = quantizedNodes[nodeNum];
+            BBox b = node.primitivesNum[i] > 0 ?
+                refitLeaf(node.children[i], node.primitivesNum[i]) :
+                refitQuantized(quantizedNodes, node.children[i], 
+                childBounds);
+            childBounds[2 * nodeNum + i] = b;
+            nodeBound.expand(b);
+        }
+        return nodeBound;
+    }
+
+    float BVH::computeSAHCost() const {
+        float rootArea = mAABB.surfaceArea();
+        if(rootArea <= 0.0f) {
+            return 0.0f;
+        }
+        float cost = 0.0f;
+        if(mWidth == 4) {
+            cost = computeSAHCost(mQBVHNodes, 0, mAABB);
+        } else if(mWidth == 8) {
+            cost = computeSAHCost(mOBVHNodes, 0, mAABB);
+        } else if(mQuantizeBits == 8) {
+            cost = computeSAHCost(mQuantized8Nodes, 0, mQuantizedBound);
+        } else if(mQuantizeBits == 16) {
+            cost = computeSAHCost(mQuantized16Nodes, 0, mQuantizedBound);
+        } else {
+            for(size_t n = 0; n < mBVHNodes.size(); ++n) {
+                const CompactBVHNode& node = mBVHNodes[n];
+                cost += node.bbox.surfaceArea() * (node.primitivesNum > 0 ?
+                    intersectCost(node.primitivesNum) : sTraversalCost);
+            }
+        }
+        return cost / rootArea;
+    }
+
+    template<int W>
+    float BVH::computeSAHCost(const std::vector<WideBVHNode<W> >& wideNodes,
+        uint32_t nodeNum, const BBox& nodeBound) const {
+        const WideBVHNode<W>& node = wideNodes[nodeNum];
+        float cost = sTraversalCost * nodeBound.surfaceArea();
+        for(int i = 0; i < node.childrenNum; ++i) {
+            BBox b(Vector3(node.bounds[0][i], node.bounds[1][i], 
+                node.bounds[2][i]),
+                Vector3(node.bounds[3][i], node.bounds[4][i], 
+                node.bounds[5][i]));
+            cost += node.primitivesNum[i] > 0 ?
+                intersectCost(node.primitivesNum[i]) * b.surfaceArea() :
+                computeSAHCost(wideNodes, node.children[i], b);
+        }
+        return cost;
+    }
+
+    template<typename T>
+    float BVH::computeSAHCost(
+        const std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+        uint32_t nodeNum, const BBox& nodeBound) const {
+        const QuantizedBVHNode<T>& node = quantizedNodes[nodeNum];
+        float cost = sTraversalCost * nodeBound.surfaceArea();
+        for(int i = 0; i < node.childrenNum; ++i) {
+            BBox b = decodeBounds(node.bounds[i], nodeBound);
+            cost += node.primitivesNum[i] > 0 ?
+                intersectCost(node.primitivesNum[i]) * b.surfaceArea() :
+                computeSAHCost(quantizedNodes, node.children[i], b);
+        }
+        return cost;
+    }
+
+    // SSE version of Triangle::intersect for the 4 triangles in pack.
+    // operations are done in the same order as the scalar version so
+    // both of them come up with the same hits and distances.
+    // return the hit mask and write the hit distances to tHit,
+    // barycentric coordinates to b1Hit b2Hit
+    static inline int intersectTrianglePack(const TrianglePack& pack,
+        const Ray& ray, float tHit[4], float b1Hit[4], float b2Hit[4]) {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 fEpsilon = _mm_set1_ps(1e-7f);
+        __m128 d[3] = {
+            _mm_set1_ps(ray.d.x), _mm_set1_ps(ray.d.y), _mm_set1_ps(ray.d.z)};
+        __m128 e1[3];
+        __m128 e2[3];
+        __m128 s[3];
+        for(int axis = 0; axis < 3; ++axis) {
+            e1[axis] = _mm_loadu_ps(pack.e1[axis]);
+            e2[axis] = _mm_loadu_ps(pack.e2[axis]);
+            s[axis] = _mm_sub_ps(_mm_set1_ps(ray.o[axis]), 
+                _mm_loadu_ps(pack.p0[axis]));
+        }
+        // s1 = cross(ray.d, e2)
+        __m128 s1[3] = {
+            _mm_sub_ps(_mm_mul_ps(d[1], e2[2]), _mm_mul_ps(d[2], e2[1])),
+            _mm_sub_ps(_mm_mul_ps(d[2], e2[0]), _mm_mul_ps(d[0], e2[2])),
+            _mm_sub_ps(_mm_mul_ps(d[0], e2[1]), _mm_mul_ps(d[1], e2[0]))};
+        __m128 divisor = _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(s1[0], e1[0]), _mm_mul_ps(s1[1], e1[1])),
+            _mm_mul_ps(s1[2], e1[2]));
+        __m128 invDivisor = _mm_div_ps(one, divisor);
+        __m128 b1 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(s[0], s1[0]), _mm_mul_ps(s[1], s1[1])),
+            _mm_mul_ps(s[2], s1[2])), invDivisor);
+        // s2 = cross(s, e1)
+        __m128 s2[3] = {
+            _mm_sub_ps(_mm_mul_ps(s[1], e1[2]), _mm_mul_ps(s[2], e1[1])),
+            _mm_sub_ps(_mm_mul_ps(s[2], e1[0]), _mm_mul_ps(s[0], e1[2])),
+            _mm_sub_ps(_mm_mul_ps(s[0], e1[1]), _mm_mul_ps(s[1], e1[0]))};
+        __m128 b2 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(d[0], s2[0]), _mm_mul_ps(d[1], s2[1])),
+            _mm_mul_ps(d[2], s2[2])), invDivisor);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(e2[0], s2[0]), _mm_mul_ps(e2[1], s2[1])),
+            _mm_mul_ps(e2[2], s2[2])), invDivisor);
+        __m128 miss = _mm_cmpeq_ps(divisor, zero);
+        miss = _mm_or_ps(miss, _mm_cmplt_ps(_mm_add_ps(b1, fEpsilon), zero));
+        miss = _mm_or_ps(miss, _mm_cmpgt_ps(_mm_sub_ps(b1, fEpsilon), one));
+        miss = _mm_or_ps(miss, _mm_cmplt_ps(_mm_add_ps(b2, fEpsilon), zero));
+        miss = _mm_or_ps(miss, _mm_cmpgt_ps(
+            _mm_sub_ps(_mm_add_ps(b1, b2), fEpsilon), one));
+        miss = _mm_or_ps(miss, _mm_cmplt_ps(t, _mm_set1_ps(ray.mint)));
+        miss = _mm_or_ps(miss, _mm_cmpgt_ps(t, _mm_set1_ps(ray.maxt)));
+        _mm_storeu_ps(tHit, t);
+        _mm_storeu_ps(b1Hit, b1);
+        _mm_storeu_ps(b2Hit, b2);
+        return ~_mm_movemask_ps(miss) & ((1 << pack.trianglesNum) - 1);
+    }
+
+    inline bool BVH::matchAlphaCoverage(uint32_t primIndex, 
+        float b1, float b2, const Ray& ray) const {
+        if(ray.mask == 0 || mPrimitiveAlphaCoverages.empty() ||
+            mPrimitiveAlphaCoverages[primIndex] == 0) {
+            return true;
+        }
+        uint32_t hitFlags = 
+            isAlphaCovered(mPrimitiveAlphaCoverages[primIndex], b1, b2) ?
+            RayFlagOpaque : RayFlagTransparent;
+        return matchRayFlags(hitFlags, ray);
+    }
+
+    bool BVH::intersectLeaf(uint32_t firstPrimIndex, uint32_t primitivesNum,
+        const Ray& ray, IntersectFilter f) const {
+        uint32_t packIndex = mLeafTrianglePacks[firstPrimIndex];
+        if(packIndex == sNoTrianglePack) {
+            for(uint32_t i = 0; i < primitivesNum; ++i) {
+                if(matchRayFlags(mPrimitiveRayFlags[firstPrimIndex + i], 
+                    ray) &&
+                    mRefinedPrimitives[firstPrimIndex + i]->intersect(ray, f)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        float tHit[4], b1Hit[4], b2Hit[4];
+        for(uint32_t i = 0; i < primitivesNum; i += 4) {
+            int hitMask = intersectTrianglePack(mTrianglePacks[packIndex++],
+                ray, tHit, b1Hit, b2Hit);
+            for(uint32_t j = 0; hitMask != 0; ++j, hitMask >>= 1) {
+                if((hitMask & 1) && 
+                    matchRayFlags(mPrimitiveRayFlags[firstPrimIndex + i + j],
+                    ray) && matchAlphaCoverage(firstPrimIndex + i + j,
+                    b1Hit[j], b2Hit[j], ray) && (f == NULL || 
+                    f(mRefinedPrimitives[firstPrimIndex + i + j], ray))) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool BVH::intersectLeaf(uint32_t firstPrimIndex, uint32_t primitivesNum,
+        const Ray& ray, float* epsilon, Intersection* intersection, 
+        IntersectFilter f, TriangleHit* triangleHit) const {
+        bool hit = false;
+        uint32_t packIndex = mLeafTrianglePacks[firstPrimIndex];
+        if(packIndex == sNoTrianglePack) {
+            for(uint32_t i = 0; i < primitivesNum; ++i) {
+                if(matchRayFlags(mPrimitiveRayFlags[firstPrimIndex + i], 
+                    ray) &&
+                    mRefinedPrimitives[firstPrimIndex + i]->intersect(ray, 
+                    epsilon, intersection, f)) {
+                    // intersection is filled in already
+                    triangleHit->primitive = NULL;
+                    hit = true;
+                }
+            }
+            return hit;
+        }
+        float tHit[4], b1Hit[4], b2Hit[4];
+        for(uint32_t i = 0; i < primitivesNum; i += 4) {
+            int hitMask = intersectTrianglePack(mTrianglePacks[packIndex++],
+                ray, tHit, b1Hit, b2Hit);
+            // walk through the hits in primitive order and only accept
+            // the ones not further than ray.maxt like the scalar loop does
+            for(uint32_t j = 0; hitMask != 0; ++j, hitMask >>= 1) {
+                const Primitive* p = mRefinedPrimitives[firstPrimIndex + i + j];
+                if((hitMask & 1) && tHit[j] <= ray.maxt &&
+                    matchRayFlags(mPrimitiveRayFlags[firstPrimIndex + i + j],
+                    ray) && matchAlphaCoverage(firstPrimIndex + i + j,
+                    b1Hit[j], b2Hit[j], ray) && (f == NULL || f(p, ray))) {
+                    ray.maxt = tHit[j];
+                    triangleHit->primitive = p;
+                    triangleHit->b1 = b1Hit[j];
+                    triangleHit->b2 = b2Hit[j];
+                    hit = true;
+                }
+            }
+        }
+        return hit;
     }
 
-    BVH::~BVH() {}
+    bool BVH::computeTriangleHit(const TriangleHit& triangleHit, 
+        const Ray& ray, float* epsilon, Intersection* intersection) const {
+        // ray.maxt is the hit distance already, the flags, alpha coverage
+        // and filter got checked by the leaf test
+        return triangleHit.primitive->getTriangleHit(ray, ray.maxt,
+            triangleHit.b1, triangleHit.b2, epsilon, intersection);
+    }
 
-    uint32_t BVH::buildLinearBVH(std::vector<BVHPrimitiveInfo> &buildData,
-        uint32_t start, uint32_t end, uint32_t* offset, 
-        PrimitiveList& orderedPrims) {
-        mBVHNodes.push_back(CompactBVHNode());
-        uint32_t nodeOffset = (*offset)++;
-        CompactBVHNode& node = mBVHNodes[nodeOffset];
 
-        BBox bbox;
-        for(uint32_t i = start; i < end; ++i) {
-            bbox.expand(buildData[i].bbox);
+    template<int W>
+    void BVH::collapse(std::vector<WideBVHNode<W> >& wideNodes) const {
+        wideNodes.clear();
+        if(mBVHNodes.size() == 0) {
+            return;
         }
-        uint32_t primitivesNum = end - start;
-        // leaf node case
-        if(primitivesNum == 1) {
-            int firstPrimIndex = orderedPrims.size();
-            //leafSummary(buildData, start, end, firstPrimIndex, primitivesNum);
-            for(uint32_t i = start; i < end; ++i) {
-                uint32_t pIndex = buildData[i].primitiveIndexNum;
-                orderedPrims.push_back(mRefinedPrimitives[pIndex]);
-            }
-            node.initLeaf(bbox, firstPrimIndex, primitivesNum);
+        wideNodes.reserve(mBVHNodes.size() / (W / 2) + 1);
+        collapseNode(0, wideNodes);
+    }
+
+    template<int W>
+    uint32_t BVH::collapseNode(uint32_t nodeNum,
+        std::vector<WideBVHNode<W> >& wideNodes) const {
+        uint32_t wideOffset = wideNodes.size();
+        wideNodes.push_back(WideBVHNode<W>());
+        // keep opening the interior child with largest surface area
+        // until the node is full or there are only leaves left
+        uint32_t children[W];
+        int childrenNum = 0;
+        const CompactBVHNode& root = mBVHNodes[nodeNum];
+        if(root.primitivesNum > 0) {
+            children[childrenNum++] = nodeNum;
         } else {
-            BBox centersUnion;
-            for(uint32_t i = start; i < end; ++i) {
-                centersUnion.expand(buildData[i].center);
+            children[childrenNum++] = nodeNum + 1;
+            children[childrenNum++] = root.secondChildOffset;
+        }
+        while(childrenNum < W) {
+            int maxAreaChild = -1;
+            float maxArea = -1.0f;
+            for(int i = 0; i < childrenNum; ++i) {
+                const CompactBVHNode& child = mBVHNodes[children[i]];
+                if(child.primitivesNum == 0 && 
+                    child.bbox.surfaceArea() > maxArea) {
+                    maxArea = child.bbox.surfaceArea();
+                    maxAreaChild = i;
+                }
             }
-            // pick the axis with largest variant to split
-            int dim = centersUnion.longestAxis();
-            // all primitives clutter in one point... should be a rare case
-            // just make this a leaf node then
-            if(centersUnion.pMin[dim] == centersUnion.pMax[dim]) {
-                uint32_t firstPrimIndex = orderedPrims.size();
-                //leafSummary(buildData, start, end, 
-                //    firstPrimIndex, primitivesNum);
-                for(uint32_t i = start; i < end; ++i) {
-                    uint32_t pIndex = buildData[i].primitiveIndexNum;
-                    orderedPrims.push_back(mRefinedPrimitives[pIndex]);
-                }
-                node.initLeaf(bbox, firstPrimIndex, primitivesNum);
-                return nodeOffset;
+            if(maxAreaChild == -1) {
+                break;
             }
-            uint32_t mid = (start + end) / 2; 
-            // split interior node by specified split method
-            switch (mSplitMethod) {
-            case Middle: {
-                float midPoint = 0.5f * (centersUnion.pMin[dim] +
-                    centersUnion.pMax[dim]);
-                BVHPrimitiveInfo* midPtr = std::partition(&buildData[start], 
-                    &buildData[end - 1] + 1, MidComparator(dim, midPoint));
-                mid = midPtr - &buildData[0];
-                // can't split down further with middle method, let the 
-                // following split methods handle this case then
-                if(start!= mid && end != mid) {
-                    break;
+            uint32_t opened = children[maxAreaChild];
+            children[maxAreaChild] = opened + 1;
+            children[childrenNum++] = mBVHNodes[opened].secondChildOffset;
+        }
+
+        WideBVHNode<W> node;
+        node.childrenNum = childrenNum;
+        for(int i = 0; i < W; ++i) {
+            // empty slot with inverted bounds never get hit
+            for(int axis = 0; axis < 3; ++axis) {
+                node.bounds[axis][i] = INFINITY;
+                node.bounds[3 + axis][i] = -INFINITY;
+            }
+            node.children[i] = 0;
+            node.primitivesNum[i] = 0;
+            node.rayFlags[i] = 0;
+        }
+        for(int i = 0; i < childrenNum; ++i) {
+            const CompactBVHNode& child = mBVHNodes[children[i]];
+            for(int axis = 0; axis < 3; ++axis) {
+                node.bounds[axis][i] = child.bbox.pMin[axis];
+                node.bounds[3 + axis][i] = child.bbox.pMax[axis];
+            }
+            node.rayFlags[i] = child.rayFlags;
+            if(child.primitivesNum > 0) {
+                node.children[i] = child.firstPrimIndex;
+                node.primitivesNum[i] = child.primitivesNum;
+            } else {
+                node.children[i] = collapseNode(children[i], wideNodes);
+            }
+        }
+        wideNodes[wideOffset] = node;
+        return wideOffset;
+    }
+
+    // test all the W children bounds against the ray, return the hit
+    // mask and write the entry distance of each child to tNear
+    template<int W>
+    static inline int intersectChildren(const WideBVHNode<W>& node,
+        const __m128 o[3], const __m128 invDir[3], 
+        const uint32_t dirIsNeg[3], const __m128& mint, const __m128& maxt,
+        float tNear[W]) {
+        int hitMask = 0;
+        for(int g = 0; g < W; g += 4) {
+            __m128 tMin = mint;
+            __m128 tMax = maxt;
+            for(int axis = 0; axis < 3; ++axis) {
+                __m128 nearPlane = _mm_loadu_ps(
+                    &node.bounds[dirIsNeg[axis] * 3 + axis][g]);
+                __m128 farPlane = _mm_loadu_ps(
+                    &node.bounds[(1 - dirIsNeg[axis]) * 3 + axis][g]);
+                tMin = _mm_max_ps(tMin, 
+                    _mm_mul_ps(_mm_sub_ps(nearPlane, o[axis]), invDir[axis]));
+                tMax = _mm_min_ps(tMax, 
+                    _mm_mul_ps(_mm_sub_ps(farPlane, o[axis]), invDir[axis]));
+            }
+            hitMask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << g;
+            _mm_storeu_ps(&tNear[g], tMin);
+        }
+        return hitMask;
+    }
+
+    struct WideBVHStackEntry {
+        uint32_t index;
+        uint32_t primitivesNum;
+        float tNear;
+    };
+
+    template<int W>
+    bool BVH::intersectWide(const std::vector<WideBVHNode<W> >& wideNodes,
+        const Ray& ray, IntersectFilter f) const {
+        if(wideNodes.size() == 0) {
+            return false;
+        }
+        __m128 o[3] = {
+            _mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y), _mm_set1_ps(ray.o.z)};
+        __m128 invDir[3] = {
+            _mm_set1_ps(1.0f / ray.d.x), 
+            _mm_set1_ps(1.0f / ray.d.y), 
+            _mm_set1_ps(1.0f / ray.d.z)};
+        uint32_t dirIsNeg[3] = {
+            ray.d.x < 0.0f, 
+            ray.d.y < 0.0f, 
+            ray.d.z < 0.0f};
+        __m128 mint = _mm_set1_ps(ray.mint);
+        __m128 maxt = _mm_set1_ps(ray.maxt);
+        float tNear[W];
+        uint32_t todoOffset = 0;
+        uint32_t todo[64 * W];
+        uint32_t nodeNum = 0;
+        while(true) {
+            const WideBVHNode<W>& node = wideNodes[nodeNum];
+            int hitMask = intersectChildren(node, o, invDir, dirIsNeg,
+                mint, maxt, tNear);
+            // any hit doesn't care about the order, intersect the leaves
+            // right away and push the interior children
+            for(int i = 0; i < node.childrenNum; ++i) {
+                if((hitMask & (1 << i)) == 0 || 
+                    !matchRayFlags(node.rayFlags[i], ray)) {
+                    continue;
+                }
+                if(node.primitivesNum[i] > 0) {
+                    if(intersectLeaf(node.children[i], node.primitivesNum[i],
+                        ray, f)) {
+                        return true;
+                    }
+                } else {
+                    todo[todoOffset++] = node.children[i];
                 }
             }
-            case EqualCount: default: {
-                mid = (start + end) / 2;
-                std::nth_element(&buildData[start], &buildData[mid],
-                    &buildData[end - 1] + 1, PointsComparator(dim));
+            if(todoOffset == 0) {
                 break;
             }
-            }
-            //splitSummary(buildData, start, end, mid, dim);
-            buildLinearBVH(buildData, 
-                start, mid, offset, orderedPrims);
-            uint32_t secondChildOffset = buildLinearBVH(buildData, 
-                mid, end, offset, orderedPrims);
-            node.initInteror(bbox, secondChildOffset, dim);
+            nodeNum = todo[--todoOffset];
         }
-        return nodeOffset;
+        return false;
     }
 
-    // optimized version bbox/ray intersection test by precomputing
-    // invDir and using dirIsNeg indexing to avoid swap tMin/tMax
-    // if the ray direction is negative
-    static inline bool intersect(const BBox& bbox, const Ray& ray,
-        const Vector3& invDir, uint32_t dirIsNeg[3]) {
-        // intersect x tabs
-        float tMin = (bbox[dirIsNeg[0]].x - ray.o.x) * invDir.x;
-        float tMax = (bbox[1 - dirIsNeg[0]].x - ray.o.x) * invDir.x;
-        // intersect y tabs
-        float tYMin = (bbox[dirIsNeg[1]].y - ray.o.y) * invDir.y;
-        float tYMax = (bbox[1 - dirIsNeg[1]].y - ray.o.y) * invDir.y;
-        if(tYMax < tMin || tYMin > tMax) {
+    template<int W>
+    bool BVH::intersectWide(const std::vector<WideBVHNode<W> >& wideNodes,
+        const Ray& ray, float* epsilon, Intersection* intersection,
+        IntersectFilter f) const {
+        if(wideNodes.size() == 0) {
             return false;
         }
-        if(tYMin > tMin) {
-            tMin = tYMin;
+        __m128 o[3] = {
+            _mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y), _mm_set1_ps(ray.o.z)};
+        __m128 invDir[3] = {
+            _mm_set1_ps(1.0f / ray.d.x), 
+            _mm_set1_ps(1.0f / ray.d.y), 
+            _mm_set1_ps(1.0f / ray.d.z)};
+        uint32_t dirIsNeg[3] = {
+            ray.d.x < 0.0f, 
+            ray.d.y < 0.0f, 
+            ray.d.z < 0.0f};
+        __m128 mint = _mm_set1_ps(ray.mint);
+        float tNear[W];
+        uint32_t todoOffset = 0;
+        WideBVHStackEntry todo[64 * W];
+        todo[todoOffset].index = 0;
+        todo[todoOffset].primitivesNum = 0;
+        todo[todoOffset].tNear = ray.mint;
+        todoOffset++;
+        bool hit = false;
+        TriangleHit triangleHit;
+        while(todoOffset > 0) {
+            WideBVHStackEntry entry = todo[--todoOffset];
+            // ray.maxt shrinks as we find closer hit
+            if(entry.tNear > ray.maxt) {
+                continue;
+            }
+            if(entry.primitivesNum > 0) {
+                if(intersectLeaf(entry.index, entry.primitivesNum, ray,
+                    epsilon, intersection, f, &triangleHit)) {
+                    hit = true;
+                }
+                continue;
+            }
+            const WideBVHNode<W>& node = wideNodes[entry.index];
+            int hitMask = intersectChildren(node, o, invDir, dirIsNeg,
+                mint, _mm_set1_ps(ray.maxt), tNear);
+            // push the hit children from far to near so the nearest
+            // one get popped first
+            uint32_t first = todoOffset;
+            for(int i = 0; i < node.childrenNum; ++i) {
+                if((hitMask & (1 << i)) == 0 || 
+                    !matchRayFlags(node.rayFlags[i], ray)) {
+                    continue;
+                }
+                WideBVHStackEntry child;
+                child.index = node.children[i];
+                child.primitivesNum = node.primitivesNum[i];
+                child.tNear = tNear[i];
+                uint32_t j = todoOffset++;
+                while(j > first && todo[j - 1].tNear < child.tNear) {
+                    todo[j] = todo[j - 1];
+                    --j;
+                }
+                todo[j] = child;
+            }
         }
-        if(tYMax < tMax) {
-            tMax = tYMax;
+        if(triangleHit.primitive && !computeTriangleHit(triangleHit, ray,
+            epsilon, intersection)) {
+            hit = false;
         }
-        // intersect ztabs
-        float tZMin = (bbox[dirIsNeg[2]].z - ray.o.z) * invDir.z;
-        float tZMax = (bbox[1 - dirIsNeg[2]].z - ray.o.z) * invDir.z;
-        if(tZMax < tMin || tZMin > tMax) {
-            return false;
+        return hit;
+    }
+
+    template<typename T>
+    void BVH::quantize(
+        std::vector<QuantizedBVHNode<T> >& quantizedNodes) {
+        quantizedNodes.clear();
+        if(mBVHNodes.size() == 0) {
+            return;
         }
-        if(tZMin > tMin) {
-            tMin = tZMin;
+        // only the interior nodes get stored, about half of the nodes
+        quantizedNodes.reserve(mBVHNodes.size() / 2 + 1);
+        std::vector<BBox> childBounds;
+        childBounds.reserve(mBVHNodes.size() + 1);
+        quantizeNode(0, quantizedNodes, childBounds);
+        mQuantizedBound = mBVHNodes[0].bbox;
+        encodeQuantized(quantizedNodes, 0, mQuantizedBound, childBounds);
+    }
+
+    template<typename T>
+    uint32_t BVH::quantizeNode(uint32_t nodeNum,
+        std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+        std::vector<BBox>& childBounds) const {
+        uint32_t quantizedOffset = quantizedNodes.size();
+        quantizedNodes.push_back(QuantizedBVHNode<T>());
+        childBounds.resize(2 * quantizedNodes.size());
+        QuantizedBVHNode<T> node;
+        memset(&node, 0, sizeof(node));
+        uint32_t children[2];
+        const CompactBVHNode& binaryNode = mBVHNodes[nodeNum];
+        if(binaryNode.primitivesNum > 0) {
+            // a single leaf tree still needs a root to hold the leaf
+            children[0] = nodeNum;
+            node.childrenNum = 1;
+        } else {
+            children[0] = nodeNum + 1;
+            children[1] = binaryNode.secondChildOffset;
+            node.childrenNum = 2;
+            node.axis = binaryNode.axis;
         }
-        if(tZMax < tMax) {
-            tMax = tZMax;
+        for(int i = 0; i < node.childrenNum; ++i) {
+            const CompactBVHNode& child = mBVHNodes[children[i]];
+            childBounds[2 * quantizedOffset + i] = child.bbox;
+            node.rayFlags[i] = child.rayFlags;
+            if(child.primitivesNum > 0) {
+                node.children[i] = child.firstPrimIndex;
+                node.primitivesNum[i] = child.primitivesNum;
+            } else {
+                node.children[i] = quantizeNode(children[i], 
+                    quantizedNodes, childBounds);
+            }
         }
+        quantizedNodes[quantizedOffset] = node;
+        return quantizedOffset;
+    }
 
-        return (tMin < ray.maxt) && (tMax > ray.mint);
+    template<typename T>
+    void BVH::encodeQuantized(
+        std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+        uint32_t nodeNum, const BBox& nodeBound,
+        const std::vector<BBox>& childBounds) const {
+        QuantizedBVHNode<T>& node = quantizedNodes[nodeNum];
+        for(int i = 0; i < node.childrenNum; ++i) {
+            BBox b = encodeBounds(childBounds[2 * nodeNum + i], nodeBound,
+                node.bounds[i]);
+            if(node.primitivesNum[i] == 0) {
+                encodeQuantized(quantizedNodes, node.children[i], b,
+                    childBounds);
+            }
+        }
     }
 
-    bool BVH::intersect(const Ray& ray, IntersectFilter f) const {
-        if(mBVHNodes.size() == 0) {
+    // interior node along with its decoded bounds, the children
+    // bounds can only be decoded with the parent ones at hand
+    struct QuantizedStackEntry {
+        uint32_t index;
+        BBox bound;
+    };
+
+    template<typename T>
+    bool BVH::intersectQuantized(
+        const std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+        const Ray& ray, IntersectFilter f) const {
+        if(quantizedNodes.size() == 0) {
             return false;
         }
         Vector3 invDir(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
@@ -183,45 +2700,46 @@ namespace Goblin {
             ray.d.x < 0.0f, 
             ray.d.y < 0.0f, 
             ray.d.z < 0.0f};
-        uint32_t nodeNum = 0;
         uint32_t todoOffset = 0;
-        uint32_t todo[64];
+        QuantizedStackEntry todo[64];
+        QuantizedStackEntry current;
+        current.index = 0;
+        current.bound = mQuantizedBound;
         while(true) {
-            const CompactBVHNode& node = mBVHNodes[nodeNum];
-            if(Goblin::intersect(node.bbox, ray, invDir, dirIsNeg)) {
-                if(node.primitivesNum > 0) {
-                    for(uint32_t i = 0; i < node.primitivesNum; ++i) {
-                        uint32_t index = node.firstPrimIndex + i;
-                        if(mRefinedPrimitives[index]->intersect(ray, f)) {
-                            return true;
-                        }
-                    }
-                    if(todoOffset == 0) {
-                        break;
+            const QuantizedBVHNode<T>& node = quantizedNodes[current.index];
+            for(int i = 0; i < node.childrenNum; ++i) {
+                if(!matchRayFlags(node.rayFlags[i], ray)) {
+                    continue;
+                }
+                BBox b = decodeBounds(node.bounds[i], current.bound);
+                if(!Goblin::intersect(b, ray, invDir, dirIsNeg)) {
+                    continue;
+                }
+                if(node.primitivesNum[i] > 0) {
+                    if(intersectLeaf(node.children[i], node.primitivesNum[i],
+                        ray, f)) {
+                        return true;
                     }
-                    nodeNum = todo[--todoOffset];
                 } else {
-                    if(dirIsNeg[node.axis]) {
-                        todo[todoOffset++] = nodeNum + 1;
-                        nodeNum = node.secondChildOffset;
-                    } else {
-                        todo[todoOffset++] = node.secondChildOffset;
-                        nodeNum = nodeNum + 1;
-                    }
-                }
-            } else {
-                if(todoOffset == 0) {
-                    break;
+                    todo[todoOffset].index = node.children[i];
+                    todo[todoOffset].bound = b;
+                    todoOffset++;
                 }
-                nodeNum = todo[--todoOffset];
             }
+            if(todoOffset == 0) {
+                break;
+            }
+            current = todo[--todoOffset];
         }
         return false;
     }
 
-    bool BVH::intersect(const Ray& ray, float* epsilon, 
-        Intersection* intersection, IntersectFilter f) const {
-        if(mBVHNodes.size() == 0) {
+    template<typename T>
+    bool BVH::intersectQuantized(
+        const std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+        const Ray& ray, float* epsilon, Intersection* intersection,
+        IntersectFilter f) const {
+        if(quantizedNodes.size() == 0) {
             return false;
         }
         Vector3 invDir(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
@@ -229,44 +2747,394 @@ namespace Goblin {
             ray.d.x < 0.0f, 
             ray.d.y < 0.0f, 
             ray.d.z < 0.0f};
-        uint32_t nodeNum = 0;
         uint32_t todoOffset = 0;
-        uint32_t todo[64];
+        QuantizedStackEntry todo[64];
+        QuantizedStackEntry current;
+        current.index = 0;
+        current.bound = mQuantizedBound;
         bool hit = false;
+        TriangleHit triangleHit;
         while(true) {
-            const CompactBVHNode& node = mBVHNodes[nodeNum];
-            if(Goblin::intersect(node.bbox, ray, invDir, dirIsNeg)) {
-                if(node.primitivesNum > 0) {
-                    for(uint32_t i = 0; i < node.primitivesNum; ++i) {
-                        uint32_t index = node.firstPrimIndex + i;
-                        if(mRefinedPrimitives[index]->intersect(ray, 
-                            epsilon, intersection, f)) {
-                            hit = true;
-                        }
-                    }
-                    if(todoOffset == 0) {
-                        break;
+            const QuantizedBVHNode<T>& node = quantizedNodes[current.index];
+            // visit the near child along the split axis first like
+            // the binary traversal does
+            int nearChild = node.childrenNum == 2 ? dirIsNeg[node.axis] : 0;
+            QuantizedStackEntry interiors[2];
+            int interiorsNum = 0;
+            for(int c = 0; c < node.childrenNum; ++c) {
+                int i = c ^ nearChild;
+                if(!matchRayFlags(node.rayFlags[i], ray)) {
+                    continue;
+                }
+                BBox b = decodeBounds(node.bounds[i], current.bound);
+                if(!Goblin::intersect(b, ray, invDir, dirIsNeg)) {
+                    continue;
+                }
+                if(node.primitivesNum[i] > 0) {
+                    if(intersectLeaf(node.children[i], node.primitivesNum[i],
+                        ray, epsilon, intersection, f, &triangleHit)) {
+                        hit = true;
                     }
-                    nodeNum = todo[--todoOffset];
                 } else {
-                    if(dirIsNeg[node.axis]) {
-                        todo[todoOffset++] = nodeNum + 1;
-                        nodeNum = node.secondChildOffset;
-                    } else {
-                        todo[todoOffset++] = node.secondChildOffset;
-                        nodeNum = nodeNum + 1;
+                    interiors[interiorsNum].index = node.children[i];
+                    interiors[interiorsNum].bound = b;
+                    interiorsNum++;
+                }
+            }
+            // push the far one first so the near one get popped first
+            while(interiorsNum > 0) {
+                todo[todoOffset++] = interiors[--interiorsNum];
+            }
+            if(todoOffset == 0) {
+                break;
+            }
+            current = todo[--todoOffset];
+        }
+        if(triangleHit.primitive && !computeTriangleHit(triangleHit, ray,
+            epsilon, intersection)) {
+            hit = false;
+        }
+        return hit;
+    }
+
+    // SSE slab test of the 4 rays in packet group g against bbox,
+    // return the 4 bit hit mask
+    static inline int intersectGroup(const BBox& bbox, 
+        const RayPacket& packet, int g) {
+        int i = 4 * g;
+        __m128 tMin = _mm_loadu_ps(&packet.mint[i]);
+        __m128 tMax = _mm_loadu_ps(&packet.maxt[i]);
+        const float* o[3] = {&packet.ox[i], &packet.oy[i], &packet.oz[i]};
+        const float* invDir[3] = 
+            {&packet.invDx[i], &packet.invDy[i], &packet.invDz[i]};
+        for(int axis = 0; axis < 3; ++axis) {
+            __m128 origin = _mm_loadu_ps(o[axis]);
+            __m128 inv = _mm_loadu_ps(invDir[axis]);
+            __m128 t0 = _mm_mul_ps(
+                _mm_sub_ps(_mm_set1_ps(bbox.pMin[axis]), origin), inv);
+            __m128 t1 = _mm_mul_ps(
+                _mm_sub_ps(_mm_set1_ps(bbox.pMax[axis]), origin), inv);
+            tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+            tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+        }
+        return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+    }
+
+    // interval arithmetic test of the whole packet against bbox,
+    // return true when none of the rays can possibly hit the bbox.
+    // axes with mixed direction signs are left out of the test
+    static inline bool cullPacket(const BBox& bbox, const RayPacket& packet) {
+        float tNear = packet.mintMin;
+        float tFar = INFINITY;
+        for(int axis = 0; axis < 3; ++axis) {
+            if(!packet.isCoherent[axis]) {
+                continue;
+            }
+            float nearPlane = bbox[packet.dirIsNeg[axis]][axis];
+            float farPlane = bbox[1 - packet.dirIsNeg[axis]][axis];
+            float invMin = packet.invDirMin[axis];
+            float invMax = packet.invDirMax[axis];
+            float n0 = nearPlane - packet.oMax[axis];
+            float n1 = nearPlane - packet.oMin[axis];
+            float nearMin = min(min(n0 * invMin, n0 * invMax),
+                min(n1 * invMin, n1 * invMax));
+            float f0 = farPlane - packet.oMax[axis];
+            float f1 = farPlane - packet.oMin[axis];
+            float farMax = max(max(f0 * invMin, f0 * invMax),
+                max(f1 * invMin, f1 * invMax));
+            tNear = max(tNear, nearMin);
+            tFar = min(tFar, farMax);
+        }
+        return tNear > tFar;
+    }
+
+    // find the first group from firstGroup that has active ray hitting
+    // bbox, return packet groups num if there isn't one
+    static inline int firstHitGroup(const BBox& bbox, 
+        const RayPacket& packet, uint64_t activeMask, int firstGroup) {
+        if(cullPacket(bbox, packet)) {
+            return packet.getGroupsNum();
+        }
+        for(int g = firstGroup; g < packet.getGroupsNum(); ++g) {
+            uint64_t groupMask = (activeMask >> (4 * g)) & 0xf;
+            if(groupMask && (intersectGroup(bbox, packet, g) & groupMask)) {
+                return g;
+            }
+        }
+        return packet.getGroupsNum();
+    }
+
+    static inline uint64_t hitMask(const BBox& bbox, const RayPacket& packet,
+        uint64_t activeMask, int firstGroup) {
+        uint64_t mask = 0;
+        for(int g = firstGroup; g < packet.getGroupsNum(); ++g) {
+            if((activeMask >> (4 * g)) & 0xf) {
+                mask |= (uint64_t)intersectGroup(bbox, packet, g) << (4 * g);
+            }
+        }
+        return mask & activeMask;
+    }
+
+    struct PacketStackEntry {
+        uint32_t nodeNum;
+        int firstGroup;
+    };
+
+    uint64_t BVH::intersectLeafPacket(uint32_t firstPrimIndex, 
+        uint32_t primitivesNum, const RayPacket& packet, uint64_t activeMask,
+        float* epsilons, Intersection* intersections, IntersectFilter f,
+        TriangleHit* triangleHits) const {
+        uint64_t hitMask = 0;
+        if(mLeafTrianglePacks[firstPrimIndex] == sNoTrianglePack) {
+            for(uint32_t i = 0; i < primitivesNum; ++i) {
+                if(!matchRayFlags(mPrimitiveRayFlags[firstPrimIndex + i],
+                    packet)) {
+                    continue;
+                }
+                hitMask |= mRefinedPrimitives[firstPrimIndex + i]->
+                    intersectPacket(packet, activeMask, epsilons, 
+                    intersections, f);
+            }
+            for(int i = 0; i < packet.getSize(); ++i) {
+                if(hitMask & ((uint64_t)1 << i)) {
+                    triangleHits[i].primitive = NULL;
+                }
+            }
+            return hitMask;
+        }
+        for(int g = 0; g < packet.getGroupsNum(); ++g) {
+            if(((activeMask >> (4 * g)) & 0xf) == 0) {
+                continue;
+            }
+            for(int i = 4 * g; i < 4 * g + 4; ++i) {
+                uint64_t rayBit = (uint64_t)1 << i;
+                if((activeMask & rayBit) && intersectLeaf(firstPrimIndex,
+                    primitivesNum, packet.getRay(i), &epsilons[i], 
+                    &intersections[i], f, &triangleHits[i])) {
+                    packet.updateMaxt(i);
+                    hitMask |= rayBit;
+                }
+            }
+        }
+        return hitMask;
+    }
+
+    uint64_t BVH::computeTriangleHits(const RayPacket& packet,
+        uint64_t hitMask, const TriangleHit* triangleHits, float* epsilons, 
+        Intersection* intersections) const {
+        for(int i = 0; i < packet.getSize(); ++i) {
+            uint64_t rayBit = (uint64_t)1 << i;
+            if((hitMask & rayBit) && triangleHits[i].primitive &&
+                !computeTriangleHit(triangleHits[i], packet.getRay(i),
+                &epsilons[i], &intersections[i])) {
+                hitMask &= ~rayBit;
+            }
+        }
+        return hitMask;
+    }
+
+    uint64_t BVH::intersectPacket(const RayPacket& packet, 
+        uint64_t activeMask, float* epsilons, 
+        Intersection* intersections, IntersectFilter f) const {
+        if(mWidth == 4) {
+            return intersectPacketWide(mQBVHNodes, packet, activeMask,
+                epsilons, intersections, f);
+        } else if(mWidth == 8) {
+            return intersectPacketWide(mOBVHNodes, packet, activeMask,
+                epsilons, intersections, f);
+        } else if(mQuantized8Nodes.size() > 0 || 
+            mQuantized16Nodes.size() > 0) {
+            // no packet traversal for the quantized layout, it's for
+            // scenes that are memory bound rather than ray bound
+            uint64_t hit = 0;
+            for(int i = 0; i < packet.getSize(); ++i) {
+                uint64_t rayBit = (uint64_t)1 << i;
+                if((activeMask & rayBit) && intersect(packet.getRay(i),
+                    &epsilons[i], &intersections[i], f)) {
+                    packet.updateMaxt(i);
+                    hit |= rayBit;
+                }
+            }
+            return hit;
+        }
+        if(mBVHNodes.size() == 0 || activeMask == 0) {
+            return 0;
+        }
+        uint64_t hit = 0;
+        TriangleHit triangleHits[RayPacket::MaxSize];
+        uint32_t todoOffset = 0;
+        PacketStackEntry todo[64];
+        PacketStackEntry current = {0, 0};
+        while(true) {
+            const CompactBVHNode& node = mBVHNodes[current.nodeNum];
+            int g = matchRayFlags(node.rayFlags, packet) ?
+                firstHitGroup(node.bbox, packet, activeMask,
+                current.firstGroup) : packet.getGroupsNum();
+            if(g < packet.getGroupsNum()) {
+                if(node.primitivesNum > 0) {
+                    uint64_t leafMask = hitMask(node.bbox, packet, 
+                        activeMask, g);
+                    hit |= intersectLeafPacket(node.firstPrimIndex, 
+                        node.primitivesNum, packet, leafMask, 
+                        epsilons, intersections, f, triangleHits);
+                } else {
+                    // the first active ray decides the traversal order
+                    int firstRay = 4 * g;
+                    while(((activeMask >> firstRay) & 1) == 0) {
+                        ++firstRay;
+                    }
+                    const Ray& ray = packet.getRay(firstRay);
+                    PacketStackEntry nearChild = {current.nodeNum + 1, g};
+                    PacketStackEntry farChild = {node.secondChildOffset, g};
+                    if(ray.d[node.axis] < 0.0f) {
+                        swap(nearChild, farChild);
                     }
+                    todo[todoOffset++] = farChild;
+                    current = nearChild;
+                    continue;
                 }
-            } else {
-                if(todoOffset == 0) {
-                    break;
+            }
+            if(todoOffset == 0) {
+                break;
+            }
+            current = todo[--todoOffset];
+        }
+        return computeTriangleHits(packet, hit, triangleHits, epsilons, 
+            intersections);
+    }
+
+    struct WidePacketStackEntry {
+        uint32_t index;
+        uint32_t primitivesNum;
+        int firstGroup;
+        float tNear;
+        // rays hitting the leaf bounds
+        uint64_t leafMask;
+    };
+
+    template<int W>
+    uint64_t BVH::intersectPacketWide(
+        const std::vector<WideBVHNode<W> >& wideNodes,
+        const RayPacket& packet, uint64_t activeMask, float* epsilons,
+        Intersection* intersections, IntersectFilter f) const {
+        if(wideNodes.size() == 0 || activeMask == 0) {
+            return 0;
+        }
+        uint64_t hit = 0;
+        TriangleHit triangleHits[RayPacket::MaxSize];
+        uint32_t todoOffset = 0;
+        WidePacketStackEntry todo[64 * W];
+        WidePacketStackEntry root = {0, 0, 0, 0.0f, 0};
+        todo[todoOffset++] = root;
+        float tNear[W];
+        while(todoOffset > 0) {
+            WidePacketStackEntry current = todo[--todoOffset];
+            if(current.primitivesNum > 0) {
+                hit |= intersectLeafPacket(current.index,
+                    current.primitivesNum, packet, current.leafMask,
+                    epsilons, intersections, f, triangleHits);
+                continue;
+            }
+            const WideBVHNode<W>& node = wideNodes[current.index];
+            // children are ordered by the entry distance of the
+            // first active ray in packet
+            int firstRay = 4 * current.firstGroup;
+            while(((activeMask >> firstRay) & 1) == 0) {
+                ++firstRay;
+            }
+            const Ray& ray = packet.getRay(firstRay);
+            __m128 o[3] = {_mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y),
+                _mm_set1_ps(ray.o.z)};
+            __m128 invDir[3] = {
+                _mm_set1_ps(packet.invDx[firstRay]),
+                _mm_set1_ps(packet.invDy[firstRay]), 
+                _mm_set1_ps(packet.invDz[firstRay])};
+            uint32_t dirIsNeg[3] = {
+                ray.d.x < 0.0f, ray.d.y < 0.0f, ray.d.z < 0.0f};
+            intersectChildren(node, o, invDir, dirIsNeg,
+                _mm_set1_ps(-INFINITY), _mm_set1_ps(INFINITY), tNear);
+            uint32_t first = todoOffset;
+            for(int i = 0; i < node.childrenNum; ++i) {
+                if(!matchRayFlags(node.rayFlags[i], packet)) {
+                    continue;
                 }
-                nodeNum = todo[--todoOffset];
+                BBox bbox(
+                    Vector3(node.bounds[0][i], node.bounds[1][i], 
+                    node.bounds[2][i]),
+                    Vector3(node.bounds[3][i], node.bounds[4][i], 
+                    node.bounds[5][i]));
+                int g = firstHitGroup(bbox, packet, activeMask, 
+                    current.firstGroup);
+                if(g == packet.getGroupsNum()) {
+                    continue;
+                }
+                WidePacketStackEntry child;
+                child.index = node.children[i];
+                child.primitivesNum = node.primitivesNum[i];
+                child.firstGroup = g;
+                child.tNear = tNear[i];
+                child.leafMask = child.primitivesNum > 0 ?
+                    hitMask(bbox, packet, activeMask, g) : 0;
+                uint32_t j = todoOffset++;
+                while(j > first && todo[j - 1].tNear < child.tNear) {
+                    todo[j] = todo[j - 1];
+                    --j;
+                }
+                todo[j] = child;
             }
         }
-        return hit;
+        return computeTriangleHits(packet, hit, triangleHits, epsilons, 
+            intersections);
+    }
+
+    size_t BVH::getNodesMemory() const {
+        return mBVHNodes.size() * sizeof(CompactBVHNode) +
+            mQBVHNodes.size() * sizeof(WideBVHNode<4>) +
+            mOBVHNodes.size() * sizeof(WideBVHNode<8>) +
+            mQuantized8Nodes.size() * sizeof(QuantizedBVHNode<uint8_t>) +
+            mQuantized16Nodes.size() * sizeof(QuantizedBVHNode<uint16_t>);
+    }
+
+    void BVH::generateBenchmarkRays(std::vector<Ray>& rays) const {
+        // incoherent rays starting all over the scene bounds, the access
+        // pattern secondary bounces end up with
+        RNG rng;
+        rays.resize(mBenchmarkRaysNum);
+        for(size_t i = 0; i < rays.size(); ++i) {
+            Vector3 o;
+            for(int axis = 0; axis < 3; ++axis) {
+                o[axis] = mAABB.pMin[axis] + rng.randomFloat() *
+                    (mAABB.pMax[axis] - mAABB.pMin[axis]);
+            }
+            Vector3 d = uniformSampleSphere(rng.randomFloat(), 
+                rng.randomFloat());
+            rays[i] = Ray(o, d, 0.0f);
+        }
     }
 
+    float BVH::benchmarkTraversal(
+        const std::string& layout, const std::vector<Ray>& rays) const {
+        boost::posix_time::ptime benchmarkStart = 
+            boost::posix_time::microsec_clock::local_time();
+        uint32_t hitsNum = 0;
+        for(size_t i = 0; i < rays.size(); ++i) {
+            Ray ray(rays[i]);
+            float epsilon;
+            Intersection intersection;
+            if(intersect(ray, &epsilon, &intersection, NULL)) {
+                hitsNum++;
+            }
+        }
+        boost::posix_time::time_duration benchmarkTime = 
+            boost::posix_time::microsec_clock::local_time() - benchmarkStart;
+        float seconds = 1e-6f * benchmarkTime.total_microseconds();
+        std::cout << "bvh benchmark(" << layout << "): " << rays.size() <<
+            " rays " << hitsNum << " hits in " << seconds << " seconds, " <<
+            (seconds > 0.0f ? 1e-6f * rays.size() / seconds : 0.0f) <<
+            " Mrays/s, nodes " << getNodesMemory() / 1024 << " KB" <<
+            std::endl;
+        return seconds;
+    }
 
     void BVH::buildDataSummary(
             const std::vector<BVHPrimitiveInfo> &buildData) const {
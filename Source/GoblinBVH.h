@@ -1,9 +1,16 @@
 #ifndef GOBLIN_BVH_H
 #define GOBLIN_BVH_H
 #include "GoblinPrimitive.h"
+#include <boost/align/aligned_allocator.hpp>
 namespace Goblin {
+    class ParamSet;
+    class ThreadPool;
     struct BVHPrimitiveInfo;
     struct BVHTreeNode;
+    struct BVHBuildState;
+    struct BVHSpatialBuildState;
+    struct BVHSplitCandidate;
+    template<typename MortonCode> struct MortonPrimitive;
 
     struct CompactBVHNode {
         BBox bbox;
@@ -13,7 +20,9 @@ namespace Goblin {
         };
         uint8_t primitivesNum;
         uint8_t axis;
-        uint8_t pad[2];
+        // union of the RayFlag bits of the primitives below
+        uint8_t rayFlags;
+        uint8_t pad;
         void initLeaf(const BBox& b, uint32_t first, uint8_t n) {
             bbox = b;
             firstPrimIndex = first;
@@ -28,20 +37,317 @@ namespace Goblin {
         }
     };
 
+    // nodes start on a cache line so each aligned pair of nodes,
+    // a parent and its first child most of the time, is one line
+    typedef std::vector<CompactBVHNode, 
+        boost::alignment::aligned_allocator<CompactBVHNode, 64> > 
+        BVHNodeList;
+
+    // wide node collapsed from the binary tree. child bounds are stored
+    // SoA as bounds[minmax * 3 + axis][child] so all the children can be
+    // tested against a ray in one go with SSE (two batches for 8 wide)
+    template<int W> struct WideBVHNode {
+        float bounds[6][W];
+        // interior child: wide node index, leaf child: first primitive index
+        uint32_t children[W];
+        // 0 for interior child
+        uint8_t primitivesNum[W];
+        // union of the RayFlag bits of the primitives below each child
+        uint8_t rayFlags[W];
+        uint8_t childrenNum;
+    };
+
+    // binary node with both children bounds quantized to T relative to
+    // the decoded bounds of the node itself, rounded outward so the
+    // decoded child bounds always enclose the real ones. pMin counts
+    // steps up from the parent pMin and pMax counts steps down from the
+    // parent pMax, both ends decode exactly. leaf children are stored
+    // in their parent so only interior nodes take up memory:
+    // 28 bytes per node for 8 bits and 40 bytes for 16 bits
+    template<typename T> struct QuantizedBVHNode {
+        // bounds[child][minmax * 3 + axis]
+        T bounds[2][6];
+        // interior child: node index, leaf child: first primitive index
+        uint32_t children[2];
+        // 0 for interior child
+        uint8_t primitivesNum[2];
+        uint8_t rayFlags[2];
+        uint8_t childrenNum;
+        uint8_t axis;
+    };
+
+    // up to 4 triangles of a leaf with vertex and edges precomputed,
+    // stored SoA as [axis][triangle] so they can be tested against
+    // a ray in one go with SSE. unused slots have zero edges
+    struct TrianglePack {
+        float p0[3][4];
+        float e1[3][4];
+        float e2[3][4];
+        uint32_t trianglesNum;
+    };
+
+    // closest hit of the SIMD triangle test, the intersection gets filled
+    // in from it once the traversal is done
+    struct TriangleHit {
+        TriangleHit(): primitive(NULL), b1(0.0f), b2(0.0f) {}
+        const Primitive* primitive;
+        float b1, b2;
+    };
+
+    // what building a BVH took, add them up to report the builds of a
+    // whole scene at once
+    struct BVHBuildStats {
+        BVHBuildStats(): bvhsNum(0), cachedNum(0), primitivesNum(0),
+            referencesNum(0), nodesNum(0), seconds(0.0f) {}
+        void add(const BVHBuildStats& stats);
+
+        uint32_t bvhsNum;
+        // the ones loaded from the cache_dir instead of built
+        uint32_t cachedNum;
+        uint64_t primitivesNum;
+        uint64_t referencesNum;
+        uint64_t nodesNum;
+        float seconds;
+    };
+
     class BVH : public Aggregate {
     public: 
         BVH(const PrimitiveList& primitives, int maxPrimitivesNum = 1,
-            const std::string& splitMethod = "middle");
+            const std::string& splitMethod = "middle",
+            int buildThreadsNum = 0);
+        // build with the options specified in scene file accelerator
+        // block: split_method(middle/equal_count/sah/lbvh/sbvh),
+        // spatial_split_budget(extra primitive references sbvh is
+        // allowed to create, 0.3 for 30% by default), max_primitives(8
+        // by default, the non sah methods make a leaf of any node with no
+        // more primitives than that, triangle leaves are tested 4 at a
+        // time with SSE),
+        // build_thread_num(0 for all the available cores),
+        // width(2 for binary, 4 or 8 for collapsed SIMD traversal),
+        // rebuild_threshold(see refit), cache_dir(directory to keep
+        // built trees in so later runs on the same input skip building),
+        // quantize_bits(0 for full float bounds, 8 or 16 to store the
+        // width 2 tree with quantized child bounds, less memory for a
+        // bit more traversal work), benchmark_rays(trace this many
+        // random rays after build and report the traversal speed and
+        // node memory, 0 to skip), node_layout(dfs by default, treelet
+        // to reorder the width 2 float nodes for cache locality),
+        // verbose(print a line for every build and refit, off by
+        // default, the scene loader reports the summary). builds big
+        // enough to go parallel run on buildThreadPool, NULL to spin up
+        // a pool of build_thread_num workers for this build only
+        BVH(const PrimitiveList& primitives, const ParamSet& params,
+            ThreadPool* buildThreadPool = NULL);
         ~BVH();
         bool intersect(const Ray& ray, IntersectFilter f) const; 
         bool intersect(const Ray& ray, float* epsilon, 
             Intersection* intersection, IntersectFilter f) const;
+        uint64_t intersectPacket(const RayPacket& packet,
+            uint64_t activeMask, float* epsilons,
+            Intersection* intersections, IntersectFilter f) const;
+        // union of the transformed bounds a few levels down the tree,
+        // much tighter than the transformed root bounds for rotated
+        // instances so the top level tree over them gets better quality
+        BBox getWorldAABB(const Transform& toWorld) const;
+        // recompute the node bounds bottom up from the current primitive
+        // bounds after vertices or instance transforms moved, without
+        // touching the tree topology. falls back to a full rebuild and
+        // return true if the SAH cost got worse than rebuild_threshold
+        // (1.5 by default) times the cost right after build
+        bool refit();
+        // the last build, rebuilds included
+        const BVHBuildStats& getBuildStats() const;
     private:
+        friend class BVHSubtreeTask;
+
+        void init(const std::string& splitMethod,
+            ThreadPool* buildThreadPool);
+        void build(ThreadPool* buildThreadPool = NULL);
+        // top down binned/partition build into mBVHNodes, subtrees
+        // get built in parallel by the thread pool
+        void buildRecursiveBVH(std::vector<BVHPrimitiveInfo>& buildData,
+            ThreadPool* threadPool, uint32_t subtreeTaskSize);
+        // linear BVH for fast preview builds: sort the primitive centers
+        // along the morton curve with parallel radix sort, then split
+        // each range where the highest differing morton bit flips
+        template<typename MortonCode> void buildLBVH(
+            std::vector<BVHPrimitiveInfo>& buildData, 
+            ThreadPool* threadPool);
+        // spatial split BVH: besides the binned object split, try to
+        // split the node space itself and clip the triangles straddling
+        // the plane to both sides. long thin triangles don't blow up
+        // the node overlap this way, at the cost of a slower build
+        // and one primitive getting referenced from several leaves
+        void buildSBVH(std::vector<BVHPrimitiveInfo>& buildData);
+        uint32_t buildSpatialBVH(std::vector<BVHPrimitiveInfo>& refs,
+            uint32_t depth, BVHSpatialBuildState& state);
+        void findObjectSplit(const std::vector<BVHPrimitiveInfo>& refs,
+            const BBox& centersUnion, float nodeArea,
+            BVHSplitCandidate* split) const;
+        void findSpatialSplit(const std::vector<BVHPrimitiveInfo>& refs,
+            const BBox& bbox, float nodeArea, 
+            const BVHSpatialBuildState& state,
+            BVHSplitCandidate* split) const;
+        void splitSpatial(const std::vector<BVHPrimitiveInfo>& refs,
+            const BVHSplitCandidate& split, BVHSpatialBuildState& state,
+            std::vector<BVHPrimitiveInfo>* leftRefs,
+            std::vector<BVHPrimitiveInfo>* rightRefs) const;
+        // mRefinedPrimitives holds the leaf references after a spatial
+        // split build, get the unique primitives back before rebuilding
+        void removeDuplicatedReferences();
+        // persistent tree cache in the cache_dir, keyed by the hash of
+        // the primitive bounds and the build options
+        uint64_t computeCacheKey(
+            const std::vector<BVHPrimitiveInfo>& buildData) const;
+        std::string getCachePath(uint64_t key) const;
+        // map the cached tree back to mBVHNodes and the build data
+        // primitive order, return false if there isn't a valid one
+        bool loadCache(uint64_t key, 
+            std::vector<BVHPrimitiveInfo>& buildData);
+        void saveCache(uint64_t key, 
+            const std::vector<BVHPrimitiveInfo>& buildData) const;
+        template<typename MortonCode> uint32_t emitLBVH(
+            const std::vector<BVHPrimitiveInfo>& buildData,
+            const std::vector<MortonPrimitive<MortonCode> >& mortonPrims,
+            uint32_t start, uint32_t end, uint32_t depth, int bitIndex);
+
         //the BVH we build is a flatten binary tree in DFS order, the node
-        //is defined as a compact 32byte class for cache line friendly access
+        //is defined as a compact 32byte class for cache line friendly access.
+        //when state is provided, subtrees below its task size are only
+        //reserved as placeholders and built later in parallel, depth is
+        //the level of the node built in the whole tree
         uint32_t buildLinearBVH(std::vector<BVHPrimitiveInfo> &buildData,
-            uint32_t start, uint32_t end, uint32_t* offset, 
-            PrimitiveList& orderedPrims);
+            uint32_t start, uint32_t end, uint32_t depth, BVHNodeList& nodes,
+            BVHBuildState* state) const;
+
+        // stitch top level nodes and the deferred subtrees into mBVHNodes
+        uint32_t flattenSubtrees(const BVHNodeList& topNodes,
+            uint32_t topIndex, const BVHBuildState& state);
+
+        void initLeaf(CompactBVHNode& node, const BBox& bbox,
+            const std::vector<BVHPrimitiveInfo> &buildData,
+            uint32_t start, uint32_t end) const;
+
+        // collapse the binary mBVHNodes to the wide node layout
+        template<int W> void collapse(
+            std::vector<WideBVHNode<W> >& wideNodes) const;
+        template<int W> uint32_t collapseNode(uint32_t nodeNum,
+            std::vector<WideBVHNode<W> >& wideNodes) const;
+        template<int W> bool intersectWide(
+            const std::vector<WideBVHNode<W> >& wideNodes,
+            const Ray& ray, IntersectFilter f) const;
+        template<int W> bool intersectWide(
+            const std::vector<WideBVHNode<W> >& wideNodes,
+            const Ray& ray, float* epsilon, 
+            Intersection* intersection, IntersectFilter f) const;
+        // reorder mBVHNodes into treelets: chains of first children
+        // stay contiguous so the first child is still right after its
+        // parent, and the chains get clustered by their chance of being
+        // visited (surface area) instead of the plain DFS order, so the
+        // nodes visited together by most rays share cache lines and pages
+        void reorderTreelets();
+        void emitTreelet(uint32_t rootNum, uint32_t maxNodesNum,
+            BVHNodeList& orderedNodes, std::vector<uint32_t>& newIndex,
+            std::vector<uint32_t>& pendingRoots) const;
+
+        // convert the binary mBVHNodes to the quantized node layout
+        template<typename T> void quantize(
+            std::vector<QuantizedBVHNode<T> >& quantizedNodes);
+        // node topology only, the real child bounds go to childBounds
+        // indexed by 2 * node index + child for encodeQuantized
+        template<typename T> uint32_t quantizeNode(uint32_t nodeNum,
+            std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+            std::vector<BBox>& childBounds) const;
+        template<typename T> void encodeQuantized(
+            std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+            uint32_t nodeNum, const BBox& nodeBound,
+            const std::vector<BBox>& childBounds) const;
+        template<typename T> bool intersectQuantized(
+            const std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+            const Ray& ray, IntersectFilter f) const;
+        template<typename T> bool intersectQuantized(
+            const std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+            const Ray& ray, float* epsilon, 
+            Intersection* intersection, IntersectFilter f) const;
+        template<int W> uint64_t intersectPacketWide(
+            const std::vector<WideBVHNode<W> >& wideNodes,
+            const RayPacket& packet, uint64_t activeMask, float* epsilons,
+            Intersection* intersections, IntersectFilter f) const;
+        uint64_t intersectLeafPacket(uint32_t firstPrimIndex, 
+            uint32_t primitivesNum, const RayPacket& packet,
+            uint64_t activeMask, float* epsilons,
+            Intersection* intersections, IntersectFilter f,
+            TriangleHit* triangleHits) const;
+
+        // gather the RayFlag bits of the primitives into
+        // mPrimitiveRayFlags and the union of them into mBVHNodes,
+        // alpha coverages into mPrimitiveAlphaCoverages
+        void computeRayFlags();
+        // whether the triangle pack hit at (b1, b2) of primitive 
+        // primIndex passes the ray mask
+        bool matchAlphaCoverage(uint32_t primIndex, float b1, float b2,
+            const Ray& ray) const;
+        // precompute the triangle packs for leaves that only
+        // contain triangles, have to be called after the primitives
+        // get reordered and before the binary nodes get collapsed
+        void buildTrianglePacks();
+        bool fillTrianglePacks(uint32_t firstPrimIndex, 
+            uint32_t primitivesNum, TrianglePack* packs) const;
+        bool intersectLeaf(uint32_t firstPrimIndex, uint32_t primitivesNum,
+            const Ray& ray, IntersectFilter f) const;
+        // closest hit test of the leaf. for triangle pack leaves only
+        // ray.maxt and triangleHit get updated, the fragment is computed
+        // once by computeTriangleHit after the traversal finished
+        bool intersectLeaf(uint32_t firstPrimIndex, uint32_t primitivesNum,
+            const Ray& ray, float* epsilon, Intersection* intersection, 
+            IntersectFilter f, TriangleHit* triangleHit) const;
+        // fill in the intersection from the SIMD hit, false (a miss)
+        // if the primitive can't, never the case for the triangles the
+        // packs were built from
+        bool computeTriangleHit(const TriangleHit& triangleHit, 
+            const Ray& ray, float* epsilon, 
+            Intersection* intersection) const;
+        // return hitMask without the rays computeTriangleHit failed on
+        uint64_t computeTriangleHits(const RayPacket& packet,
+            uint64_t hitMask, const TriangleHit* triangleHits,
+            float* epsilons, Intersection* intersections) const;
+
+        // binned surface area heuristic split, return false if
+        // creating a leaf is cheaper than any of the candidate splits
+        bool splitSAH(std::vector<BVHPrimitiveInfo> &buildData,
+            uint32_t start, uint32_t end, const BBox& bbox,
+            const BBox& centersUnion, int dim, ThreadPool* threadPool,
+            uint32_t* mid) const;
+
+        BBox getWorldAABB(uint32_t nodeNum, int depth,
+            const Transform& toWorld) const;
+
+        BBox refitLeaf(uint32_t firstPrimIndex, uint32_t primitivesNum);
+        template<int W> BBox refitWide(
+            std::vector<WideBVHNode<W> >& wideNodes, uint32_t nodeNum);
+        template<typename T> BBox refitQuantized(
+            std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+            uint32_t nodeNum, std::vector<BBox>& childBounds);
+        // SAH cost of the whole tree relative to the root area
+        float computeSAHCost() const;
+        template<int W> float computeSAHCost(
+            const std::vector<WideBVHNode<W> >& wideNodes,
+            uint32_t nodeNum, const BBox& nodeBound) const;
+        template<typename T> float computeSAHCost(
+            const std::vector<QuantizedBVHNode<T> >& quantizedNodes,
+            uint32_t nodeNum, const BBox& nodeBound) const;
+
+        // bytes taken by the nodes of the layout in use
+        size_t getNodesMemory() const;
+        // time closest hit traversal of the rays and log the speed
+        // along with the node memory of the current layout, return
+        // the seconds it took
+        float benchmarkTraversal(
+            const std::string& layout, const std::vector<Ray>& rays) const;
+        void generateBenchmarkRays(std::vector<Ray>& rays) const;
+
+        // relative cost of intersecting primitivesNum primitives in a leaf
+        float intersectCost(uint32_t primitivesNum) const;
 
         // these are all just temp debug logging, should find a better verify process
         void buildDataSummary(
@@ -55,11 +361,41 @@ namespace Goblin {
     private:
         enum SplitMethod {
             Middle, 
-            EqualCount
+            EqualCount,
+            SAH,
+            LBVH,
+            SBVH
         };
         int mMaxPrimitivesNum;
         SplitMethod mSplitMethod;
-        std::vector<CompactBVHNode> mBVHNodes;
+        int mWidth;
+        int mBuildThreadsNum;
+        float mRebuildThreshold;
+        float mSpatialSplitBudget;
+        int mQuantizeBits;
+        int mBenchmarkRaysNum;
+        bool mTreeletLayout;
+        bool mVerbose;
+        bool mAllTriangles;
+        float mBuildCost;
+        BVHBuildStats mBuildStats;
+        std::string mCacheDir;
+        BVHNodeList mBVHNodes;
+        std::vector<WideBVHNode<4> > mQBVHNodes;
+        std::vector<WideBVHNode<8> > mOBVHNodes;
+        std::vector<QuantizedBVHNode<uint8_t> > mQuantized8Nodes;
+        std::vector<QuantizedBVHNode<uint16_t> > mQuantized16Nodes;
+        // decoded bounds of the quantized root node
+        BBox mQuantizedBound;
+        std::vector<TrianglePack> mTrianglePacks;
+        // first triangle pack of the leaf indexed by its first primitive
+        // index, leaves with non triangle primitives don't have packs
+        std::vector<uint32_t> mLeafTrianglePacks;
+        // RayFlag bits of mRefinedPrimitives
+        std::vector<uint8_t> mPrimitiveRayFlags;
+        // alpha coverage of mRefinedPrimitives, empty if none of
+        // them has one
+        std::vector<uint64_t> mPrimitiveAlphaCoverages;
     };
 }
 
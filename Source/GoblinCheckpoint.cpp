@@ -0,0 +1,131 @@
+#include "GoblinCheckpoint.h"
+#include <boost/filesystem.hpp>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace Goblin {
+
+    static const char sCheckpointMagic[4] = {'G', 'B', 'C', 'P'};
+    static const uint32_t sCheckpointVersion = 3;
+
+    struct CheckpointHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t finishedSamples;
+        uint32_t hasFilm;
+        uint64_t sampleCount;
+        uint64_t extraSize;
+        uint64_t fingerprint;
+    };
+
+    Checkpoint::Checkpoint(const string& filename, bool resume,
+        uint64_t fingerprint):
+        mFilename(filename), mResume(resume), mFingerprint(fingerprint) {}
+
+    bool Checkpoint::save(const CheckpointState& state) const {
+        boost::filesystem::path path(mFilename);
+        boost::filesystem::path tempPath = path.parent_path() /
+            boost::filesystem::unique_path("%%%%%%%%.tmp");
+        std::ofstream out(tempPath.string().c_str(), std::ios::binary);
+        if(!out) {
+            std::cerr << "failed to write checkpoint " << mFilename <<
+                std::endl;
+            return false;
+        }
+        CheckpointHeader header;
+        memcpy(header.magic, sCheckpointMagic, 4);
+        header.version = sCheckpointVersion;
+        header.finishedSamples = state.finishedSamples;
+        header.hasFilm = !state.film.empty();
+        header.sampleCount = state.sampleCount;
+        header.extraSize = state.extra.size();
+        header.fingerprint = mFingerprint;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if(header.hasFilm) {
+            writeFilmState(out, state.film);
+        }
+        if(!state.extra.empty()) {
+            out.write(&state.extra[0], state.extra.size());
+        }
+        out.close();
+        boost::system::error_code error;
+        if(!out) {
+            std::cerr << "failed to write checkpoint " << mFilename <<
+                std::endl;
+            boost::filesystem::remove(tempPath, error);
+            return false;
+        }
+        boost::filesystem::rename(tempPath, path, error);
+        if(error) {
+            std::cerr << "failed to write checkpoint " << mFilename <<
+                ": " << error.message() << std::endl;
+            boost::filesystem::remove(tempPath, error);
+            return false;
+        }
+        return true;
+    }
+
+    bool Checkpoint::load(CheckpointState* state, int xRes,
+        int yRes) const {
+        std::ifstream in(mFilename.c_str(), std::ios::binary);
+        if(!in) {
+            return false;
+        }
+        // the sizes in the file are only trusted as far as the file goes
+        in.seekg(0, std::ios::end);
+        uint64_t bytesLeft = (uint64_t)in.tellg();
+        in.seekg(0, std::ios::beg);
+        if(bytesLeft < sizeof(CheckpointHeader)) {
+            std::cerr << "ignore truncated checkpoint " << mFilename <<
+                std::endl;
+            return false;
+        }
+        bytesLeft -= sizeof(CheckpointHeader);
+        CheckpointHeader header;
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if(!in || memcmp(header.magic, sCheckpointMagic, 4) != 0 ||
+            header.version != sCheckpointVersion) {
+            std::cerr << "ignore mismatched checkpoint " << mFilename <<
+                std::endl;
+            return false;
+        }
+        if(header.fingerprint != mFingerprint) {
+            std::cerr << "ignore checkpoint " << mFilename <<
+                " of a different scene" << std::endl;
+            return false;
+        }
+        FilmState film;
+        if(header.hasFilm) {
+            uint64_t filmBytes = 0;
+            if(!readFilmState(in, xRes, yRes, bytesLeft, &film,
+                &filmBytes)) {
+                std::cerr << "ignore checkpoint " << mFilename <<
+                    ", its film is truncated or not " << xRes << "x" <<
+                    yRes << std::endl;
+                return false;
+            }
+            bytesLeft -= filmBytes;
+        }
+        if(header.extraSize != bytesLeft) {
+            std::cerr << "ignore truncated checkpoint " << mFilename <<
+                std::endl;
+            return false;
+        }
+        vector<char> extra(header.extraSize);
+        if(!extra.empty()) {
+            in.read(&extra[0], extra.size());
+        }
+        if(!in || in.peek() != std::ifstream::traits_type::eof()) {
+            std::cerr << "ignore truncated checkpoint " << mFilename <<
+                std::endl;
+            return false;
+        }
+        state->finishedSamples = header.finishedSamples;
+        state->sampleCount = header.sampleCount;
+        state->film = film;
+        state->extra.swap(extra);
+        std::cout << "checkpoint: loaded " << mFilename << std::endl;
+        return true;
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef GOBLIN_CHECKPOINT_H
+#define GOBLIN_CHECKPOINT_H
+
+#include "GoblinFilm.h"
+#include "GoblinUtils.h"
+
+namespace Goblin {
+
+    // accumulation state of a render in progress, or of one part of a
+    // distributed render
+    struct CheckpointState {
+        CheckpointState(): finishedSamples(0), sampleCount(0) {}
+        // samples per pixel (iterations for SPPM) done so far
+        uint32_t finishedSamples;
+        // total samples for the splatting renderers, emitted photons
+        // for SPPM, normalization needs it on resume
+        uint64_t sampleCount;
+        // empty for renderers that rebuild the film from the extra data
+        FilmState film;
+        // renderer specific data, stored as is
+        vector<char> extra;
+    };
+
+    // binary snapshot of a render in progress, a preempted job resumes
+    // from it instead of starting over, g_ray --merge adds up the ones
+    // the parts of a distributed render leave behind. the file is only
+    // good for the same scene and renderer on a machine of the same
+    // endianness, the fingerprint of the scene is stored with it and
+    // files of another scene get rejected on load
+    class Checkpoint {
+    public:
+        Checkpoint(const string& filename = "", bool resume = false,
+            uint64_t fingerprint = 0);
+        bool isEnabled() const;
+        bool isResuming() const;
+        uint64_t getFingerprint() const;
+        // written to a temp file then renamed, a job killed while
+        // saving leaves the previous checkpoint intact
+        bool save(const CheckpointState& state) const;
+        // leaves state untouched when the file is missing or broken, or
+        // when its film is not xRes by yRes
+        bool load(CheckpointState* state, int xRes, int yRes) const;
+    private:
+        string mFilename;
+        bool mResume;
+        uint64_t mFingerprint;
+    };
+
+    inline bool Checkpoint::isEnabled() const {
+        return !mFilename.empty();
+    }
+
+    inline bool Checkpoint::isResuming() const {
+        return isEnabled() && mResume;
+    }
+
+    inline uint64_t Checkpoint::getFingerprint() const {
+        return mFingerprint;
+    }
+}
+
+#endif //GOBLIN_CHECKPOINT_H
@@ -12,9 +12,12 @@
 #include "GoblinRenderer.h"
 #include "GoblinSphere.h"
 #include "GoblinSPPM.h"
+#include "GoblinWavefrontPathtracer.h"
 #include "GoblinWhitted.h"
 #include "GoblinUtils.h"
 
+#include <iomanip>
+#include <sstream>
 
 namespace Goblin {
     static const size_t sDelimiterWidth = 75;
@@ -123,7 +126,8 @@ namespace Goblin {
         mPrimitiveFactory(
             new Factory<Primitive, const ParamSet&, const SceneCache&>()),
         mLightFactory(
-            new Factory<Light, const ParamSet&, const SceneCache&>()) {
+            new Factory<Light, const ParamSet&, const SceneCache&>()),
+        mSceneHash(0), mFrameHash(0), mLensInstance(NULL), mLensHash(0) {
 
         // filter
         mFilterFactory->registerCreator("box", new BoxFilterCreator);
@@ -147,6 +151,8 @@ namespace Goblin {
             new WhittedRendererCreator);
         mRendererFactory->registerCreator("path_tracing",
             new PathTracerCreator);
+        mRendererFactory->registerCreator("wavefront_path_tracing",
+            new WavefrontPathTracerCreator);
         mRendererFactory->registerCreator("light_tracing",
             new LightTracerCreator);
         mRendererFactory->registerCreator("bdpt",
@@ -223,6 +229,7 @@ namespace Goblin {
         pt.getChild("filter", &filterPt);
         ParamSet filterParams;
         parseParamSet(filterPt, &filterParams);
+        mFilterParams = filterParams;
         string type = filterParams.getString("type");
         cout << string(sDelimiterWidth, '-') << endl;
         return mFilterFactory->create(type, filterParams);
@@ -235,6 +242,7 @@ namespace Goblin {
         pt.getChild("film", &filmPt);
         ParamSet filmParams;
         parseParamSet(filmPt, &filmParams);
+        mFilmParams = filmParams;
         string type = filmParams.getString("type");
         cout << string(sDelimiterWidth, '-') << endl;
         return mFilmFactory->create(type, filmParams, filter);
@@ -248,6 +256,9 @@ namespace Goblin {
         pt.getChild("camera", &cameraPt);
         ParamSet cameraParams;
         parseParamSet(cameraPt, &cameraParams);
+        mCameraParams = cameraParams;
+        mLensInstance = NULL;
+        mLensHash = cameraParams.hash();
         string type = cameraParams.getString("type");
         // need to add lens into scene so that it can be intersected by
         // light particles
@@ -273,9 +284,10 @@ namespace Goblin {
             string modelName = type + "_lens_model";
             sceneCache->addPrimitive(modelName, model);
             cameraParams.setString("model" , modelName);
-            const Primitive* instance(mPrimitiveFactory->create("instance",
+            Primitive* instance(mPrimitiveFactory->create("instance",
                 cameraParams, *sceneCache));
             sceneCache->addInstance(instance);
+            mLensInstance = static_cast<InstancedPrimitive*>(instance);
         }
         cout << string(sDelimiterWidth, '-') << endl;
         return CameraPtr(mCameraFactory->create(type, cameraParams, film));
@@ -287,9 +299,54 @@ namespace Goblin {
         cout << string(sDelimiterWidth, '-') << endl;
         ParamSet setting;
         parseParamSet(settingPt, &setting);
-        string method = setting.getString("render_method", "path_tracing");
+        mSettingParams = setting;
         cout << string(sDelimiterWidth, '-') << endl;
-        return RendererPtr(mRendererFactory->create(method, setting));
+        return createRenderer(setting);
+    }
+
+    RendererPtr ContextLoader::createRenderer(const ParamSet& setting) {
+        string method = setting.getString("render_method", "path_tracing");
+        RendererPtr renderer(mRendererFactory->create(method, setting));
+        if(renderer) {
+            // seconds, zero for no deadline
+            float timeBudget = setting.getFloat("time_budget");
+            int passSamples = setting.getInt("pass_sample_per_pixel");
+            float writeInterval = setting.getFloat("write_interval");
+            int writePassInterval = setting.getInt("write_pass_interval");
+            float checkpointInterval =
+                setting.getFloat("checkpoint_interval");
+            renderer->setRenderBudget(RenderBudget(timeBudget, passSamples,
+                writeInterval, writePassInterval, checkpointInterval));
+        }
+        return renderer;
+    }
+
+    // render_setting keys that only decide how long the render goes on,
+    // a resumed job is free to change them
+    static const char* sProgressSettings[] = {"sample_per_pixel",
+        "thread_num", "time_budget", "pass_sample_per_pixel",
+        "write_interval", "write_pass_interval", "checkpoint",
+        "checkpoint_interval", "resume"};
+
+    Checkpoint ContextLoader::createCheckpoint(const ParamSet& setting,
+        const ParamSet& filterParams, const ParamSet& filmParams,
+        const ParamSet& cameraParams) const {
+        ParamSet sceneSetting(setting);
+        size_t keysNum = sizeof(sProgressSettings) / sizeof(const char*);
+        for(size_t i = 0; i < keysNum; ++i) {
+            sceneSetting.eraseBool(sProgressSettings[i]);
+            sceneSetting.eraseInt(sProgressSettings[i]);
+            sceneSetting.eraseFloat(sProgressSettings[i]);
+            sceneSetting.eraseString(sProgressSettings[i]);
+        }
+        ParamSet sceneFilm(filmParams);
+        sceneFilm.eraseString("file");
+        uint64_t hashes[6] = {mSceneHash, mFrameHash, sceneSetting.hash(),
+            filterParams.hash(), sceneFilm.hash(), cameraParams.hash()};
+        // picks up from the checkpoint file when resume is on and
+        // the file matches the scene
+        return Checkpoint(setting.getString("checkpoint"),
+            setting.getBool("resume"), hashBytes(hashes, sizeof(hashes)));
     }
 
     VolumeRegion* ContextLoader::parseVolume(const PropertyTree& pt) {
@@ -307,6 +364,25 @@ namespace Goblin {
         return mVolumeFactory->create(type, volumeParams);
     }
 
+    void ContextLoader::parseAccelerator(const PropertyTree& pt,
+        SceneCache* sceneCache) {
+        if(!pt.hasChild("accelerator")) {
+            return;
+        }
+        cout << "accelerator" << endl;
+        cout << string(sDelimiterWidth, '-') << endl;
+        PropertyTree acceleratorPt;
+        pt.getChild("accelerator", &acceleratorPt);
+        ParamSet acceleratorParams;
+        parseParamSet(acceleratorPt, &acceleratorParams);
+        if(acceleratorParams.hasString("cache_dir")) {
+            acceleratorParams.setString("cache_dir", sceneCache->resolvePath(
+                acceleratorParams.getString("cache_dir")));
+        }
+        sceneCache->setAcceleratorParams(acceleratorParams);
+        cout << string(sDelimiterWidth, '-') << endl;
+    }
+
     void ContextLoader::parseGeometry(const PropertyTree& pt, 
         SceneCache* sceneCache) {
         cout << "geometry" <<endl;
@@ -374,7 +450,7 @@ namespace Goblin {
         parseParamSet(pt, &primitiveParams);
         string type = primitiveParams.getString("type");
         string name = primitiveParams.getString("name");
-        const Primitive* primitive = mPrimitiveFactory->create(type, 
+        Primitive* primitive = mPrimitiveFactory->create(type, 
             primitiveParams, *sceneCache);
         sceneCache->addPrimitive(name, primitive);
         BBox bbox = primitive->getAABB();
@@ -383,6 +459,8 @@ namespace Goblin {
         cout << "BBox center: " << bbox.center() << endl;
         if(type == "instance") {
             sceneCache->addInstance(primitive);
+            mInstances[name] = static_cast<InstancedPrimitive*>(primitive);
+            mInstanceParams[name] = primitiveParams;
         }
         cout << string(sDelimiterWidth, '-') << endl;
     }
@@ -426,6 +504,125 @@ namespace Goblin {
         cout << string(sDelimiterWidth, '-') << endl;
     }
 
+    static void overrideParamSet(const PropertyTree& job, const char* key,
+        ParamSet* params) {
+        PropertyTree groupPt;
+        if(job.getChild(key, &groupPt)) {
+            cout << key << endl;
+            parseParamSet(groupPt, params);
+        }
+    }
+
+    bool ContextLoader::loadJob(const PropertyTree& job,
+        RenderContext* context) {
+        cout << "job" << endl;
+        return applyJob(job, -1, context);
+    }
+
+    int ContextLoader::getFramesNum() const {
+        return (int)mFrameNodes.size();
+    }
+
+    bool ContextLoader::loadFrame(int frameIndex, RenderContext* context) {
+        if(frameIndex < 0 || frameIndex >= getFramesNum()) {
+            return false;
+        }
+        cout << "frame " << frameIndex << endl;
+        const PropertyTree& frame = mFrameNodes[frameIndex].second;
+        map<string, ParamSet> transforms;
+        for(std::set<string>::const_iterator it = mMovedInstances.begin();
+            it != mMovedInstances.end(); ++it) {
+            transforms[*it] = mInstanceParams[*it];
+        }
+        std::set<string> movedInstances;
+        PtreeList instanceNodes;
+        frame.getChildren("instance", &instanceNodes);
+        for(size_t i = 0; i < instanceNodes.size(); ++i) {
+            string name = instanceNodes[i].second.parseString("string.name");
+            if(mInstances.find(name) == mInstances.end()) {
+                cerr << "frame " << frameIndex <<
+                    " moves unknown instance " << name << endl;
+                return false;
+            }
+            ParamSet params(mInstanceParams[name]);
+            parseParamSet(instanceNodes[i].second, &params);
+            transforms[name] = params;
+            movedInstances.insert(name);
+        }
+        mFrameHash = 0;
+        for(std::set<string>::const_iterator it = movedInstances.begin();
+            it != movedInstances.end(); ++it) {
+            uint64_t paramsHash = transforms[*it].hash();
+            mFrameHash = hashBytes(it->data(), it->size(), mFrameHash);
+            mFrameHash = hashBytes(&paramsHash, sizeof(paramsHash),
+                mFrameHash);
+        }
+        for(map<string, ParamSet>::const_iterator it = transforms.begin();
+            it != transforms.end(); ++it) {
+            mInstances[it->first]->setTransform(getTransform(it->second));
+        }
+        mMovedInstances.swap(movedInstances);
+        if(!transforms.empty()) {
+            // only the top level tree over the instances changes, the
+            // model BVHs below them are left alone
+            mAggregate->refit();
+        }
+        return applyJob(frame, frameIndex, context);
+    }
+
+    bool ContextLoader::applyJob(const PropertyTree& job, int frameIndex,
+        RenderContext* context) {
+        cout << string(sDelimiterWidth, '-') << endl;
+        ParamSet setting(mSettingParams);
+        overrideParamSet(job, "render_setting", &setting);
+        ParamSet filterParams(mFilterParams);
+        overrideParamSet(job, "filter", &filterParams);
+        ParamSet filmParams(mFilmParams);
+        overrideParamSet(job, "film", &filmParams);
+        if(frameIndex >= 0 && !job.hasChild("film.string.file")) {
+            path file(filmParams.getString("file", "goblin.png"));
+            std::ostringstream frameFile;
+            frameFile << file.stem().string() << "_" <<
+                std::setw(4) << std::setfill('0') << frameIndex <<
+                file.extension().string();
+            filmParams.setString("file",
+                (file.parent_path() / frameFile.str()).string());
+        }
+        ParamSet cameraParams(mCameraParams);
+        overrideParamSet(job, "camera", &cameraParams);
+        cout << string(sDelimiterWidth, '-') << endl;
+        if(cameraParams.getFloat("lens_radius") !=
+            mCameraParams.getFloat("lens_radius")) {
+            // the lens disk light particles hit got built on load
+            cerr << "a job can't change the camera lens_radius" << endl;
+            return false;
+        }
+        if(mLensInstance && cameraParams.hash() != mLensHash) {
+            // the lens follows the camera, only the top level tree over
+            // the instances needs a refit
+            mLensInstance->setTransform(getTransform(cameraParams));
+            mAggregate->refit();
+            mLensHash = cameraParams.hash();
+        }
+        Filter* filter = mFilterFactory->create(
+            filterParams.getString("type"), filterParams);
+        Film* film = mFilmFactory->create(filmParams.getString("type"),
+            filmParams, filter);
+        CameraPtr camera(mCameraFactory->create(
+            cameraParams.getString("type"), cameraParams, film));
+        RendererPtr renderer = createRenderer(setting);
+        if(!camera || !renderer) {
+            return false;
+        }
+        renderer->setCheckpoint(createCheckpoint(setting, filterParams,
+            filmParams, cameraParams));
+        // the workers stay parked across jobs like they do across passes
+        renderer->shareThreadPool(*context->mRenderer);
+        context->mScene->setCamera(camera);
+        context->mRenderer = renderer;
+        return true;
+    }
+
     RenderContext* ContextLoader::load(const string& filename) {
         PropertyTree pt;
         path scenePath(filename);
@@ -434,6 +631,25 @@ namespace Goblin {
             return NULL;
         }
         SceneCache sceneCache(canonical(scenePath.parent_path()));
+        mInstances.clear();
+        mInstanceParams.clear();
+        mMovedInstances.clear();
+        mFrameNodes.clear();
+        pt.getChildren("frame", &mFrameNodes);
+        // the groups a job overrides go in the checkpoint fingerprint
+        // with the values the job ends up with
+        mSceneHash = 0xcbf29ce484222325ULL;
+        mFrameHash = 0;
+        const PtreeList& nodes = pt.getChildren();
+        for(size_t i = 0; i < nodes.size(); ++i) {
+            const string& key = nodes[i].first;
+            if(key == "render_setting" || key == "filter" ||
+                key == "film" || key == "camera") {
+                continue;
+            }
+            mSceneHash = hashBytes(key.data(), key.size(), mSceneHash);
+            mSceneHash = nodes[i].second.hash(mSceneHash);
+        }
 
         RendererPtr renderer = parseRenderer(pt);
 
@@ -441,9 +657,15 @@ namespace Goblin {
         Film* film = parseFilm(pt, filter);
 
         CameraPtr camera = parseCamera(pt, film, &sceneCache);
+        if(renderer) {
+            renderer->setCheckpoint(createCheckpoint(mSettingParams,
+                mFilterParams, mFilmParams, mCameraParams));
+        }
 
         VolumeRegion* volume = parseVolume(pt);
 
+        parseAccelerator(pt, &sceneCache);
+
         PtreeList geometryNodes;
         pt.getChildren("geometry", &geometryNodes);
         for(size_t i = 0; i < geometryNodes.size(); ++i) {
@@ -469,9 +691,26 @@ namespace Goblin {
         for(size_t i = 0; i < lightNodes.size(); ++i) {
             parseLight(lightNodes[i].second, &sceneCache);
         }
-        PrimitivePtr aggregate(new BVH(sceneCache.getInstances(),
-            1, "equal_count"));
-        ScenePtr scene(new Scene(aggregate, camera, 
+        // two level acceleration: the root BVH is built over instance
+        // world bounds, the per model BVHs below it are shared by all
+        // the instances referencing the same model
+        mAggregate.reset(new BVH(sceneCache.getInstances(),
+            sceneCache.getAcceleratorParams(),
+            sceneCache.getBuildThreadPool()));
+        // a line for the whole scene, not one per mesh
+        const BVHBuildStats& modelStats = sceneCache.getModelBVHStats();
+        const BVHBuildStats& topStats = mAggregate->getBuildStats();
+        cout << "bvh build: " << modelStats.bvhsNum << " model bvhs over " <<
+            modelStats.primitivesNum << " primitives " <<
+            modelStats.nodesNum << " nodes in " << modelStats.seconds <<
+            " seconds, top level over " << topStats.primitivesNum <<
+            " instances in " << topStats.seconds << " seconds";
+        uint32_t cachedNum = modelStats.cachedNum + topStats.cachedNum;
+        if(cachedNum > 0) {
+            cout << ", " << cachedNum << " bvhs loaded from cache";
+        }
+        cout << endl;
+        ScenePtr scene(new Scene(mAggregate, camera, 
             sceneCache.getLights(), volume));
 
         RenderContext* ctx = new RenderContext(renderer, scene);
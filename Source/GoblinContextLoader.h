@@ -1,12 +1,16 @@
 #ifndef GOBLIN_CONTEXT_LOADER_H
 #define GOBLIN_CONTEXT_LOADER_H
 
+#include <set>
 #include <string>
 #include "GoblinFactory.h"
 #include "GoblinFilter.h"
 #include "GoblinFilm.h"
 #include "GoblinCamera.h"
+#include "GoblinCheckpoint.h"
+#include "GoblinParamSet.h"
 #include "GoblinPrimitive.h"
+#include "GoblinPropertyTree.h"
 #include "GoblinRenderContext.h"
 #include "GoblinScene.h"
 #include "GoblinTexture.h"
@@ -14,16 +18,41 @@
 
 namespace Goblin {
     using boost::scoped_ptr;
-    class PropertyTree;
-    class ParamSet;
+    class BVH;
 
     class ContextLoader {
     public:
         ContextLoader();
         RenderContext* load(const std::string& filename);
+        // point the context of the last load at a new job. a job has the
+        // render_setting, filter, film and camera groups of a scene file,
+        // its values override the ones load parsed. geometry, BVHs,
+        // textures and lights stay resident across jobs, a thin lens
+        // camera can move but not change its lens_radius
+        bool loadJob(const PropertyTree& job, RenderContext* context);
+        // frame nodes of a sequence scene file, a frame is a job with
+        // instance groups on top: the name of a primitive instance plus
+        // the transform keys to override (use the rotation key the scene
+        // file uses, euler wins over orientation)
+        int getFramesNum() const;
+        // move the instances of the frame, refit the top level BVH over
+        // them and load the frame as a job. the image goes to the film
+        // file numbered by the frame unless the frame names its own
+        bool loadFrame(int frameIndex, RenderContext* context);
     private:
+        bool applyJob(const PropertyTree& job, int frameIndex,
+            RenderContext* context);
+
         RendererPtr parseRenderer(const PropertyTree& pt);
 
+        RendererPtr createRenderer(const ParamSet& setting);
+
+        // checkpoint of the render_setting, stamped with the fingerprint
+        // of the scene the groups and the moved instances make up
+        Checkpoint createCheckpoint(const ParamSet& setting,
+            const ParamSet& filterParams, const ParamSet& filmParams,
+            const ParamSet& cameraParams) const;
+
         Filter* parseFilter(const PropertyTree& pt);
 
         Film* parseFilm(const PropertyTree& pt, Filter* filter);
@@ -33,6 +62,8 @@ namespace Goblin {
 
         VolumeRegion* parseVolume(const PropertyTree& pt);
 
+        void parseAccelerator(const PropertyTree& pt, SceneCache* sceneCache);
+
         void parseGeometry(const PropertyTree& pt, SceneCache* sceneCache);
 
         void parseTexture(const PropertyTree& pt, SceneCache* sceneCache);
@@ -61,6 +92,28 @@ namespace Goblin {
             mPrimitiveFactory;
         scoped_ptr<Factory<Light, const ParamSet&, const SceneCache&> > 
             mLightFactory;
+        // scene file groups the jobs override
+        ParamSet mSettingParams;
+        ParamSet mFilterParams;
+        ParamSet mFilmParams;
+        ParamSet mCameraParams;
+        // named instances the frames can move, with their scene file
+        // params the frames override
+        map<string, InstancedPrimitive*> mInstances;
+        map<string, ParamSet> mInstanceParams;
+        // moved by the last frame, back to the scene file transform
+        // when the next frame doesn't move them
+        std::set<string> mMovedInstances;
+        boost::shared_ptr<BVH> mAggregate;
+        PtreeList mFrameNodes;
+        // scene file minus the groups the jobs override, and the
+        // instances the last frame moved
+        uint64_t mSceneHash;
+        uint64_t mFrameHash;
+        // thin lens disk of the camera, NULL for a pinhole. jobs move it
+        // with the camera, mLensHash is of the camera params it is at
+        InstancedPrimitive* mLensInstance;
+        uint64_t mLensHash;
     };
 }
 
@@ -4,6 +4,7 @@
 #include "GoblinSampler.h"
 #include "GoblinImageIO.h"
 
+#include <boost/atomic/atomic_ref.hpp>
 #include <cstring>
 
 namespace Goblin {
@@ -38,11 +39,15 @@ namespace Goblin {
 
     ImageTile::ImageTile(const ImageRect& tileRect,
         const FilterTable& cachedFilter):
-        mTileRect(tileRect), mPixels(NULL),
-        mCachedFilter(cachedFilter) {
+        mTileRect(tileRect), mOwnedRect(tileRect), mPixels(NULL),
+        mCapacity(tileRect.pixelNum()), mCachedFilter(cachedFilter) {
         mPixels = new Pixel[mTileRect.xCount * mTileRect.yCount];
     }
 
+    ImageTile::ImageTile(const FilterTable& cachedFilter):
+        mTileRect(0, 0, 0, 0), mOwnedRect(0, 0, 0, 0), mPixels(NULL),
+        mCapacity(0), mCachedFilter(cachedFilter) {}
+
     ImageTile::~ImageTile() {
         if(mPixels) {
             delete [] mPixels;
@@ -50,6 +55,58 @@ namespace Goblin {
         }
     }
 
+    void ImageTile::reset(const SampleRange& sampleRange,
+        const ImageRect& imageRect) {
+        const Vector2& filterWidth = mCachedFilter.getFilterWidth();
+        // sample at imageX reaches pixels in
+        // [ceil(imageX - 0.5 - width), floor(imageX - 0.5 + width)]
+        int imageXEnd = imageRect.xStart + imageRect.xCount;
+        int imageYEnd = imageRect.yStart + imageRect.yCount;
+        int x0 = max(ceilInt(sampleRange.xStart - 0.5f - filterWidth.x),
+            imageRect.xStart);
+        int x1 = min(floorInt(sampleRange.xEnd - 0.5f + filterWidth.x) + 1,
+            imageXEnd);
+        int y0 = max(ceilInt(sampleRange.yStart - 0.5f - filterWidth.y),
+            imageRect.yStart);
+        int y1 = min(floorInt(sampleRange.yEnd - 0.5f + filterWidth.y) + 1,
+            imageYEnd);
+        mTileRect = ImageRect(x0, y0, max(x1 - x0, 0), max(y1 - y0, 0));
+        shrinkSampleRange(sampleRange);
+
+        int pixelNum = mTileRect.pixelNum();
+        if(pixelNum > mCapacity) {
+            delete [] mPixels;
+            mPixels = new Pixel[pixelNum];
+            mCapacity = pixelNum;
+        } else {
+            for(int i = 0; i < pixelNum; ++i) {
+                mPixels[i].color = Color::Black;
+                mPixels[i].weight = 0.0f;
+            }
+        }
+    }
+
+    void ImageTile::shrinkSampleRange(const SampleRange& sampleRange) {
+        const Vector2& filterWidth = mCachedFilter.getFilterWidth();
+        // pixel x only receives samples in [x + 0.5 - width,
+        // x + 0.5 + width], it's ours when that lies in sampleRange.
+        // keep one pixel margin against rounding in addSample
+        int x0 = mTileRect.xStart;
+        int x1 = mTileRect.xStart + mTileRect.xCount;
+        int y0 = mTileRect.yStart;
+        int y1 = mTileRect.yStart + mTileRect.yCount;
+        int ox0 = max(ceilInt(sampleRange.xStart - 0.5f + filterWidth.x) + 1,
+            x0);
+        int ox1 = min(ceilInt(sampleRange.xEnd - 0.5f - filterWidth.x) - 1,
+            x1);
+        int oy0 = max(ceilInt(sampleRange.yStart - 0.5f + filterWidth.y) + 1,
+            y0);
+        int oy1 = min(ceilInt(sampleRange.yEnd - 0.5f - filterWidth.y) - 1,
+            y1);
+        mOwnedRect = ImageRect(ox0, oy0, max(ox1 - ox0, 0),
+            max(oy1 - oy0, 0));
+    }
+
     void ImageTile::getTileRange(int* xStart, int *xEnd,
         int* yStart, int *yEnd) const {
         *xStart = mTileRect.xStart;
@@ -58,6 +115,14 @@ namespace Goblin {
         *yEnd = mTileRect.yStart + mTileRect.yCount;
     }
 
+    void ImageTile::getOwnedRange(int* xStart, int *xEnd,
+        int* yStart, int *yEnd) const {
+        *xStart = mOwnedRect.xStart;
+        *xEnd = mOwnedRect.xStart + mOwnedRect.xCount;
+        *yStart = mOwnedRect.yStart;
+        *yEnd = mOwnedRect.yStart + mOwnedRect.yCount;
+    }
+
     void ImageTile::addSample(float imageX, float imageY, const Color& L) {
         if(L.isNaN()) {
             cout << "sample ("<< imageX << " " << imageY
@@ -93,9 +158,11 @@ namespace Goblin {
         Filter* filter, const std::string& filename,
         bool toneMapping,
         float bloomRadius, float bloomWeight):
-        mXRes(xRes), mYRes(yRes), mFilter(filter), mCachedFilter(filter),
-        mFilename(filename), mToneMapping(toneMapping),
-        mBloomRadius(bloomRadius), mBloomWeight(bloomWeight) {
+        mXRes(xRes), mYRes(yRes), mBandIndex(0), mBandCount(1),
+        mFilter(filter), mCachedFilter(filter),
+        mSplats(NULL), mFilename(filename), mToneMapping(toneMapping),
+        mBloomRadius(bloomRadius), mBloomWeight(bloomWeight),
+        mImageWriter(NULL) {
 
         memcpy(mCrop, crop, 4 * sizeof(float));
 
@@ -115,6 +182,10 @@ namespace Goblin {
             delete[] mPixels;
             mPixels = NULL;
         }
+        if(mSplats != NULL) {
+            delete[] mSplats;
+            mSplats = NULL;
+        }
         if(mFilter != NULL) {
             delete mFilter;
             mFilter = NULL;
@@ -135,19 +206,73 @@ namespace Goblin {
         sampleRange.xEnd = floorInt(mXStart + 0.5f + mXCount + xWidth);
         sampleRange.yStart = floorInt(mYStart + 0.5f - yWidth);
         sampleRange.yEnd = floorInt(mYStart + 0.5f + mYCount + yWidth);
+        clipToSampleBand(&sampleRange.yStart, &sampleRange.yEnd);
+    }
+
+    static inline void atomicAdd(float& target, float value) {
+        boost::atomic_ref<float>(target).fetch_add(value,
+            boost::memory_order_relaxed);
     }
 
     void Film::mergeTile(const ImageTile& tile) {
         int xStart, xEnd, yStart, yEnd;
         tile.getTileRange(&xStart, &xEnd, &yStart, &yEnd);
+        int ownedXStart, ownedXEnd, ownedYStart, ownedYEnd;
+        tile.getOwnedRange(&ownedXStart, &ownedXEnd,
+            &ownedYStart, &ownedYEnd);
         const Pixel* tileBuffer = tile.getTileBuffer();
         int tileWidth = xEnd - xStart;
         for(int y = yStart; y < yEnd; ++y) {
+            bool ownedRow = y >= ownedYStart && y < ownedYEnd;
             for(int x = xStart; x < xEnd; ++x) {
                 int tileIndex = (y - yStart) * tileWidth + (x - xStart);
                 int filmIndex = y * mXRes + x;
-                mPixels[filmIndex].color += tileBuffer[tileIndex].color;
-                mPixels[filmIndex].weight += tileBuffer[tileIndex].weight;
+                const Pixel& src = tileBuffer[tileIndex];
+                Pixel& dst = mPixels[filmIndex];
+                if(ownedRow && x >= ownedXStart && x < ownedXEnd) {
+                    dst.color += src.color;
+                    dst.weight += src.weight;
+                } else {
+                    // apron, neighbor tiles may be merging here too
+                    atomicAdd(dst.color.r, src.color.r);
+                    atomicAdd(dst.color.g, src.color.g);
+                    atomicAdd(dst.color.b, src.color.b);
+                    atomicAdd(dst.weight, src.weight);
+                }
+            }
+        }
+    }
+
+    void Film::initSplatBuffer() {
+        int floatsNum = 3 * mXRes * mYRes;
+        if(mSplats == NULL) {
+            mSplats = new float[floatsNum];
+        }
+        memset(mSplats, 0, floatsNum * sizeof(float));
+    }
+
+    void Film::addSplat(float imageX, float imageY, const Color& L) {
+        if(L.isNaN()) {
+            cout << "splat ("<< imageX << " " << imageY
+                << ") generate NaN point, discard this sample" << endl;
+            return;
+        }
+        // same filter footprint as ImageTile::addSample, splats are
+        // not weight normalized though
+        float dImageX = imageX - 0.5f;
+        float dImageY = imageY - 0.5f;
+        const Vector2& filterWidth = mCachedFilter.getFilterWidth();
+        int x0 = max(ceilInt(dImageX - filterWidth.x), mXStart);
+        int x1 = min(floorInt(dImageX + filterWidth.x), mXStart + mXCount - 1);
+        int y0 = max(ceilInt(dImageY - filterWidth.y), mYStart);
+        int y1 = min(floorInt(dImageY + filterWidth.y), mYStart + mYCount - 1);
+        for(int y = y0; y <= y1; ++y) {
+            for(int x = x0; x <= x1; ++x) {
+                float w = mCachedFilter.evaluate(x - dImageX, y - dImageY);
+                float* splat = mSplats + 3 * (y * mXRes + x);
+                atomicAdd(splat[0], w * L.r);
+                atomicAdd(splat[1], w * L.g);
+                atomicAdd(splat[2], w * L.b);
             }
         }
     }
@@ -159,9 +284,89 @@ namespace Goblin {
                 mPixels[index].color *= scale;
             }
         }
+        if (mSplats) {
+            for (int i = 0; i < 3 * mXRes * mYRes; ++i) {
+                mSplats[i] *= scale;
+            }
+        }
+    }
+
+    void Film::clearImage() {
+        for(int i = 0; i < mXRes * mYRes; ++i) {
+            mPixels[i] = Pixel();
+        }
+        if(mSplats) {
+            memset(mSplats, 0, 3 * mXRes * mYRes * sizeof(float));
+        }
+    }
+
+    void Film::getState(FilmState* state) const {
+        state->xRes = mXRes;
+        state->yRes = mYRes;
+        getImageRect(state->rect);
+        int pixelNum = mXRes * mYRes;
+        state->pixels.resize(4 * pixelNum);
+        for(int i = 0; i < pixelNum; ++i) {
+            state->pixels[4 * i] = mPixels[i].color.r;
+            state->pixels[4 * i + 1] = mPixels[i].color.g;
+            state->pixels[4 * i + 2] = mPixels[i].color.b;
+            state->pixels[4 * i + 3] = mPixels[i].weight;
+        }
+        if(mSplats) {
+            state->splats.assign(mSplats, mSplats + 3 * pixelNum);
+        } else {
+            state->splats.clear();
+        }
+    }
+
+    bool Film::setState(const FilmState& state) {
+        if(state.xRes != mXRes || state.yRes != mYRes ||
+            state.rect.xStart != mXStart || state.rect.yStart != mYStart ||
+            state.rect.xCount != mXCount || state.rect.yCount != mYCount ||
+            state.splats.empty() != (mSplats == NULL)) {
+            return false;
+        }
+        clearImage();
+        return addState(state);
+    }
+
+    bool Film::addState(const FilmState& state) {
+        int pixelNum = mXRes * mYRes;
+        if(state.xRes != mXRes || state.yRes != mYRes ||
+            (int)state.pixels.size() != 4 * pixelNum ||
+            (!state.splats.empty() &&
+            (int)state.splats.size() != 3 * pixelNum)) {
+            return false;
+        }
+        for(int i = 0; i < pixelNum; ++i) {
+            const float* p = &state.pixels[4 * i];
+            mPixels[i].color += Color(p[0], p[1], p[2]);
+            mPixels[i].weight += p[3];
+        }
+        if(!state.splats.empty()) {
+            if(mSplats == NULL) {
+                initSplatBuffer();
+            }
+            for(int i = 0; i < 3 * pixelNum; ++i) {
+                mSplats[i] += state.splats[i];
+            }
+        }
+        return true;
     }
 
-    void Film::writeImage(bool normalize) {
+    void Film::setSampleBand(int index, int count) {
+        mBandIndex = index;
+        mBandCount = count;
+    }
+
+    void Film::clipToSampleBand(int* yStart, int* yEnd) const {
+        int64_t rows = *yEnd - *yStart;
+        int start = *yStart;
+        *yStart = start + (int)(rows * mBandIndex / mBandCount);
+        *yEnd = start + (int)(rows * (mBandIndex + 1) / mBandCount);
+    }
+
+    void Film::writeImage(bool normalize, float scale) {
         Color* colors = new Color[mXRes * mYRes];
         for(int y = 0; y < mYRes; ++y) {
             for(int x = 0; x < mXRes; ++x) {
@@ -169,6 +374,11 @@ namespace Goblin {
                 colors[index] = normalize?
                     mPixels[index].color / mPixels[index].weight:
                     mPixels[index].color;
+                if(mSplats) {
+                    const float* splat = mSplats + 3 * index;
+                    colors[index] += Color(splat[0], splat[1], splat[2]);
+                }
+                colors[index] *= scale;
             }
         }
 
@@ -184,12 +394,23 @@ namespace Goblin {
                 mDebugPoints[i].second, 1);
         }
 
-        cout << "write image to : " << mFilename << endl;
-        if(mBloomRadius > 0.0f && mBloomWeight > 0.0f) {
-            Goblin::bloom(colors, mXRes, mYRes, mBloomRadius, mBloomWeight);
+        ImageWriter::Job job;
+        job.filename = mFilename;
+        job.colors = colors;
+        job.xRes = mXRes;
+        job.yRes = mYRes;
+        job.toneMapping = mToneMapping;
+        job.bloomRadius = mBloomRadius;
+        job.bloomWeight = mBloomWeight;
+        if(mImageWriter) {
+            mImageWriter->write(job);
+        } else {
+            ImageWriter::process(job);
         }
-        Goblin::writeImage(mFilename, colors, mXRes, mYRes, mToneMapping);
-        delete [] colors;
+    }
+
+    void Film::setImageWriter(ImageWriter* writer) {
+        mImageWriter = writer;
     }
 
     void Film::addDebugLine(const DebugLine& l, const Color& c) {
@@ -200,6 +421,107 @@ namespace Goblin {
         mDebugPoints.push_back(pair<Vector2, Color>(p, c));
     }
 
+    // one image encoding while the next waits is enough to hide the
+    // write behind a render, more would only pile up frame buffers
+    static const size_t sMaxPendingImages = 2;
+
+    ImageWriter::ImageWriter(): mShutdown(false),
+        mThread(&ImageWriter::run, this) {}
+
+    ImageWriter::~ImageWriter() {
+        {
+            boost::lock_guard<boost::mutex> lock(mMutex);
+            mShutdown = true;
+        }
+        mCondition.notify_all();
+        mThread.join();
+    }
+
+    void ImageWriter::write(const Job& job) {
+        boost::unique_lock<boost::mutex> lock(mMutex);
+        while(mJobs.size() >= sMaxPendingImages) {
+            mCondition.wait(lock);
+        }
+        mJobs.push_back(job);
+        mCondition.notify_all();
+    }
+
+    void ImageWriter::process(const Job& job) {
+        cout << "write image to : " << job.filename << endl;
+        if(job.bloomRadius > 0.0f && job.bloomWeight > 0.0f) {
+            Goblin::bloom(job.colors, job.xRes, job.yRes, job.bloomRadius,
+                job.bloomWeight);
+        }
+        Goblin::writeImage(job.filename, job.colors, job.xRes, job.yRes,
+            job.toneMapping);
+        delete [] job.colors;
+    }
+
+    void ImageWriter::run() {
+        boost::unique_lock<boost::mutex> lock(mMutex);
+        while(true) {
+            while(mJobs.empty() && !mShutdown) {
+                mCondition.wait(lock);
+            }
+            if(mJobs.empty()) {
+                return;
+            }
+            // the job stays queued while it is processed so write keeps
+            // counting it as pending
+            Job job = mJobs.front();
+            lock.unlock();
+            process(job);
+            lock.lock();
+            mJobs.pop_front();
+            mCondition.notify_all();
+        }
+    }
+
+    void writeFilmState(std::ostream& out, const FilmState& state) {
+        int32_t header[7] = {state.xRes, state.yRes,
+            state.rect.xStart, state.rect.yStart,
+            state.rect.xCount, state.rect.yCount,
+            !state.splats.empty()};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&state.pixels[0]),
+            state.pixels.size() * sizeof(float));
+        if(!state.splats.empty()) {
+            out.write(reinterpret_cast<const char*>(&state.splats[0]),
+                state.splats.size() * sizeof(float));
+        }
+    }
+
+    bool readFilmState(std::istream& in, int xRes, int yRes,
+        uint64_t maxBytes, FilmState* state, uint64_t* filmBytes) {
+        int32_t header[7];
+        if(maxBytes < sizeof(header)) {
+            return false;
+        }
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        if(!in || header[0] != xRes || header[1] != yRes) {
+            return false;
+        }
+        size_t pixelNum = (size_t)xRes * yRes;
+        uint64_t bytes = sizeof(header) +
+            (header[6] ? 7 : 4) * pixelNum * sizeof(float);
+        if(bytes > maxBytes) {
+            return false;
+        }
+        *filmBytes = bytes;
+        state->xRes = header[0];
+        state->yRes = header[1];
+        state->rect = ImageRect(header[2], header[3], header[4], header[5]);
+        state->pixels.resize(4 * pixelNum);
+        in.read(reinterpret_cast<char*>(&state->pixels[0]),
+            state->pixels.size() * sizeof(float));
+        state->splats.resize(header[6] ? 3 * pixelNum : 0);
+        if(!state->splats.empty()) {
+            in.read(reinterpret_cast<char*>(&state->splats[0]),
+                state->splats.size() * sizeof(float));
+        }
+        return (bool)in;
+    }
+
     Film* ImageFilmCreator::create(const ParamSet& params, 
         Filter* filter) const {
         Vector2 res = params.getVector2("resolution", Vector2(640, 480));
@@ -7,6 +7,9 @@
 #include "GoblinUtils.h"
 #include "GoblinVector.h"
 
+#include <boost/thread.hpp>
+#include <deque>
+
 namespace Goblin {
 
     const int FILTER_TABLE_WIDTH = 16;
@@ -41,6 +44,27 @@ namespace Goblin {
         int xStart, yStart, xCount, yCount;
     };
 
+    // raw accumulation buffers of a film, what checkpoints and the parts
+    // of a distributed render carry around
+    struct FilmState {
+        FilmState(): xRes(0), yRes(0), rect(0, 0, 0, 0) {}
+        bool empty() const { return pixels.empty(); }
+
+        int xRes, yRes;
+        // crop window the samples went to
+        ImageRect rect;
+        // color rgb and weight per pixel
+        vector<float> pixels;
+        // rgb per pixel, empty without a splat buffer
+        vector<float> splats;
+    };
+
+    void writeFilmState(std::ostream& out, const FilmState& state);
+    // fails without allocating when the stored film is not xRes by yRes
+    // or needs more than maxBytes, filmBytes gets the bytes it took
+    bool readFilmState(std::istream& in, int xRes, int yRes,
+        uint64_t maxBytes, FilmState* state, uint64_t* filmBytes);
+
     class FilterTable {
     public:
         FilterTable(const Filter* filter);
@@ -58,20 +82,39 @@ namespace Goblin {
 
     class ImageTile {
     public:
+        // the caller owns every pixel in tileRect exclusively during merge
         ImageTile(const ImageRect& tileRect, const FilterTable& cachedFilter);
 
+        // empty tile, reset it to the sample range it's going to collect
+        ImageTile(const FilterTable& cachedFilter);
+
         ~ImageTile();
 
+        // cover the pixels samples in sampleRange can reach (the range
+        // plus a filter width apron, clipped to imageRect) and clear it
+        void reset(const SampleRange& sampleRange, const ImageRect& imageRect);
+
+        // from now on samples only come from sampleRange, a part of the
+        // range the tile got reset with, gives up ownership of the rest
+        void shrinkSampleRange(const SampleRange& sampleRange);
+
         void getTileRange(int* xStart, int *xEnd,
             int* yStart, int* yEnd) const;
 
+        // pixels no other sample range reaches, the rest of the tile
+        // overlaps neighbor tiles and needs atomic merge
+        void getOwnedRange(int* xStart, int *xEnd,
+            int* yStart, int* yEnd) const;
+
         const Pixel* getTileBuffer() const;
 
         void addSample(float imageX, float imageY, const Color& L);
 
     private:
         ImageRect mTileRect;
+        ImageRect mOwnedRect;
         Pixel* mPixels;
+        int mCapacity;
         const FilterTable& mCachedFilter;
     };
 
@@ -79,6 +122,37 @@ namespace Goblin {
         return mPixels;
     }
 
+    // encodes and writes images on a thread of its own, a film handed
+    // one returns from writeImage as soon as the colors got resolved,
+    // so a sequence renders the next frame while the last one is saved
+    class ImageWriter {
+    public:
+        struct Job {
+            std::string filename;
+            // allocated with new[], the writer deletes it when done
+            Color* colors;
+            int xRes, yRes;
+            bool toneMapping;
+            float bloomRadius;
+            float bloomWeight;
+        };
+
+        ImageWriter();
+        // waits for the queued images to be written
+        ~ImageWriter();
+        // blocks while the writer is too far behind
+        void write(const Job& job);
+        static void process(const Job& job);
+    private:
+        void run();
+    private:
+        std::deque<Job> mJobs;
+        boost::mutex mMutex;
+        boost::condition_variable mCondition;
+        bool mShutdown;
+        boost::thread mThread;
+    };
+
     class Film {
     public:
         Film(int xRes, int yRes, const float crop[4],
@@ -106,10 +180,44 @@ namespace Goblin {
 
         void scaleImage(float s);
 
-        void writeImage(bool normalize = true);
-
+        // drop everything accumulated so far, splats included
+        void clearImage();
+
+        void getState(FilmState* state) const;
+        // fails with the film untouched on a resolution, crop window or
+        // splat buffer mismatch
+        bool setState(const FilmState& state);
+        // add up buffers of another render of the same
+        // resolution, splat buffer gets created when the state has one
+        bool addState(const FilmState& state);
+
+        // only hand out the samples of the index-th of count horizontal
+        // bands of the sample range. the crop window stays whole, so the
+        // filter footprint of samples next to a band edge still lands
+        // on the film and the bands of all the parts add up to the image
+        void setSampleBand(int index, int count);
+        // cut rows [*yStart, *yEnd) down to the sample band
+        void clipToSampleBand(int* yStart, int* yEnd) const;
+
+        // scale gets applied on the written colors only, so the film
+        // can keep accumulating after an intermediate write
+        void writeImage(bool normalize = true, float scale = 1.0f);
+
+        // write images through writer instead of in place, NULL to go
+        // back to in place writes
+        void setImageWriter(ImageWriter* writer);
+
+        // lock free, pixels outside the tile's owned range get added
+        // atomically so tiles can merge while their neighbors do
         void mergeTile(const ImageTile& tile);
 
+        // light tracing style renderers splat samples anywhere on the
+        // image. those go to a buffer separated from the filtered pixels
+        // with atomic adds, call this before the splatting pass starts
+        void initSplatBuffer();
+
+        void addSplat(float imageX, float imageY, const Color& L);
+
         void addDebugLine(const DebugLine& l, const Color& c);
 
         void addDebugPoint(const Vector2& p, const Color& c);
@@ -117,15 +225,19 @@ namespace Goblin {
     private:
         int mXRes, mYRes;
         int mXStart, mYStart, mXCount, mYCount;
+        int mBandIndex, mBandCount;
         float mInvXRes, mInvYRes;
         float mCrop[4];
         Filter* mFilter;
         FilterTable mCachedFilter;
         Pixel* mPixels;
+        // rgb per pixel, NULL til initSplatBuffer
+        float* mSplats;
         std::string mFilename;
         bool mToneMapping;
         float mBloomRadius;
         float mBloomWeight;
+        ImageWriter* mImageWriter;
         vector<pair<DebugLine, Color> > mDebugLines;
         vector<pair<Vector2, Color> > mDebugPoints;
     };
@@ -39,6 +39,15 @@ namespace Goblin {
         mIsUpdated = false;
     }
 
+    void Fragment::transform(const AffineTransform& toWorld,
+        const AffineTransform& normalToWorld) {
+        mPosition = toWorld.onPoint(mPosition);
+        mNormal = normalize(normalToWorld.onVector(mNormal));
+        mDPDU = toWorld.onVector(mDPDU);
+        mDPDV = toWorld.onVector(mDPDV);
+        mIsUpdated = false;
+    }
+
     size_t Geometry::nextGeometryId = 0;
     
     Geometry::Geometry(): mGeometryId(nextGeometryId++) {}
@@ -14,6 +14,7 @@ namespace Goblin {
     class BBox;
     class Ray;
     class Transform;
+    class AffineTransform;
 
     class Fragment {
     public:
@@ -44,6 +45,9 @@ namespace Goblin {
         void setUVDifferential(float dudx, float dvdx, float dudy, float dvdy);
 
         void transform(const Transform& t);
+        // normalToWorld is the inverse transpose of toWorld
+        void transform(const AffineTransform& toWorld, 
+            const AffineTransform& normalToWorld);
     private:
         Vector3 mPosition;
         Vector3 mNormal;
@@ -145,6 +149,17 @@ namespace Goblin {
         virtual float area() const = 0;
         virtual BBox getObjectBound() const = 0;
         virtual void refine(GeometryList& refinedGeometries) const;
+        // fill in the vertex positions and return true if this geometry
+        // is a single triangle, used by accelerator to precompute leaves
+        virtual bool getTriangle(Vector3* p0, Vector3* p1, Vector3* p2) const;
+        // same as getTriangle for the vertex uvs
+        virtual bool getTriangleUV(Vector2* uv0, Vector2* uv1, 
+            Vector2* uv2) const;
+        // fill in the fragment of a hit at distance t and barycentrics
+        // b1 b2 found outside of intersect (the SIMD leaf test), return
+        // false if this geometry is not a single triangle
+        virtual bool getTriangleFragment(const Ray& ray, float t, float b1,
+            float b2, float* epsilon, Fragment* fragment) const;
 
         virtual size_t getVertexNum() const = 0;
         virtual size_t getFaceNum() const = 0;
@@ -180,6 +195,21 @@ namespace Goblin {
         throw std::exception();
     }
 
+    inline bool Geometry::getTriangle(Vector3* p0, Vector3* p1, 
+        Vector3* p2) const {
+        return false;
+    }
+
+    inline bool Geometry::getTriangleUV(Vector2* uv0, Vector2* uv1, 
+        Vector2* uv2) const {
+        return false;
+    }
+
+    inline bool Geometry::getTriangleFragment(const Ray& ray, float t,
+        float b1, float b2, float* epsilon, Fragment* fragment) const {
+        return false;
+    }
+
     inline void Geometry::clearGeometryCache() {
         std::map<size_t, Geometry*>::iterator it;
         for(it = geometryCache.begin(); it != geometryCache.end(); ++it) {
@@ -31,7 +31,7 @@ namespace Goblin {
 
     void LightTraceTask::run(TLSPtr& tls) {
         RenderingTLS* renderingTLS = static_cast<RenderingTLS*>(tls.get());
-        ImageTile* tile = renderingTLS->getTile();
+        Film* film = mCamera->getFilm();
 
         Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, mRNG);
         int batchAmount = sampler.maxSamplesPerRequest();
@@ -41,13 +41,13 @@ namespace Goblin {
         while ((sampleNum = sampler.requestSamples(samples)) > 0) {
             for (int s = 0; s <sampleNum; ++s) {
                 //mLightTracer->splatFilmT0(mScene, samples[s], *mRNG,
-                //    mPathVertices, tile);
+                //    mPathVertices, film);
 
                 mLightTracer->splatFilmT1(mScene, samples[s], *mRNG,
-                    mPathVertices, tile);
+                    mPathVertices, film);
 
                 //mLightTracer->splatFilmS1(mScene, samples[s], *mRNG,
-                //    mPathVertices, tile);
+                //    mPathVertices, film);
             }
             totalSampleCount += sampleNum;
         }
@@ -72,7 +72,7 @@ namespace Goblin {
 
     void LightTracer::splatFilmT1(const ScenePtr& scene, const Sample& sample,
         const RNG& rng, std::vector<PathVertex>& pathVertices,
-        ImageTile* tile) const {
+        Film* film) const {
         if (scene->getLights().size() == 0) {
             return;
         }
@@ -167,13 +167,13 @@ namespace Goblin {
             
             Color pathContribution = fsL * fsE * G *
                 pv.throughput * cVertex.throughput;
-            tile->addSample(filmPixel.x, filmPixel.y, pathContribution);
+            film->addSplat(filmPixel.x, filmPixel.y, pathContribution);
         }
     }
 
     void LightTracer::splatFilmT0(const ScenePtr& scene, const Sample& sample,
         const RNG& rng, std::vector<PathVertex>& pathVertices,
-        ImageTile* tile) const {
+        Film* film) const {
         if (scene->getLights().size() == 0) {
             return;
         }
@@ -216,7 +216,7 @@ namespace Goblin {
                 if (filmPixel != Camera::sInvalidPixel) {
                     Color L = light->eval(pLight, nLight, dirLight);
                     float We = camera->evalWe(pCamera, pS_1);
-                    tile->addSample(filmPixel.x, filmPixel.y,
+                    film->addSplat(filmPixel.x, filmPixel.y,
                         L * We * pathVertices[lightVertex].throughput);
                 }
                 break;
@@ -239,7 +239,7 @@ namespace Goblin {
 
     void LightTracer::splatFilmS1(const ScenePtr& scene, const Sample& sample,
         const RNG& rng, std::vector<PathVertex>& pathVertices,
-        ImageTile* tile) const {
+        Film* film) const {
         if (scene->getLights().size() == 0) {
             return;
         }
@@ -328,7 +328,7 @@ namespace Goblin {
             }
             Color pathContribution = fsL * fsE * G *
                 pv.throughput * lVertex.throughput;
-            tile->addSample(filmPixel.x, filmPixel.y, pathContribution);
+            film->addSplat(filmPixel.x, filmPixel.y, pathContribution);
         }
     }
 
@@ -348,22 +348,31 @@ namespace Goblin {
                 mMaxPathLength, &progress));
         }
 
+        film->initSplatBuffer();
         RenderingTLSManager tlsManager(film);
-        ThreadPool threadPool(mThreadNum, &tlsManager);
-        threadPool.enqueue(lightTraceTasks);
-        threadPool.waitForAll();
+        renderPasses(lightTraceTasks, &tlsManager, &progress);
         //clean up
         for(size_t i = 0; i < lightTraceTasks.size(); ++i) {
             delete lightTraceTasks[i];
         }
         lightTraceTasks.clear();
 
+        drawDebugData(tlsManager.getDebugData(), camera);
+        outputFilm(film, tlsManager);
+    }
+
+    void LightTracer::writeFilm(Film* film,
+        const RenderingTLSManager& tlsManager) const {
+        // splats are normalized by the samples of all passes so far
         ImageRect filmRect;
         film->getImageRect(filmRect);
         float filmArea = (float)(filmRect.xCount * filmRect.yCount);
-        film->scaleImage(filmArea / tlsManager.getTotalSampleCount());
-        drawDebugData(tlsManager.getDebugData(), camera);
-        film->writeImage(false);
+        film->writeImage(false,
+            filmArea / tlsManager.getTotalSampleCount());
+    }
+
+    bool LightTracer::supportCropPartition() const {
+        return false;
     }
 
     void LightTracer::querySampleQuota(const ScenePtr& scene,
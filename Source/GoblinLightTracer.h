@@ -20,6 +20,11 @@ namespace Goblin {
             RenderingTLS* tls = NULL) const;
 
         void render(const ScenePtr& scene);
+
+        void writeFilm(Film* film,
+            const RenderingTLSManager& tlsManager) const;
+
+        bool supportCropPartition() const;
         
         // t = 1 strategy
         // random walk a particle path from light source and connect to
@@ -27,7 +32,7 @@ namespace Goblin {
         // path tracing technique
         void splatFilmT1(const ScenePtr& scene, const Sample& sample,
             const RNG& rng, std::vector<PathVertex>& pathVertices,
-            ImageTile* tile) const;
+            Film* film) const;
         // t = 0 strategy
         // random walk a particle path from light source and only contribute
         // to film when the last intersection hit the camera lens. This is
@@ -36,7 +41,7 @@ namespace Goblin {
         // compare to other strategy
         void splatFilmT0(const ScenePtr& scene, const Sample& sample,
             const RNG& rng, std::vector<PathVertex>& pathVertices,
-            ImageTile* tile) const;
+            Film* film) const;
 
         // s = 1 strategy
         // random walk a particle path from camera and and connect to one
@@ -44,7 +49,7 @@ namespace Goblin {
         // implemented.
         void splatFilmS1(const ScenePtr& scene, const Sample& sample,
             const RNG& rng, std::vector<PathVertex>& pathVertices,
-            ImageTile* tile) const;
+            Film* film) const;
 
         void querySampleQuota(const ScenePtr& scene,
             SampleQuota* sampleQuota);
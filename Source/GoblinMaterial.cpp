@@ -810,6 +810,83 @@ namespace Goblin {
         return pdf;
     }
 
+    // alpha above this counts as fully opaque, the transmission
+    // we give up on is way below what the sampling noise is
+    static const float sOpaqueAlpha = 1.0f - 1e-4f;
+    // samples along each barycentric axis per coverage cell, picked
+    // from the mask texel size so every texel gets at least one
+    static const int sMinCellSamples = 2;
+    static const int sMaxCellSamples = 8;
+
+    AlphaClass MaskMaterial::classifyAlpha(const Geometry* geometry,
+        uint64_t* coverage) const {
+        *coverage = 0;
+        Vector3 p[3];
+        Vector2 uv[3];
+        if((mMaskedMaterial->getType() & BSDFNull) ||
+            !geometry->getTriangle(&p[0], &p[1], &p[2]) ||
+            !geometry->getTriangleUV(&uv[0], &uv[1], &uv[2])) {
+            return AlphaTransparent;
+        }
+        // point samples can only vouch for the mask when they are no
+        // further apart than a texel, leave it to the full test when
+        // the texel size is unknown or it would take too many samples
+        float texelSize = mAlphaMask->getTexelSize();
+        if(texelSize <= 0.0f) {
+            return AlphaTransparent;
+        }
+        float uvExtent = max(max(length(uv[1] - uv[0]), 
+            length(uv[2] - uv[0])), length(uv[2] - uv[1]));
+        float cellRate = ceil(uvExtent / (texelSize * sAlphaCoverageRes));
+        if(cellRate > sMaxCellSamples) {
+            return AlphaTransparent;
+        }
+        int cellSamples = max((int)cellRate, sMinCellSamples);
+        // sample the mask on a lattice over the barycentric coordinate,
+        // a cell is opaque if all the lattice points on it are opaque
+        int n = sAlphaCoverageRes * cellSamples;
+        float step = 1.0f / n;
+        Vector3 normal = normalize(cross(p[1] - p[0], p[2] - p[0]));
+        vector<char> isOpaque((n + 1) * (n + 1), 0);
+        bool allOpaque = true;
+        for(int i = 0; i <= n; ++i) {
+            for(int j = 0; i + j <= n; ++j) {
+                float b1 = i * step;
+                float b2 = j * step;
+                float b0 = 1.0f - b1 - b2;
+                Fragment fragment(b0 * p[0] + b1 * p[1] + b2 * p[2], normal,
+                    b0 * uv[0] + b1 * uv[1] + b2 * uv[2], 
+                    Vector3::Zero, Vector3::Zero);
+                bool opaque = mAlphaMask->lookup(fragment) >= sOpaqueAlpha;
+                isOpaque[i * (n + 1) + j] = opaque;
+                allOpaque = allOpaque && opaque;
+            }
+        }
+        if(allOpaque) {
+            return AlphaOpaque;
+        }
+        for(int ci = 0; ci < sAlphaCoverageRes; ++ci) {
+            for(int cj = 0; ci + cj < sAlphaCoverageRes; ++cj) {
+                bool opaque = true;
+                for(int i = ci * cellSamples; 
+                    i <= (ci + 1) * cellSamples && opaque; ++i) {
+                    for(int j = cj * cellSamples; 
+                        j <= (cj + 1) * cellSamples && i + j <= n; ++j) {
+                        if(!isOpaque[i * (n + 1) + j]) {
+                            opaque = false;
+                            break;
+                        }
+                    }
+                }
+                if(opaque) {
+                    *coverage |= (uint64_t)1 << 
+                        (ci * sAlphaCoverageRes + cj);
+                }
+            }
+        }
+        return *coverage != 0 ? AlphaPartial : AlphaTransparent;
+    }
+
     static BumpShaders getBumpShaders(const ParamSet& params,
         const SceneCache& sceneCache) {
         FloatTexturePtr bump;
@@ -8,6 +8,7 @@
 
 namespace Goblin {
     class Fragment;
+    class Geometry;
     class Vector3;
     class Matrix3;
     class Ray;
@@ -27,6 +28,34 @@ namespace Goblin {
             BSDFDiffuse | BSDFGlossy | BSDFSpecular | BSDFNull
     };
 
+    // load time classification of a triangle against the material alpha
+    enum AlphaClass {
+        // no index-matched component anywhere on the triangle
+        AlphaOpaque,
+        // index-matched component everywhere, or can't tell
+        AlphaTransparent,
+        // opaque in the cells flagged in the alpha coverage
+        AlphaPartial
+    };
+
+    // alpha coverage is a bit for each cell of a 8x8 grid laid over the
+    // barycentric coordinate (b1, b2) of the triangle, set if the alpha
+    // is 1 all over the cell. return the bit index of the cell (b1, b2)
+    // falls in, the triangle only covers the cells with i + j < 8
+    static const int sAlphaCoverageRes = 8;
+
+    inline int alphaCoverageCell(float b1, float b2) {
+        int i = clamp((int)(b1 * sAlphaCoverageRes), 0, 
+            sAlphaCoverageRes - 1);
+        int j = clamp((int)(b2 * sAlphaCoverageRes), 0, 
+            sAlphaCoverageRes - 1);
+        return i * sAlphaCoverageRes + j;
+    }
+
+    inline bool isAlphaCovered(uint64_t coverage, float b1, float b2) {
+        return (coverage >> alphaCoverageCell(b1, b2)) & 1;
+    }
+
     enum BSDFMode {
         BSDFRadiance,
         BSDFImportance
@@ -153,6 +182,12 @@ namespace Goblin {
 
         virtual const BSSRDF* getBSSRDF() const;
 
+        // classify the triangle geometry at load time and fill in its
+        // alpha coverage for AlphaPartial, so that rays can tell
+        // whether a hit lets them through without shading it
+        virtual AlphaClass classifyAlpha(const Geometry* geometry,
+            uint64_t* coverage) const;
+
         BSDFType getType() const;
 
         // material util to get the fresnel factor
@@ -197,6 +232,12 @@ namespace Goblin {
         return NULL;
     }
 
+    inline AlphaClass Material::classifyAlpha(const Geometry* geometry,
+        uint64_t* coverage) const {
+        *coverage = 0;
+        return (mType & BSDFNull) ? AlphaTransparent : AlphaOpaque;
+    }
+
     inline BSDFType Material::getType() const {
         return mType;
     }
@@ -444,6 +485,9 @@ namespace Goblin {
         float pdf(const Fragment& fragment, 
             const Vector3& wo, const Vector3& wi, BSDFType type) const;
 
+        AlphaClass classifyAlpha(const Geometry* geometry,
+            uint64_t* coverage) const;
+
         // override the bump mapping since it's the masked material
         // should do the job
         void perturb(Fragment* fragment) const;
@@ -4,6 +4,8 @@
 #include "GoblinParamSet.h"
 #include "GoblinScene.h"
 #include "GoblinLight.h"
+#include "GoblinMaterial.h"
+#include "GoblinRay.h"
 
 namespace Goblin {
     vector<Model*> Model::refinedModels;
@@ -11,22 +13,81 @@ namespace Goblin {
     Model::Model(const Geometry* geometry, const MaterialPtr& material,
         const AreaLight* areaLight, bool isCameraLens):
         mGeometry(geometry), mMaterial(material), mAreaLight(areaLight),
-        mIsCameraLens(isCameraLens) {}
+        mIsCameraLens(isCameraLens) {
+        computeRayFlags();
+    }
+
+    void Model::computeRayFlags() {
+        AlphaClass alphaClass = mMaterial->classifyAlpha(mGeometry, 
+            &mAlphaCoverage);
+        if(alphaClass == AlphaOpaque) {
+            mRayFlags = RayFlagOpaque;
+        } else if(alphaClass == AlphaTransparent) {
+            mRayFlags = RayFlagTransparent;
+        } else {
+            mRayFlags = RayFlagAll;
+        }
+    }
+
+    bool Model::intersectCoverage(const Ray& ray, float* epsilon,
+        Fragment* fragment) const {
+        float maxt = ray.maxt;
+        Fragment f;
+        if(!mGeometry->intersect(ray, epsilon, &f)) {
+            return false;
+        }
+        // barycentric coordinate of the hit, solved the same way as
+        // Triangle::intersect so the accelerators land on the same cell
+        Vector3 p0, p1, p2;
+        mGeometry->getTriangle(&p0, &p1, &p2);
+        Vector3 e1 = p1 - p0;
+        Vector3 e2 = p2 - p0;
+        Vector3 s = ray.o - p0;
+        Vector3 s1 = cross(ray.d, e2);
+        Vector3 s2 = cross(s, e1);
+        float invDivisor = 1.0f / dot(s1, e1);
+        float b1 = dot(s, s1) * invDivisor;
+        float b2 = dot(ray.d, s2) * invDivisor;
+        uint32_t hitFlags = isAlphaCovered(mAlphaCoverage, b1, b2) ?
+            RayFlagOpaque : RayFlagTransparent;
+        if((hitFlags & ray.mask) != ray.mask) {
+            ray.maxt = maxt;
+            return false;
+        }
+        *fragment = f;
+        return true;
+    }
 
     bool Model::intersect(const Ray& ray, IntersectFilter f) const {
+        if((mRayFlags & ray.mask) != ray.mask) {
+            return false;
+        }
         if(f != NULL && !f(this, ray)) {
             return false;
         }
+        if(mAlphaCoverage != 0 && ray.mask != 0) {
+            // any hit test leaves ray.maxt alone
+            float maxt = ray.maxt;
+            float epsilon;
+            Fragment fragment;
+            bool hit = intersectCoverage(ray, &epsilon, &fragment);
+            ray.maxt = maxt;
+            return hit;
+        }
         return mGeometry->intersect(ray);
     }
 
     bool Model::intersect(const Ray& ray, float* epsilon, 
         Intersection* intersection, IntersectFilter f) const {
+        if((mRayFlags & ray.mask) != ray.mask) {
+            return false;
+        }
         if(f != NULL && !f(this, ray)) {
             return false;
         }
-        bool hit = mGeometry->intersect(ray, epsilon, 
-            &intersection->fragment);
+        bool hit = (mAlphaCoverage != 0 && ray.mask != 0) ?
+            intersectCoverage(ray, epsilon, &intersection->fragment) :
+            mGeometry->intersect(ray, epsilon, &intersection->fragment);
         if(hit) {
             intersection->primitive = this;
         }
@@ -79,7 +140,9 @@ namespace Goblin {
         if(!model->intersectable()) {
             PrimitiveList primitives;
             primitives.push_back(model);
-            Primitive* aggregate = new BVH(primitives, 1, "equal_count");
+            Primitive* aggregate = new BVH(primitives, 
+                sceneCache.getAcceleratorParams(),
+                sceneCache.getBuildThreadPool());
             Primitive::allocatedPrimitives.push_back(aggregate);
             return aggregate;
         } else {
@@ -18,10 +18,19 @@ namespace Goblin {
 
         BBox getAABB() const;
 
+        bool getTriangle(Vector3* p0, Vector3* p1, Vector3* p2) const;
+
+        bool getTriangleHit(const Ray& ray, float t, float b1, float b2,
+            float* epsilon, Intersection* intersection) const;
+
         const MaterialPtr& getMaterial() const;
 
         const AreaLight* getAreaLight() const;
 
+        uint32_t getRayFlags() const;
+
+        uint64_t getAlphaCoverage() const;
+
         void refine(PrimitiveList& refinedPrimitives) const;
 
         void collectRenderList(RenderList& rList,
@@ -34,14 +43,21 @@ namespace Goblin {
             const AreaLight* areaLight = NULL, bool isCameraLens = false);
         // For chunk allocation refined models, 
         // allocate first then set geometry
-        Model(): mGeometry(NULL), mAreaLight(NULL), mIsCameraLens(false) {}
+        Model(): mGeometry(NULL), mAreaLight(NULL), mIsCameraLens(false),
+            mRayFlags(RayFlagAll), mAlphaCoverage(0) {}
         void init(const Geometry* geometry, const MaterialPtr& material,
             const AreaLight* areaLight);
+        void computeRayFlags();
+        // resolve the alpha coverage cell the hit lands on
+        bool intersectCoverage(const Ray& ray, float* epsilon,
+            Fragment* fragment) const;
     private:
         const Geometry* mGeometry;
         MaterialPtr mMaterial;
         const AreaLight* mAreaLight;
         bool mIsCameraLens;
+        uint32_t mRayFlags;
+        uint64_t mAlphaCoverage;
         // used to keep the refined models generated by refine method
         static vector<Model*> refinedModels;
     friend class ModelPrimitiveCreator;
@@ -51,6 +67,21 @@ namespace Goblin {
         return mGeometry->intersectable(); 
     }
 
+    inline bool Model::getTriangle(Vector3* p0, Vector3* p1, 
+        Vector3* p2) const {
+        return mGeometry->getTriangle(p0, p1, p2);
+    }
+
+    inline bool Model::getTriangleHit(const Ray& ray, float t, float b1,
+        float b2, float* epsilon, Intersection* intersection) const {
+        if(!mGeometry->getTriangleFragment(ray, t, b1, b2, epsilon,
+            &intersection->fragment)) {
+            return false;
+        }
+        intersection->primitive = this;
+        return true;
+    }
+
     inline bool Model::isCameraLens() const {
         return mIsCameraLens;
     }
@@ -63,11 +94,20 @@ namespace Goblin {
         return mAreaLight;
     }
 
+    inline uint32_t Model::getRayFlags() const {
+        return mRayFlags;
+    }
+
+    inline uint64_t Model::getAlphaCoverage() const {
+        return mAlphaCoverage;
+    }
+
     inline void Model::init(const Geometry* geometry, 
         const MaterialPtr& material, const AreaLight* areaLight) {
         mGeometry = geometry;
         mMaterial = material;
         mAreaLight = areaLight;
+        computeRayFlags();
     }
 
     inline void Model::clearRefinedModels() {
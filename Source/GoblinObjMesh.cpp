@@ -304,6 +304,21 @@ namespace Goblin {
         }
     }
 
+    void ObjMesh::setPositions(const std::vector<Vector3>& positions) {
+        if(positions.size() != mVertices.size()) {
+            std::cerr << "mesh '" << mFilename << "' has " << 
+                mVertices.size() << " vertices, can't set " << 
+                positions.size() << " positions" << std::endl;
+            return;
+        }
+        mBBox = BBox();
+        for(size_t i = 0; i < mVertices.size(); ++i) {
+            mVertices[i].position = positions[i];
+            mBBox.expand(positions[i]);
+        }
+        recalculateArea();
+    }
+
     void ObjMesh::recalculateArea() {
         mArea = 0.0f;
         for(size_t i = 0; i < mTriangles.size(); ++i) {
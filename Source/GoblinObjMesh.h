@@ -28,6 +28,10 @@ namespace Goblin {
         const TriangleIndex* getFacePtr(size_t index) const;
 
         bool load();
+        // move the vertices for animation/edit, positions need to match
+        // the vertex count. normals are kept as they are. accelerators
+        // built on top of this mesh need a BVH::refit afterward
+        void setPositions(const std::vector<Vector3>& positions);
         bool hasNormal() const;
         bool hasTexCoord() const;
     private:
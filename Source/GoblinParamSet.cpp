@@ -1,4 +1,5 @@
 #include "GoblinParamSet.h"
+#include "GoblinUtils.h"
 
 namespace Goblin {
     void ParamSet::setBool(const std::string& key, bool b) {
@@ -270,4 +271,34 @@ namespace Goblin {
         }
         return d;
     }
+
+    template<typename T>
+    static uint64_t hashItemValue(const T& value, uint64_t hash) {
+        return hashBytes(&value, sizeof(T), hash);
+    }
+
+    static uint64_t hashItemValue(const std::string& value, uint64_t hash) {
+        return hashBytes(value.data(), value.size(), hash);
+    }
+
+    // the item hashes get summed up, an override that erased and
+    // appended an item doesn't change the result
+    template<typename T>
+    static uint64_t hashItems(const std::vector<ParamSetItem<T> >& items,
+        uint32_t type) {
+        uint64_t sum = 0;
+        for(size_t i = 0; i < items.size(); ++i) {
+            uint64_t hash = hashBytes(&type, sizeof(type));
+            hash = hashBytes(items[i].key.data(), items[i].key.size(), hash);
+            sum += hashItemValue(items[i].data, hash);
+        }
+        return sum;
+    }
+
+    uint64_t ParamSet::hash() const {
+        return hashItems(mBools, 0) + hashItems(mInts, 1) +
+            hashItems(mFloats, 2) + hashItems(mVec2s, 3) +
+            hashItems(mVec3s, 4) + hashItems(mVec4s, 5) +
+            hashItems(mColors, 6) + hashItems(mStrings, 7);
+    }
 }
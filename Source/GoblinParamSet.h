@@ -65,6 +65,8 @@ namespace Goblin {
             const Color& d = Color::White) const;
         std::string getString(const std::string& key,
             const std::string& = "") const;
+        // hash of all the items, doesn't depend on the order they got set
+        uint64_t hash() const;
 
     private:
         // TODO chage this to map...
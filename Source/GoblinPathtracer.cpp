@@ -2,14 +2,6 @@
 #include "GoblinRay.h"
 
 namespace Goblin {
-    static bool isOpaque(const Primitive* p, const Ray& r) {
-        return !(p->getMaterial()->getType() & BSDFNull);
-    }
-    
-    static bool notOpaque(const Primitive* p, const Ray& r) {
-        return !isOpaque(p, r);
-    }
-
     PathTracer::PathTracer(int samplePerPixel, int threadNum, 
         int maxRayDepth, int bssrdfSampleNum): 
         Renderer(samplePerPixel, threadNum),
@@ -23,11 +15,12 @@ namespace Goblin {
         Color throughput(1.0f);
         float maxt = ray.maxt;
         Ray currentRay(ray);
+        // only the index-matched surfaces attenuate
+        currentRay.mask = RayFlagTransparent;
         float epsilon;
         Intersection intersection;
         while(true) {
-            if(!scene->intersect(currentRay,
-                &epsilon, &intersection, &notOpaque)) {
+            if(!scene->intersect(currentRay, &epsilon, &intersection)) {
                 break;
             } 
             const MaterialPtr& material = intersection.getMaterial();
@@ -96,8 +89,8 @@ namespace Goblin {
             Color L = light->sampleL(p, epsilon, ls, &wi, &lightPdf, &shadowRay);
             if(L != Color::Black && lightPdf > 0.0f) {
                 Color f = material->bsdf(fragment, wo, wi);
-                if(f != Color::Black && 
-                    !scene->intersect(shadowRay, &isOpaque)) {
+                shadowRay.mask = RayFlagOpaque;
+                if(f != Color::Black && !scene->intersect(shadowRay)) {
                     // calculate the transmittance alone index-matched material
                     Color tr = evalAttenuation(scene, shadowRay,
                         BSDFSample(rng)); 
@@ -145,8 +138,8 @@ namespace Goblin {
                 Intersection lightIntersect;
                 float lightEpsilon;
                 Ray r(p, wi, epsilon);
-                if(scene->intersect(r, &lightEpsilon, 
-                    &lightIntersect, &isOpaque)) {
+                r.mask = RayFlagOpaque;
+                if(scene->intersect(r, &lightEpsilon, &lightIntersect)) {
                     Color tr = evalAttenuation(scene, r, BSDFSample(rng));
                     if(lightIntersect.primitive->getAreaLight() == light) {
                         Color Li = lightIntersect.Le(-wi);
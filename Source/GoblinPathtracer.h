@@ -13,14 +13,14 @@ namespace Goblin {
         Color Li(const ScenePtr& scene, const RayDifferential& ray,
             const Sample& sample, const RNG& rng,
             RenderingTLS* tls) const;
-    private:
+    protected:
         // evaluate index-matched material attenuation along the ray
         Color evalAttenuation(const ScenePtr& scene, const Ray& ray,
             const BSDFSample& bs) const;
         
         void querySampleQuota(const ScenePtr& scene,
             SampleQuota* sampleQuota);
-    private:
+    protected:
         int mMaxRayDepth;
         int mBssrdfSampleNum;
     };
@@ -6,6 +6,26 @@
 namespace Goblin {
     vector<Primitive*> Primitive::allocatedPrimitives;
 
+    uint64_t Primitive::intersectPacket(const RayPacket& packet,
+        uint64_t activeMask, float* epsilons, 
+        Intersection* intersections, IntersectFilter f) const {
+        uint64_t hitMask = 0;
+        for(int g = 0; g < packet.getGroupsNum(); ++g) {
+            if(((activeMask >> (4 * g)) & 0xf) == 0) {
+                continue;
+            }
+            for(int i = 4 * g; i < 4 * g + 4; ++i) {
+                uint64_t rayBit = (uint64_t)1 << i;
+                if((activeMask & rayBit) && intersect(packet.getRay(i), 
+                    &epsilons[i], &intersections[i], f)) {
+                    packet.updateMaxt(i);
+                    hitMask |= rayBit;
+                }
+            }
+        }
+        return hitMask;
+    }
+
     Color Intersection::Le(const Vector3& outDirection) {
         Vector3 ps = fragment.getPosition();
         Vector3 ns = fragment.getNormal();
@@ -99,33 +119,68 @@ namespace Goblin {
 
     InstancedPrimitive::InstancedPrimitive(const Transform& toWorld, 
         const Primitive* primitive):
-        mToWorld(toWorld), mPrimitive(primitive) {}
+        mToWorld(toWorld), mPrimitive(primitive) {
+        cacheTransforms();
+    }
 
     InstancedPrimitive::InstancedPrimitive(const Vector3& position, 
         const Quaternion& orientation,
         const Vector3& scale, const Primitive* primitive):
-        mToWorld(position, orientation, scale), mPrimitive(primitive) {}
+        mToWorld(position, orientation, scale), mPrimitive(primitive) {
+        cacheTransforms();
+    }
+
+    void InstancedPrimitive::cacheTransforms() {
+        mWorldToObject = AffineTransform(mToWorld.getInverse());
+        mObjectToWorld = AffineTransform(mToWorld.getMatrix());
+        mNormalToWorld = AffineTransform(mToWorld.getInverse().transpose());
+    }
 
     bool InstancedPrimitive::intersect(const Ray& ray, 
         IntersectFilter f) const {
-        Ray r = mToWorld.invertRay(ray);
+        Ray r = mWorldToObject.onRay(ray);
         return mPrimitive->intersect(r, f);
     }
 
     bool InstancedPrimitive::intersect(const Ray& ray, float* epsilon, 
         Intersection* intersection, IntersectFilter f) const {
-        Ray r = mToWorld.invertRay(ray);
+        Ray r = mWorldToObject.onRay(ray);
         bool hit = mPrimitive->intersect(r, epsilon, intersection, f);
         if(hit) {
-            intersection->fragment.transform(mToWorld);
+            intersection->fragment.transform(mObjectToWorld, mNormalToWorld);
             ray.maxt = r.maxt;
         }
         return hit;
     }
 
+    uint64_t InstancedPrimitive::intersectPacket(const RayPacket& packet,
+        uint64_t activeMask, float* epsilons, 
+        Intersection* intersections, IntersectFilter f) const {
+        Ray rays[RayPacket::MaxSize];
+        RayPacket localPacket;
+        for(int i = 0; i < packet.getSize(); ++i) {
+            rays[i] = mWorldToObject.onRay(packet.getRay(i));
+            localPacket.addRay(&rays[i]);
+        }
+        uint64_t hitMask = mPrimitive->intersectPacket(localPacket,
+            activeMask, epsilons, intersections, f);
+        for(int i = 0; i < packet.getSize(); ++i) {
+            if(hitMask & ((uint64_t)1 << i)) {
+                intersections[i].fragment.transform(mObjectToWorld,
+                    mNormalToWorld);
+                packet.getRay(i).maxt = rays[i].maxt;
+                packet.updateMaxt(i);
+            }
+        }
+        return hitMask;
+    }
 
     BBox InstancedPrimitive::getAABB() const {
-        return mToWorld.onBBox(mPrimitive->getAABB());
+        return mPrimitive->getWorldAABB(mToWorld);
+    }
+
+    uint32_t InstancedPrimitive::getRayFlags() const {
+        return mPrimitive->getRayFlags();
     }
 
     const Vector3& InstancedPrimitive::getPosition() const {
@@ -144,6 +199,11 @@ namespace Goblin {
         return mToWorld.getMatrix();
     }
 
+    void InstancedPrimitive::setTransform(const Transform& toWorld) {
+        mToWorld = toWorld;
+        cacheTransforms();
+    }
+
     void InstancedPrimitive::collectRenderList(RenderList& rList, 
         const Matrix4& m) const {
         mPrimitive->collectRenderList(rList, m * mToWorld.getMatrix());
@@ -204,6 +264,14 @@ namespace Goblin {
         return mAABB;
     }
 
+    uint32_t Aggregate::getRayFlags() const {
+        uint32_t rayFlags = 0;
+        for(size_t i = 0; i < mRefinedPrimitives.size(); ++i) {
+            rayFlags |= mRefinedPrimitives[i]->getRayFlags();
+        }
+        return rayFlags;
+    }
+
 
     Primitive* InstancePrimitiveCreator::create(const ParamSet& params,
         const SceneCache& sceneCache) const {
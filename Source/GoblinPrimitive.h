@@ -14,6 +14,7 @@
 namespace Goblin {
     class Ray;
     class RayDifferential;
+    class RayPacket;
     /* temp notes:
     three kinds of primitive: instance, model, aggregate
     model = geometry + material
@@ -67,6 +68,17 @@ namespace Goblin {
 
     typedef bool (*IntersectFilter)(const Primitive* p, const Ray& ray);
 
+    // flags primitives carry so rays can pick what they hit with
+    // Ray::mask instead of an IntersectFilter callback. acceleration
+    // structures keep the union of them per node to cull subtrees
+    enum RayFlag {
+        // material without index-matched component, blocks shadow rays
+        RayFlagOpaque = 1 << 0,
+        // material with index-matched component rays can go through
+        RayFlagTransparent = 1 << 1,
+        RayFlagAll = RayFlagOpaque | RayFlagTransparent
+    };
+
     class Primitive {
     public:
         virtual ~Primitive() {}
@@ -81,14 +93,45 @@ namespace Goblin {
         virtual bool intersect(const Ray& ray, float* epsilon, 
             Intersection* intersection, IntersectFilter f = NULL) const = 0;
 
+        // closest hit test for the rays in packet flagged in activeMask,
+        // return the mask of rays that found a closer intersection.
+        // default implementation tests the rays one by one
+        virtual uint64_t intersectPacket(const RayPacket& packet,
+            uint64_t activeMask, float* epsilons, 
+            Intersection* intersections, IntersectFilter f = NULL) const;
+
         virtual BBox getAABB() const = 0;
 
+        // world bounds when this primitive gets instanced with toWorld,
+        // aggregates can provide tighter bounds than transforming
+        // the corners of getAABB
+        virtual BBox getWorldAABB(const Transform& toWorld) const;
+
+        // return true and fill in the world space vertex positions
+        // if this primitive is a single triangle
+        virtual bool getTriangle(Vector3* p0, Vector3* p1, 
+            Vector3* p2) const;
+
+        // fill in the intersection of a hit the accelerator found with
+        // its own triangle test, see Geometry::getTriangleFragment
+        virtual bool getTriangleHit(const Ray& ray, float t, float b1,
+            float b2, float* epsilon, Intersection* intersection) const;
+
         virtual const MaterialPtr& getMaterial() const;
 
         virtual const AreaLight* getAreaLight() const;
 
         virtual bool isCameraLens() const;
 
+        // RayFlag bits of this primitive, aggregates and instances
+        // return the union of the primitives they contain
+        virtual uint32_t getRayFlags() const;
+
+        // alpha coverage of a triangle primitive with RayFlagAll set,
+        // hits on the covered cells count as RayFlagOpaque and the rest
+        // as RayFlagTransparent. 0 if there isn't one
+        virtual uint64_t getAlphaCoverage() const;
+
         virtual void collectRenderList(RenderList& rList, 
             const Matrix4& m = Matrix4::Identity) const = 0;
 
@@ -106,6 +149,21 @@ namespace Goblin {
         throw std::exception();
     }
 
+    inline BBox Primitive::getWorldAABB(const Transform& toWorld) const {
+        return toWorld.onBBox(getAABB());
+    }
+
+    inline bool Primitive::getTriangle(Vector3* p0, Vector3* p1,
+        Vector3* p2) const {
+        return false;
+    }
+
+    inline bool Primitive::getTriangleHit(const Ray& ray, float t,
+        float b1, float b2, float* epsilon,
+        Intersection* intersection) const {
+        return false;
+    }
+
     // TODO meh......instance should have the right to do 
     //material override, add it in later...
     inline const MaterialPtr& Primitive::getMaterial() const {
@@ -123,6 +181,14 @@ namespace Goblin {
         throw std::exception();
     }
 
+    inline uint32_t Primitive::getRayFlags() const {
+        return RayFlagAll;
+    }
+
+    inline uint64_t Primitive::getAlphaCoverage() const {
+        return 0;
+    }
+
     inline void Primitive::clearAllocatedPrimitives() {
         for(size_t i = 0; i < allocatedPrimitives.size(); ++i) {
             delete allocatedPrimitives[i];
@@ -135,12 +201,19 @@ namespace Goblin {
         bool intersect(const Ray& ray, IntersectFilter f) const; 
         bool intersect(const Ray& ray, float* epsilon, 
             Intersection* intersection, IntersectFilter f) const;
+        uint64_t intersectPacket(const RayPacket& packet,
+            uint64_t activeMask, float* epsilons, 
+            Intersection* intersections, IntersectFilter f) const;
 
         BBox getAABB() const;
+        uint32_t getRayFlags() const;
         const Vector3& getPosition() const;
         const Quaternion& getOrientation() const;
         const Vector3& getScale() const;
         const Matrix4& getWorldMatrix();
+        // move the instance, the aggregate containing it needs
+        // a BVH::refit afterward
+        void setTransform(const Transform& toWorld);
         void collectRenderList(RenderList& rList, 
             const Matrix4& m = Matrix4::Identity) const;
     private:
@@ -150,8 +223,14 @@ namespace Goblin {
             const Quaternion& orientation,
             const Vector3& scale, const Primitive* primitive);
 
+        void cacheTransforms();
+
     private:
         Transform mToWorld;
+        // 3x4 affine copies of mToWorld used during intersection
+        AffineTransform mWorldToObject;
+        AffineTransform mObjectToWorld;
+        AffineTransform mNormalToWorld;
         const Primitive* mPrimitive;
     friend class InstancePrimitiveCreator;
     };
@@ -166,6 +245,7 @@ namespace Goblin {
         void collectRenderList(RenderList& rList, 
             const Matrix4& m = Matrix4::Identity) const;
         BBox getAABB() const;
+        uint32_t getRayFlags() const;
     protected:
         PrimitiveList mInputPrimitives;
         PrimitiveList mRefinedPrimitives;
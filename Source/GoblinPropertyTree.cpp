@@ -1,6 +1,9 @@
 #include "GoblinPropertyTree.h"
+#include "GoblinUtils.h"
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/lexical_cast.hpp>
+#include <iostream>
+#include <sstream>
 
 namespace Goblin {
     using boost::lexical_cast;
@@ -35,6 +38,21 @@ namespace Goblin {
         }
     }
 
+    bool PropertyTree::parse(const std::string& json) {
+        try {
+            std::istringstream in(json);
+            ptree pt;
+            read_json(in, pt);
+            *this = PropertyTree(pt);
+            return true;
+        }
+        catch(boost::property_tree::json_parser::json_parser_error e) {
+            std::cerr <<"error parsing json " << json << std::endl;
+            std::cerr <<e.what() << std::endl;
+            return false;
+        }
+    }
+
     const PtreeList& PropertyTree::getChildren() const {
         return mChildren;
     }
@@ -121,4 +139,20 @@ namespace Goblin {
         return rv;
     }
 
+
+    static uint64_t hashPtree(const ptree& pt, uint64_t hash) {
+        hash = hashBytes(pt.data().data(), pt.data().size(), hash);
+        for(ptree::const_iterator it = pt.begin(); it != pt.end(); it++) {
+            hash = hashBytes(it->first.data(), it->first.size(), hash);
+            hash = hashPtree(it->second, hash);
+        }
+        // closes the children list so moving a node a level up or down
+        // comes out different
+        char end = 0;
+        return hashBytes(&end, 1, hash);
+    }
+
+    uint64_t PropertyTree::hash(uint64_t seed) const {
+        return hashPtree(mPtree, seed);
+    }
 }
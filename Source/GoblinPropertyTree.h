@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 #include <boost/property_tree/ptree.hpp>
 
 namespace Goblin {
@@ -15,6 +16,8 @@ namespace Goblin {
         PropertyTree(const ptree& pt);
         PropertyTree() {};
         bool read(const std::string& fileName);
+        // same as read but from a json document in memory
+        bool parse(const std::string& json);
         const PtreeList& getChildren() const;
         bool getChildren(const char* key, PtreeList* children) const;
         bool hasChild(const char* key) const;
@@ -24,6 +27,9 @@ namespace Goblin {
         int parseInt(const char* key, int fallback = 0) const;
         std::string parseString(const char* key, const char* fallback = "") const;
         std::vector<float> parseFloatArray(const char* key) const;
+        // hash of the keys and values all the way down, formatting of
+        // the file doesn't change it
+        uint64_t hash(uint64_t seed) const;
 
     private:
         ptree mPtree;
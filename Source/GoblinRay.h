@@ -16,14 +16,17 @@ namespace Goblin {
         Vector3 d;
         mutable float mint, maxt;
         int depth;
+        // RayFlag bits a primitive needs to have all of to get hit,
+        // 0 to hit everything
+        uint32_t mask;
     };
     
     inline Ray::Ray(): o(Vector3::Zero), d(Vector3::Zero),
-        mint(0), maxt(INFINITY), depth(0) {}
+        mint(0), maxt(INFINITY), depth(0), mask(0) {}
 
     inline Ray::Ray(const Vector3& origin, const Vector3& dir, 
         float start, float end, int depth): o(origin), d(dir), 
-        mint(start), maxt(end), depth(depth) {}
+        mint(start), maxt(end), depth(depth), mask(0) {}
 
     inline Vector3 Ray::operator()(float t) const {
         return o + t * d;
@@ -49,6 +52,111 @@ namespace Goblin {
         const Vector3& dir, float start, float end, int depth):
         Ray(origin, dir, start, end, depth),
         hasDifferential(false) {}
+
+
+    // a bundle of coherent rays (ex: camera rays of neighbor samples)
+    // that traverse the acceleration structure together. origins and
+    // reciprocal directions are stored SoA so 4 rays can be tested 
+    // against a box with SSE, and the origin/direction intervals of
+    // the whole packet are used to cull boxes none of the rays can hit
+    class RayPacket {
+    public:
+        RayPacket();
+        void clear();
+        void addRay(const Ray* ray);
+        int getSize() const;
+        int getGroupsNum() const;
+        const Ray& getRay(int i) const;
+        // sync the packet maxt after ray i found a closer intersection
+        void updateMaxt(int i) const;
+    public:
+        static const int MaxSize = 64;
+        float ox[MaxSize], oy[MaxSize], oz[MaxSize];
+        float invDx[MaxSize], invDy[MaxSize], invDz[MaxSize];
+        float mint[MaxSize];
+        mutable float maxt[MaxSize];
+        Vector3 oMin, oMax;
+        Vector3 invDirMin, invDirMax;
+        float mintMin;
+        // axis with all the ray directions in the same sign
+        bool isCoherent[3];
+        uint32_t dirIsNeg[3];
+        // mask bits set in all the rays
+        uint32_t commonMask;
+    private:
+        const Ray* mRays[MaxSize];
+        int mSize;
+    };
+
+    inline RayPacket::RayPacket() {
+        clear();
+    }
+
+    inline void RayPacket::clear() {
+        mSize = 0;
+        oMin = invDirMin = Vector3(INFINITY, INFINITY, INFINITY);
+        oMax = invDirMax = Vector3(-INFINITY, -INFINITY, -INFINITY);
+        mintMin = INFINITY;
+        for(int i = 0; i < 3; ++i) {
+            isCoherent[i] = true;
+            dirIsNeg[i] = 0;
+        }
+        commonMask = 0xffffffff;
+    }
+
+    inline void RayPacket::addRay(const Ray* ray) {
+        int i = mSize++;
+        // unused lanes of the last group never hit anything
+        if(i % 4 == 0) {
+            for(int j = i + 1; j < i + 4; ++j) {
+                ox[j] = oy[j] = oz[j] = 0.0f;
+                invDx[j] = invDy[j] = invDz[j] = 0.0f;
+                mint[j] = INFINITY;
+                maxt[j] = -INFINITY;
+            }
+        }
+        mRays[i] = ray;
+        Vector3 invDir(1.0f / ray->d.x, 1.0f / ray->d.y, 1.0f / ray->d.z);
+        ox[i] = ray->o.x;
+        oy[i] = ray->o.y;
+        oz[i] = ray->o.z;
+        invDx[i] = invDir.x;
+        invDy[i] = invDir.y;
+        invDz[i] = invDir.z;
+        mint[i] = ray->mint;
+        maxt[i] = ray->maxt;
+        mintMin = min(mintMin, ray->mint);
+        commonMask &= ray->mask;
+        for(int axis = 0; axis < 3; ++axis) {
+            oMin[axis] = min(oMin[axis], ray->o[axis]);
+            oMax[axis] = max(oMax[axis], ray->o[axis]);
+            invDirMin[axis] = min(invDirMin[axis], invDir[axis]);
+            invDirMax[axis] = max(invDirMax[axis], invDir[axis]);
+            uint32_t isNeg = ray->d[axis] < 0.0f;
+            if(i == 0) {
+                dirIsNeg[axis] = isNeg;
+            }
+            if(ray->d[axis] == 0.0f || isNeg != dirIsNeg[axis]) {
+                isCoherent[axis] = false;
+            }
+        }
+    }
+
+    inline int RayPacket::getSize() const {
+        return mSize;
+    }
+
+    inline int RayPacket::getGroupsNum() const {
+        return (mSize + 3) / 4;
+    }
+
+    inline const Ray& RayPacket::getRay(int i) const {
+        return *mRays[i];
+    }
+
+    inline void RayPacket::updateMaxt(int i) const {
+        maxt[i] = mRays[i]->maxt;
+    }
 }
 
 #endif //GOBLIN_RAY_H
@@ -1,5 +1,7 @@
 #ifndef GOBLIN_RENDER_CONTEXT_H
 #define GOBLIN_RENDER_CONTEXT_H
+#include "GoblinCamera.h"
+#include "GoblinFilm.h"
 #include "GoblinRenderer.h"
 #include "GoblinScene.h"
 
@@ -9,6 +11,9 @@ namespace Goblin {
         RenderContext(RendererPtr renderer, ScenePtr scene):
           mRenderer(renderer), mScene(scene) {}
         void render();
+        // render only one part of the image, see RenderPartition
+        void setPartition(RenderPartition partition);
+        bool mergeParts(const vector<string>& parts);
 
     public:
         RendererPtr mRenderer;
@@ -19,6 +24,29 @@ namespace Goblin {
         mRenderer->preprocess(mScene);
         mRenderer->render(mScene);
     }
+
+    inline void RenderContext::setPartition(RenderPartition partition) {
+        if(partition.mode == RenderPartition::Samples &&
+            !mRenderer->supportSamplePartition()) {
+            cout << "renderer can't split samples, split crop instead" <<
+                endl;
+            partition.mode = RenderPartition::Crop;
+        } else if(partition.mode == RenderPartition::Crop &&
+            !mRenderer->supportCropPartition()) {
+            cout << "renderer can't split crop, split samples instead" <<
+                endl;
+            partition.mode = RenderPartition::Samples;
+        }
+        if(partition.mode == RenderPartition::Crop) {
+            mScene->getCamera()->getFilm()->setSampleBand(partition.index,
+                partition.count);
+        }
+        mRenderer->setPartition(partition);
+    }
+
+    inline bool RenderContext::mergeParts(const vector<string>& parts) {
+        return mRenderer->mergeParts(mScene, parts);
+    }
 }
 
 #endif //GOBLIN_RENDER_CONTEXT_H
\ No newline at end of file
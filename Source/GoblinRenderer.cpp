@@ -5,9 +5,14 @@
 #include "GoblinFilm.h"
 #include "GoblinUtils.h"
 #include "GoblinVolume.h"
+#include <algorithm>
 
 namespace Goblin {
 
+    static const int sTilesPerThread = 16;
+    static const int sMinTileSize = 8;
+    static const int sMaxTileSize = 32;
+
     RenderTask::RenderTask(Renderer* renderer, const CameraPtr& camera,
         const ScenePtr& scene, const SampleRange& sampleRange,
         const SampleQuota& sampleQuota, int samplePerPixel,
@@ -29,9 +34,18 @@ namespace Goblin {
     void RenderTask::run(TLSPtr& tls) {
         RenderingTLS* renderingTLS =
             static_cast<RenderingTLS*>(tls.get());
-        ImageTile* tile = renderingTLS->getTile();
+        ImageTile* tile = renderingTLS->getLocalTile(mSampleRange);
 
-        Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, mRNG);
+        SampleRange sampleRange(mSampleRange);
+        Sampler sampler(sampleRange, mSamplePerPixel, mSampleQuota, mRNG);
+        if(mRenderer->supportRayPacket()) {
+            renderPackets(sampler, tile, renderingTLS, &sampleRange);
+            mCamera->getFilm()->mergeTile(*tile);
+            if(mRenderProgress) {
+                mRenderProgress->update();
+            }
+            return;
+        }
         int batchAmount = sampler.maxSamplesPerRequest();
         Sample* samples = sampler.allocateSampleBuffer(batchAmount);
         int sampleNum = 0;
@@ -46,9 +60,173 @@ namespace Goblin {
                 tile->addSample(samples[s].imageX, samples[s].imageY,
                     w * (tr * L + Lv));
             }
+            splitTail(sampler, tile, &sampleRange);
+        }
+        delete [] samples;
+        mCamera->getFilm()->mergeTile(*tile);
+        // split off parts are not counted as tasks in progress
+        if(mRenderProgress) {
+            mRenderProgress->update();
+        }
+    }
+
+    void RenderTask::setSamplePerPixel(int samplePerPixel) {
+        mSamplePerPixel = samplePerPixel;
+    }
+
+    void RenderTask::seed(uint32_t s) {
+        mRNG->seed(s);
+    }
+
+    void RenderTask::splitTail(Sampler& sampler, ImageTile* tile,
+        SampleRange* sampleRange) {
+        ThreadPool* threadPool = ThreadPool::getCurrent();
+        if(threadPool == NULL || !threadPool->isStarving()) {
+            return;
+        }
+        SampleRange tail;
+        if(!sampler.split(&tail)) {
+            return;
+        }
+        sampleRange->yEnd = tail.yStart;
+        tile->shrinkSampleRange(*sampleRange);
+        RenderTask* tailTask = new RenderTask(mRenderer, mCamera, mScene,
+            tail, mSampleQuota, mSamplePerPixel, NULL);
+        // a stream of its own derived from this one, so the reseeding of
+        // resumed renders and distributed parts reaches the tails too
+        tailTask->seed(mRNG->randomUInt());
+        threadPool->spawn(tailTask);
+    }
+
+    void RenderTask::renderPackets(Sampler& sampler, ImageTile* tile,
+        RenderingTLS* renderingTLS, SampleRange* sampleRange) {
+        int batchAmount = sampler.maxSamplesPerRequest();
+        // gather the samples of neighbor pixels to fill up the packets
+        int requestsNum = max(RayPacket::MaxSize / batchAmount, 1);
+        Sample* samples = sampler.allocateSampleBuffer(
+            requestsNum * batchAmount);
+        RayDifferential* rays = new RayDifferential[RayPacket::MaxSize];
+        Intersection* intersections = new Intersection[RayPacket::MaxSize];
+        float weights[RayPacket::MaxSize];
+        float epsilons[RayPacket::MaxSize];
+        RayPacket packet;
+        while(true) {
+            int sampleNum = 0;
+            for(int r = 0; r < requestsNum; ++r) {
+                int n = sampler.requestSamples(samples + sampleNum);
+                if(n == 0) {
+                    break;
+                }
+                sampleNum += n;
+            }
+            if(sampleNum == 0) {
+                break;
+            }
+            for(int first = 0; first < sampleNum; 
+                first += RayPacket::MaxSize) {
+                int packetSize = min(sampleNum - first, RayPacket::MaxSize);
+                packet.clear();
+                for(int i = 0; i < packetSize; ++i) {
+                    rays[i] = RayDifferential();
+                    weights[i] = mCamera->generateRay(samples[first + i],
+                        &rays[i]);
+                    packet.addRay(&rays[i]);
+                }
+                uint64_t hitMask = mScene->intersect(packet, epsilons,
+                    intersections);
+                for(int i = 0; i < packetSize; ++i) {
+                    const Sample& s = samples[first + i];
+                    bool hit = (hitMask >> i) & 1;
+                    Color L = mRenderer->shade(mScene, rays[i], hit,
+                        epsilons[i], intersections[i], s, *mRNG, 
+                        renderingTLS);
+                    Color tr = mRenderer->transmittance(mScene, rays[i]);
+                    Color Lv = mRenderer->Lv(mScene, rays[i], *mRNG);
+                    tile->addSample(s.imageX, s.imageY, 
+                        weights[i] * (tr * L + Lv));
+                }
+            }
+            splitTail(sampler, tile, sampleRange);
         }
+        delete [] intersections;
+        delete [] rays;
         delete [] samples;
-        mRenderProgress->update();
+    }
+
+    RenderBudget::RenderBudget(float timeLimit, int passSamples,
+        float writeInterval, int writePassInterval,
+        float checkpointInterval):
+        mTimeLimit(timeLimit), mPassSamples(passSamples),
+        mWriteInterval(writeInterval), mWritePassInterval(writePassInterval),
+        mCheckpointInterval(checkpointInterval),
+        mPassNum(0), mPassStartSeconds(0.0f), mLastPassSeconds(0.0f),
+        mLastWritePass(0), mLastWriteSeconds(0.0f),
+        mLastCheckpointSeconds(0.0f), mCheckpointDue(false) {
+    }
+
+    bool RenderBudget::isProgressive() const {
+        return mTimeLimit > 0.0f || mPassSamples > 0 ||
+            mWriteInterval > 0.0f || mWritePassInterval > 0 ||
+            mCheckpointInterval > 0.0f;
+    }
+
+    int RenderBudget::getPassSamples(int samplesLeft) const {
+        if(!isProgressive()) {
+            return samplesLeft;
+        }
+        // without an explicit pass size add a sample per pixel a time,
+        // the finest a deadline can cut
+        return min(mPassSamples > 0 ? mPassSamples : 1, samplesLeft);
+    }
+
+    void RenderBudget::start() {
+        mStartTime = boost::posix_time::microsec_clock::universal_time();
+        mPassNum = 0;
+        mPassStartSeconds = 0.0f;
+        mLastPassSeconds = 0.0f;
+        mLastWritePass = 0;
+        mLastWriteSeconds = 0.0f;
+        mLastCheckpointSeconds = 0.0f;
+        mCheckpointDue = false;
+    }
+
+    float RenderBudget::getElapsedSeconds() const {
+        boost::posix_time::time_duration elapsed =
+            boost::posix_time::microsec_clock::universal_time() - mStartTime;
+        return 1e-6f * (float)elapsed.total_microseconds();
+    }
+
+    bool RenderBudget::hasTimeForPass() const {
+        if(mTimeLimit <= 0.0f) {
+            return true;
+        }
+        return getElapsedSeconds() + mLastPassSeconds <= mTimeLimit;
+    }
+
+    bool RenderBudget::finishPass() {
+        float elapsed = getElapsedSeconds();
+        mLastPassSeconds = elapsed - mPassStartSeconds;
+        mPassStartSeconds = elapsed;
+        mPassNum++;
+        bool writeDue = 
+            (mWritePassInterval > 0 &&
+            mPassNum - mLastWritePass >= mWritePassInterval) ||
+            (mWriteInterval > 0.0f &&
+            elapsed - mLastWriteSeconds >= mWriteInterval);
+        if(writeDue) {
+            mLastWritePass = mPassNum;
+            mLastWriteSeconds = elapsed;
+        }
+        mCheckpointDue = mCheckpointInterval > 0.0f &&
+            elapsed - mLastCheckpointSeconds >= mCheckpointInterval;
+        if(mCheckpointDue) {
+            mLastCheckpointSeconds = elapsed;
+        }
+        return writeDue;
+    }
+
+    bool RenderBudget::isCheckpointDue() const {
+        return mCheckpointDue;
     }
 
     RenderProgress::RenderProgress(int taskNum): 
@@ -69,10 +247,12 @@ namespace Goblin {
             "                     ";
 
         std::cout.flush();
-        if(mFinishedNum == mTasksNum) {
-            std::cout << "\rRender Complete!         " << std::endl;
-            std::cout.flush();
-        }
+    }
+
+    void RenderProgress::finish() {
+        boost::lock_guard<boost::mutex> lk(mUpdateMutex);
+        std::cout << "\rRender Complete!         " << std::endl;
+        std::cout.flush();
     }
 
     Renderer::Renderer(int samplePerPixel, int threadNum):
@@ -96,6 +276,56 @@ namespace Goblin {
         }
     }
 
+    bool Renderer::supportRayPacket() const {
+        return false;
+    }
+
+    Color Renderer::shade(const ScenePtr& scene, const RayDifferential& ray,
+        bool hit, float epsilon, Intersection& intersection, 
+        const Sample& sample, const RNG& rng, RenderingTLS* tls) const {
+        return Li(scene, ray, sample, rng, tls);
+    }
+
+    void Renderer::setRenderBudget(const RenderBudget& renderBudget) {
+        mRenderBudget = renderBudget;
+    }
+
+    void Renderer::setCheckpoint(const Checkpoint& checkpoint) {
+        mCheckpoint = checkpoint;
+    }
+
+    void Renderer::shareThreadPool(const Renderer& renderer) {
+        if(renderer.mThreadNum == mThreadNum) {
+            mThreadPool = renderer.mThreadPool;
+        }
+    }
+
+    void Renderer::setPartition(const RenderPartition& partition) {
+        mPartition = partition;
+        if(mPartition.mode == RenderPartition::Samples) {
+            // the leftover samples go to the last parts
+            mSamplePerPixel =
+                mSamplePerPixel * (partition.index + 1) / partition.count -
+                mSamplePerPixel * partition.index / partition.count;
+        }
+    }
+
+    bool Renderer::supportSamplePartition() const {
+        return true;
+    }
+
+    bool Renderer::supportCropPartition() const {
+        return true;
+    }
+
+    ThreadPool& Renderer::getThreadPool(TLSManager* tlsManager) {
+        if(!mThreadPool) {
+            mThreadPool.reset(new ThreadPool(mThreadNum));
+        }
+        mThreadPool->setTLSManager(tlsManager);
+        return *mThreadPool;
+    }
+
     void Renderer::render(const ScenePtr& scene) {
         const CameraPtr camera = scene->getCamera();
         Film* film = camera->getFilm();
@@ -113,15 +343,143 @@ namespace Goblin {
         }
         
         RenderingTLSManager tlsManager(film);
-        ThreadPool threadPool(mThreadNum, &tlsManager);
-        threadPool.enqueue(renderTasks);
-        threadPool.waitForAll();
+        renderPasses(renderTasks, &tlsManager, &progress);
         //clean up
         for(size_t i = 0; i < renderTasks.size(); ++i) {
             delete renderTasks[i];
         }
         renderTasks.clear();
         drawDebugData(tlsManager.getDebugData(), camera);
+        outputFilm(film, tlsManager);
+    }
+
+    int Renderer::renderPasses(const vector<Task*>& tasks,
+        RenderingTLSManager* tlsManager, RenderProgress* progress) {
+        ThreadPool& threadPool = getThreadPool(tlsManager);
+        Film* film = tlsManager->getFilm();
+        mRenderBudget.start();
+        int finishedSamples = 0;
+        CheckpointState checkpointState;
+        if(mCheckpoint.isResuming() &&
+            mCheckpoint.load(&checkpointState, film->getXResolution(),
+            film->getYResolution())) {
+            if(film->setState(checkpointState.film)) {
+                finishedSamples = checkpointState.finishedSamples;
+                tlsManager->setTotalSampleCount(
+                    checkpointState.sampleCount);
+                cout << "resume at " << finishedSamples << "/" <<
+                    mSamplePerPixel << " samples per pixel" << endl;
+            } else {
+                cerr << "ignore checkpoint of a different film" << endl;
+            }
+        }
+        // resumed renders and the parts of a distributed one need random
+        // streams of their own, otherwise they would repeat the samples
+        // already in the film or in the other parts
+        uint32_t seed = finishedSamples;
+        if(mPartition.isPartial()) {
+            seed = 31 * seed + mPartition.index + 1;
+        }
+        if(seed != 0) {
+            for(size_t i = 0; i < tasks.size(); ++i) {
+                static_cast<RenderTask*>(tasks[i])->seed(
+                    0x9e3779b9u * seed + i);
+            }
+        }
+        bool checkpointSaved = false;
+        while(finishedSamples < mSamplePerPixel &&
+            mRenderBudget.hasTimeForPass()) {
+            int passSamples = mRenderBudget.getPassSamples(
+                mSamplePerPixel - finishedSamples);
+            for(size_t i = 0; i < tasks.size(); ++i) {
+                static_cast<RenderTask*>(tasks[i])->setSamplePerPixel(
+                    passSamples);
+            }
+            progress->reset();
+            threadPool.enqueue(tasks);
+            threadPool.waitForAll();
+            finishedSamples += passSamples;
+            bool writeDue = mRenderBudget.finishPass();
+            checkpointSaved = false;
+            if(mCheckpoint.isEnabled() && mRenderBudget.isCheckpointDue()) {
+                saveCheckpoint(mCheckpoint, film, finishedSamples,
+                    *tlsManager);
+                checkpointSaved = true;
+            }
+            if(!mRenderBudget.isProgressive()) {
+                continue;
+            }
+            cout << "\rpass done: " << finishedSamples << "/" <<
+                mSamplePerPixel << " samples per pixel in " <<
+                mRenderBudget.getElapsedSeconds() << " seconds" << endl;
+            if(writeDue && finishedSamples < mSamplePerPixel) {
+                writeFilm(film, *tlsManager);
+            }
+        }
+        progress->finish();
+        // the last state, a later job can pick up from the cutoff or
+        // add samples on top
+        if(mCheckpoint.isEnabled() && !checkpointSaved) {
+            saveCheckpoint(mCheckpoint, film, finishedSamples, *tlsManager);
+        }
+        return finishedSamples;
+    }
+
+    void Renderer::saveCheckpoint(const Checkpoint& checkpoint,
+        const Film* film, int finishedSamples,
+        const RenderingTLSManager& tlsManager) const {
+        CheckpointState state;
+        state.finishedSamples = finishedSamples;
+        state.sampleCount = tlsManager.getTotalSampleCount();
+        film->getState(&state.film);
+        checkpoint.save(state);
+    }
+
+    void Renderer::outputFilm(Film* film,
+        const RenderingTLSManager& tlsManager) const {
+        if(mPartition.isPartial()) {
+            cout << "write part " << mPartition.index << "/" <<
+                mPartition.count << " to : " << mPartition.output << endl;
+            saveCheckpoint(Checkpoint(mPartition.output, false,
+                mCheckpoint.getFingerprint()), film,
+                mSamplePerPixel, tlsManager);
+            return;
+        }
+        writeFilm(film, tlsManager);
+    }
+
+    bool Renderer::mergeParts(const ScenePtr& scene,
+        const vector<string>& parts) {
+        Film* film = scene->getCamera()->getFilm();
+        film->clearImage();
+        // crop bands and sample shares are disjoint sets of the samples
+        // of the whole film, filter weights included, they add up to
+        // the film of a single render. splats are normalized by the
+        // total sample count
+        uint64_t totalSampleCount = 0;
+        for(size_t i = 0; i < parts.size(); ++i) {
+            CheckpointState state;
+            Checkpoint part(parts[i], false, mCheckpoint.getFingerprint());
+            if(!part.load(&state, film->getXResolution(),
+                film->getYResolution()) || state.film.empty()) {
+                cerr << "can't merge part " << parts[i] << endl;
+                return false;
+            }
+            if(!film->addState(state.film)) {
+                cerr << "part " << parts[i] <<
+                    " has a different resolution" << endl;
+                return false;
+            }
+            totalSampleCount += state.sampleCount;
+        }
+        RenderingTLSManager tlsManager(film);
+        tlsManager.setTotalSampleCount(totalSampleCount);
+        writeFilm(film, tlsManager);
+        return true;
+    }
+
+    void Renderer::writeFilm(Film* film,
+        const RenderingTLSManager& tlsManager) const {
         film->writeImage();
     }
 
@@ -552,21 +910,79 @@ namespace Goblin {
         return L;
     }
 
+    // distance of cell (x, y) along the hilbert curve filling a n x n
+    // grid, n is a power of 2
+    static uint32_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y) {
+        uint32_t d = 0;
+        for(uint32_t s = n / 2; s > 0; s /= 2) {
+            uint32_t rx = (x & s) > 0;
+            uint32_t ry = (y & s) > 0;
+            d += s * s * ((3 * rx) ^ ry);
+            // rotate the quadrant
+            if(ry == 0) {
+                if(rx == 1) {
+                    x = n - 1 - x;
+                    y = n - 1 - y;
+                }
+                swap(x, y);
+            }
+        }
+        return d;
+    }
+
+    static bool compareHilbertIndex(const pair<uint32_t, SampleRange>& a,
+        const pair<uint32_t, SampleRange>& b) {
+        return a.first < b.first;
+    }
+
+    unsigned int Renderer::getWorkerNum() const {
+        unsigned int coreNum = boost::thread::hardware_concurrency();
+        if(mThreadNum > 0) {
+            coreNum = min(coreNum, (unsigned int)mThreadNum);
+        }
+        return max(coreNum, 1u);
+    }
+
     void Renderer::getSampleRanges(const Film* film,
-        vector<SampleRange>& sampleRanges) const {
+        vector<SampleRange>& sampleRanges, int step) const {
         SampleRange fullRange;
         film->getSampleRange(fullRange);
-        int step = 8;
-        for (int y = fullRange.yStart; y < fullRange.yEnd; y += step) {
-            for (int x = fullRange.xStart; x < fullRange.xEnd; x += step) {
+        int xCount = fullRange.xEnd - fullRange.xStart;
+        int yCount = fullRange.yEnd - fullRange.yStart;
+        if(step <= 0) {
+            // enough tiles per thread for the stealing to even out the
+            // load, small tiles splitting handles the long tail anyway
+            step = (int)sqrtf((float)xCount * yCount /
+                (sTilesPerThread * getWorkerNum()));
+            step = max(min(step, sMaxTileSize), sMinTileSize);
+        }
+        int xTiles = (xCount + step - 1) / step;
+        int yTiles = (yCount + step - 1) / step;
+        uint32_t n = 1;
+        while(n < (uint32_t)max(xTiles, yTiles)) {
+            n *= 2;
+        }
+        // neighbor tiles stay close in the queue, each worker grabs a
+        // contiguous run of them
+        vector<pair<uint32_t, SampleRange> > tiles;
+        tiles.reserve(xTiles * yTiles);
+        for(int ty = 0; ty < yTiles; ++ty) {
+            for(int tx = 0; tx < xTiles; ++tx) {
+                int x = fullRange.xStart + tx * step;
+                int y = fullRange.yStart + ty * step;
                 SampleRange subSampleRange;
                 subSampleRange.xStart = x;
                 subSampleRange.xEnd = min(x + step, fullRange.xEnd);
                 subSampleRange.yStart = y;
                 subSampleRange.yEnd = min(y + step, fullRange.yEnd);
-                sampleRanges.push_back(subSampleRange);
+                tiles.push_back(pair<uint32_t, SampleRange>(
+                    hilbertIndex(n, tx, ty), subSampleRange));
             }
         }
+        std::sort(tiles.begin(), tiles.end(), compareHilbertIndex);
+        for(size_t i = 0; i < tiles.size(); ++i) {
+            sampleRanges.push_back(tiles[i].second);
+        }
     }
 
     void Renderer::drawDebugData(const DebugData& debugData,
@@ -1,11 +1,13 @@
 #ifndef GOBLIN_RENDERER_H
 #define GOBLIN_RENDERER_H
 
+#include "GoblinCheckpoint.h"
 #include "GoblinMaterial.h"
 #include "GoblinRay.h"
 #include "GoblinScene.h"
 #include "GoblinSampler.h"
 #include "GoblinThreadPool.h"
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 namespace Goblin {
     class Color;
@@ -22,11 +24,69 @@ namespace Goblin {
         RenderProgress(int taskNum);
         void reset();
         void update();
+        // once all the passes are done
+        void finish();
     private:
         boost::mutex mUpdateMutex;
         int mFinishedNum, mTasksNum;
     };
 
+    // sample passes, deadline and intermediate output of a progressive
+    // render, zero turns the matching limit off. with none of them set
+    // the render goes in one pass like it always did
+    class RenderBudget {
+    public:
+        RenderBudget(float timeLimit = 0.0f, int passSamples = 0,
+            float writeInterval = 0.0f, int writePassInterval = 0,
+            float checkpointInterval = 0.0f);
+        bool isProgressive() const;
+        // samples per pixel the next pass adds, capped by what's left
+        int getPassSamples(int samplesLeft) const;
+        void start();
+        float getElapsedSeconds() const;
+        // a pass is only started when it is expected to finish in time,
+        // judging by how long the last one took
+        bool hasTimeForPass() const;
+        // count a finished pass, true when an intermediate image is due
+        bool finishPass();
+        // set by finishPass
+        bool isCheckpointDue() const;
+    private:
+        float mTimeLimit;
+        int mPassSamples;
+        float mWriteInterval;
+        int mWritePassInterval;
+        float mCheckpointInterval;
+        boost::posix_time::ptime mStartTime;
+        int mPassNum;
+        float mPassStartSeconds;
+        float mLastPassSeconds;
+        int mLastWritePass;
+        float mLastWriteSeconds;
+        float mLastCheckpointSeconds;
+        bool mCheckpointDue;
+    };
+
+    // one of count parts of a render split across processes. each part
+    // renders either a band of sample rows over the whole crop window or
+    // a share of the samples and leaves its raw film in output for
+    // Renderer::mergeParts
+    struct RenderPartition {
+        enum Mode {
+            Crop,
+            Samples
+        };
+        RenderPartition(int i = 0, int n = 1, Mode m = Crop,
+            const string& o = ""):
+            index(i), count(n), mode(m), output(o) {}
+        bool isPartial() const { return count > 1; }
+
+        int index;
+        int count;
+        Mode mode;
+        string output;
+    };
+
     class RenderTask : public Task {
     public:
         RenderTask(Renderer* mRenderer, const CameraPtr& camera,
@@ -35,12 +95,27 @@ namespace Goblin {
             RenderProgress* renderProgress);
         ~RenderTask();
         void run(TLSPtr& tls);
+        // tasks get run again for every pass of a progressive render
+        void setSamplePerPixel(int samplePerPixel);
+        void seed(uint32_t s);
+
+    protected:
+        // trace the camera rays in packets for renderers support it
+        void renderPackets(Sampler& sampler, ImageTile* tile,
+            RenderingTLS* renderingTLS, SampleRange* sampleRange);
+
+        // when the other workers run out of tasks, hand them half of
+        // the rows this task hasn't started yet. only sampleRange
+        // shrinks, the task covers its full range next run
+        void splitTail(Sampler& sampler, ImageTile* tile,
+            SampleRange* sampleRange);
 
     protected:
         Renderer* mRenderer;
         const CameraPtr& mCamera;
         const ScenePtr& mScene;
-        const SampleRange& mSampleRange;
+        // by value, split off tails outlive the range they came from
+        SampleRange mSampleRange;
         const SampleQuota& mSampleQuota;
         int mSamplePerPixel;
         RenderProgress* mRenderProgress;
@@ -56,10 +131,42 @@ namespace Goblin {
 
         virtual void render(const ScenePtr& scene);
 
+        void setRenderBudget(const RenderBudget& renderBudget);
+
+        void setCheckpoint(const Checkpoint& checkpoint);
+
+        // take over the parked workers of renderer when it runs the same
+        // number of threads, so a resident scene doesn't spawn a new pool
+        // for every job that swaps the renderer
+        void shareThreadPool(const Renderer& renderer);
+
+        // call before render, the film sample band is up to the caller
+        void setPartition(const RenderPartition& partition);
+
+        // renderers that can't add up independent sample sets (SPPM
+        // shrinks its radii along the way) only split by sample band
+        virtual bool supportSamplePartition() const;
+        // splatting renderers only split samples, a crop band would drop
+        // every light path that lands outside of it
+        virtual bool supportCropPartition() const;
+
+        // add up the raw films the parts left behind and write the image
+        bool mergeParts(const ScenePtr& scene, const vector<string>& parts);
+
         virtual Color Li(const ScenePtr& scene, const RayDifferential& ray, 
             const Sample& sample, const RNG& rng,
             RenderingTLS* tls = NULL) const = 0;
 
+        // renderers that can shade a camera ray from its already found
+        // intersection get their camera rays traced in packets
+        virtual bool supportRayPacket() const;
+
+        // radiance along ray with the intersection test result known
+        virtual Color shade(const ScenePtr& scene, 
+            const RayDifferential& ray, bool hit, float epsilon,
+            Intersection& intersection, const Sample& sample, 
+            const RNG& rng, RenderingTLS* tls = NULL) const;
+
         // volume in scatter and emission contribution
         Color Lv(const ScenePtr& scene, const Ray& ray, const RNG& rng) const;
 
@@ -109,12 +216,40 @@ namespace Goblin {
             float epsilon, const Intersection& intersection,
             const Sample& sample, const RNG& rng) const;
 
+        // the threads the pool runs, thread_num 0 stands for all the
+        // available cores like it does for the ThreadPool
+        unsigned int getWorkerNum() const;
+
+        // tiles along a hilbert curve, step 0 picks the tile size from
+        // resolution and thread number
         void getSampleRanges(const Film* film,
-            vector<SampleRange>& sampleRanges) const;
+            vector<SampleRange>& sampleRanges, int step = 0) const;
 
         void drawDebugData(const DebugData& debugData,
             const CameraPtr& camera) const;
 
+        // run the RenderTasks pass after pass until sample per pixel or
+        // the time budget is reached, returns the samples per pixel done
+        int renderPasses(const vector<Task*>& tasks,
+            RenderingTLSManager* tlsManager, RenderProgress* progress);
+
+        void saveCheckpoint(const Checkpoint& checkpoint, const Film* film,
+            int finishedSamples,
+            const RenderingTLSManager& tlsManager) const;
+
+        // the final image, or the raw film when rendering a part
+        void outputFilm(Film* film,
+            const RenderingTLSManager& tlsManager) const;
+
+        // resolve the film into the output image, for the intermediate
+        // images as well as the final one
+        virtual void writeFilm(Film* film,
+            const RenderingTLSManager& tlsManager) const;
+
+        // workers get spawned on first call and stay parked between
+        // passes and renders
+        ThreadPool& getThreadPool(TLSManager* tlsManager);
+
     private:
         virtual void querySampleQuota(const ScenePtr& scene, 
             SampleQuota* sampleQuota) = 0;
@@ -137,6 +272,12 @@ namespace Goblin {
         BSSRDFSampleIndex mBSSRDFSampleIndex;
         int mSamplePerPixel;
         int mThreadNum;
+        RenderBudget mRenderBudget;
+        Checkpoint mCheckpoint;
+        RenderPartition mPartition;
+
+    private:
+        boost::shared_ptr<ThreadPool> mThreadPool;
     };
 }
 
@@ -48,6 +48,7 @@ namespace Goblin {
         void run(TLSPtr& tls);
 
         void nextIteration() { mCurrentIteration++; }
+        void setIteration(int iteration) { mCurrentIteration = iteration; }
     private:
         SPPM* mSPPM;
         const ScenePtr& mScene;
@@ -474,6 +475,9 @@ namespace Goblin {
         int xEnd = xStart + filmRect.xCount;
         int yStart = filmRect.yStart;
         int yEnd = yStart + filmRect.yCount;
+        // pixel data and photons stay the ones of the whole film, only
+        // the pixels of the band get visible points
+        film->clipToSampleBand(&yStart, &yEnd);
         int tileWidth = 64;
         vector<SampleRange> sampleRanges;
         for (int y = yStart; y < yEnd; y += tileWidth) {
@@ -517,11 +521,37 @@ namespace Goblin {
             photonChaches[i].resize(filmRect.pixelNum());
         }
         uint64_t emittedPhotons = 0;
-        int iterationCount = mSamplePerPixel;
-        for (int i = 0; i < iterationCount; ++i) {
+        int iterationCount = 0;
+        CheckpointState checkpointState;
+        if (mCheckpoint.isResuming() &&
+            mCheckpoint.load(&checkpointState, film->getXResolution(),
+            film->getYResolution()) &&
+            loadPixelData(checkpointState.extra)) {
+            // the halton sequences continue where they left off, the
+            // permutations and start ids come out the same for the
+            // same scene
+            iterationCount = checkpointState.finishedSamples;
+            emittedPhotons = checkpointState.sampleCount;
+            for (size_t i = 0; i < rayTraceTasks.size(); ++i) {
+                static_cast<RayTraceTask*>(rayTraceTasks[i])->setIteration(
+                    iterationCount);
+            }
+            for (size_t i = 0; i < photonTraceTasks.size(); ++i) {
+                static_cast<PhotonTraceTask*>(
+                    photonTraceTasks[i])->setIterationOffset(emittedPhotons);
+            }
+            std::cout << "resume at iteration " << iterationCount <<
+                std::endl;
+        }
+        bool checkpointSaved = false;
+        // every iteration is a pass as far as the budget is concerned
+        mRenderBudget.start();
+        while (iterationCount < mSamplePerPixel &&
+            mRenderBudget.hasTimeForPass()) {
             // ray trace pass
             RayTraceTLSManager rayTraceTLSManager(sampleQuota);
-            ThreadPool rayTraceThreadPool(mThreadNum, &rayTraceTLSManager);
+            ThreadPool& rayTraceThreadPool =
+                getThreadPool(&rayTraceTLSManager);
             rayTraceThreadPool.enqueue(rayTraceTasks);
             rayTraceThreadPool.waitForAll();
             for (size_t j = 0; j < rayTraceTasks.size(); ++j) {
@@ -535,8 +565,8 @@ namespace Goblin {
             // photon trace pass
             PhotonTraceTLSManager photonTraceTLSManager(sampleQuota,
                 mPixelData, photonChaches, &emittedPhotons);
-            ThreadPool photonTraceThreadPool(mThreadNum,
-                &photonTraceTLSManager);
+            ThreadPool& photonTraceThreadPool =
+                getThreadPool(&photonTraceTLSManager);
             photonTraceThreadPool.enqueue(photonTraceTasks);
             photonTraceThreadPool.waitForAll();
             for (size_t j = 0; j < photonTraceTasks.size(); ++j) {
@@ -566,14 +596,27 @@ namespace Goblin {
                 mPixelData[j].reset();
             }
 
+            iterationCount++;
             // report progress
-            std::cout << "\rIteration: " << i + 1 << "/" << iterationCount;
+            std::cout << "\rIteration: " << iterationCount << "/" <<
+                mSamplePerPixel;
             std::cout.flush();
-            if(i == iterationCount - 1) {
-                std::cout << "\rRender Complete!         " << std::endl;
-                std::cout.flush();
+            bool writeDue = mRenderBudget.finishPass();
+            checkpointSaved = false;
+            if (mCheckpoint.isEnabled() && mRenderBudget.isCheckpointDue()) {
+                savePixelData(iterationCount, emittedPhotons);
+                checkpointSaved = true;
+            }
+            if (writeDue && iterationCount < mSamplePerPixel) {
+                resolveImage(film, iterationCount, emittedPhotons);
+                film->writeImage();
             }
         }
+        std::cout << "\rRender Complete!         " << std::endl;
+        std::cout.flush();
+        if (mCheckpoint.isEnabled() && !checkpointSaved) {
+            savePixelData(iterationCount, emittedPhotons);
+        }
         // clean up
         for (size_t i = 0; i < rayTraceTasks.size(); ++i) {
             delete rayTraceTasks[i];
@@ -583,11 +626,76 @@ namespace Goblin {
             delete photonTraceTasks[i];
         }
 
+        resolveImage(film, iterationCount, emittedPhotons);
+        // resolved film is weight normalized like any other by now
+        RenderingTLSManager tlsManager(film);
+        outputFilm(film, tlsManager);
+    }
+
+    bool SPPM::supportSamplePartition() const {
+        return false;
+    }
+
+    // the part of PixelData that lives through iterations, as floats
+    static const size_t sPixelStateSize = 8;
+
+    void SPPM::savePixelData(int iterationCount,
+        uint64_t emittedPhotons) const {
+        CheckpointState state;
+        state.finishedSamples = iterationCount;
+        state.sampleCount = emittedPhotons;
+        vector<float> pixelState(sPixelStateSize * mPixelData.size());
+        for (size_t i = 0; i < mPixelData.size(); ++i) {
+            float* p = &pixelState[sPixelStateSize * i];
+            const PixelData& pixel = mPixelData[i];
+            p[0] = pixel.Ni;
+            p[1] = pixel.Ri;
+            p[2] = pixel.Ld.r;
+            p[3] = pixel.Ld.g;
+            p[4] = pixel.Ld.b;
+            p[5] = pixel.Tau.r;
+            p[6] = pixel.Tau.g;
+            p[7] = pixel.Tau.b;
+        }
+        const char* bytes = reinterpret_cast<const char*>(&pixelState[0]);
+        state.extra.assign(bytes, bytes + pixelState.size() * sizeof(float));
+        mCheckpoint.save(state);
+    }
+
+    bool SPPM::loadPixelData(const vector<char>& extra) {
+        if (extra.size() !=
+            sPixelStateSize * mPixelData.size() * sizeof(float)) {
+            std::cerr << "ignore checkpoint of a different resolution" <<
+                std::endl;
+            return false;
+        }
+        const float* pixelState = reinterpret_cast<const float*>(&extra[0]);
+        for (size_t i = 0; i < mPixelData.size(); ++i) {
+            const float* p = pixelState + sPixelStateSize * i;
+            PixelData& pixel = mPixelData[i];
+            pixel.Ni = p[0];
+            pixel.Ri = p[1];
+            pixel.Ld = Color(p[2], p[3], p[4]);
+            pixel.Tau = Color(p[5], p[6], p[7]);
+        }
+        return true;
+    }
+
+    void SPPM::resolveImage(Film* film, int iterationCount,
+        uint64_t emittedPhotons) const {
+        ImageRect filmRect;
+        film->getImageRect(filmRect);
         ImageTile tile(filmRect, film->getFilterTable());
         float invIterationCount = 1.0f / (float)iterationCount;
+        int yStart = filmRect.yStart;
+        int yEnd = yStart + filmRect.yCount;
+        film->clipToSampleBand(&yStart, &yEnd);
         for (size_t i = 0; i < mPixelData.size(); ++i) {
             int x, y;
             filmRect.offsetToPixel(i, &x, &y);
+            if (y < yStart || y >= yEnd) {
+                continue;
+            }
             // direct lighting from ray trace pass
             Color Ld = mPixelData[i].Ld * invIterationCount;
             float r = mPixelData[i].Ri;
@@ -595,9 +703,8 @@ namespace Goblin {
             Color Lbounce = mPixelData[i].Tau / (emittedPhotons * PI * r * r);
             tile.addSample((float)x, (float)y, Ld + Lbounce);
         }
-
+        film->clearImage();
         film->mergeTile(tile);
-        film->writeImage();
     }
 
     void SPPM::querySampleQuota(const ScenePtr& scene,
@@ -67,6 +67,8 @@ namespace Goblin {
 
         void render(const ScenePtr& scene);
 
+        bool supportSamplePartition() const;
+
         void querySampleQuota(const ScenePtr& scene, SampleQuota* sampleQuota);
 
         void rayTracePass(const ScenePtr& scene, const Sample& sample,
@@ -75,6 +77,17 @@ namespace Goblin {
         void photonTracePass(const ScenePtr& scene, const Sample& sample,
             vector<PhotonCache>& photonCache);
 
+    private:
+        // gather direct and photon lighting of the iterations done so far
+        // into the film, replacing what it had
+        void resolveImage(Film* film, int iterationCount,
+            uint64_t emittedPhotons) const;
+
+        // radii, photon counts, Tau and direct lighting of every pixel
+        void savePixelData(int iterationCount,
+            uint64_t emittedPhotons) const;
+        bool loadPixelData(const vector<char>& extra);
+
     private:
         int mMaxPathLength;
         vector<PixelData> mPixelData;
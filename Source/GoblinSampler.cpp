@@ -196,6 +196,18 @@ namespace Goblin {
         return mSamplesPerPixel;
     }
 
+    bool Sampler::split(SampleRange* tail) {
+        int firstFreeRow = mCurrentX == mXStart ? mCurrentY : mCurrentY + 1;
+        int freeRows = mYEnd - firstFreeRow;
+        if(freeRows < 2) {
+            return false;
+        }
+        int splitRow = firstFreeRow + freeRows / 2;
+        *tail = SampleRange(mXStart, mXEnd, splitRow, mYEnd);
+        mYEnd = splitRow;
+        return true;
+    }
+
     void Sampler::debugOutput(Sample* samples) {
         static bool debugFlip = true;
         if(debugFlip) {
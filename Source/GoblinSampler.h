@@ -89,6 +89,9 @@ namespace Goblin {
         int maxSamplesPerRequest() const;
         uint64_t maxTotalSamples() const;
         int requestSamples(Sample* samples);
+        // give away the second half of the rows not started yet,
+        // returns false when there are less than two of them
+        bool split(SampleRange* tail);
 
         Sample* allocateSampleBuffer(size_t bufferSize);
     private:
@@ -1,9 +1,11 @@
 #include "GoblinColor.h"
 #include "GoblinModel.h"
 #include "GoblinParamSet.h"
+#include "GoblinRay.h"
 #include "GoblinSampler.h"
 #include "GoblinScene.h"
 #include "GoblinSphere.h"
+#include "GoblinThreadPool.h"
 #include "GoblinVolume.h"
 
 namespace Goblin {
@@ -44,6 +46,10 @@ namespace Goblin {
         return mCamera;
     }
 
+    void Scene::setCamera(const CameraPtr& camera) {
+        mCamera = camera;
+    }
+
     void Scene::getBoundingSphere(Vector3* center, float* radius) const {
         mAggregate->getAABB().getBoundingSphere(center, radius);
     }
@@ -70,6 +76,22 @@ namespace Goblin {
         return isIntersect;
     }
 
+    uint64_t Scene::intersect(const RayPacket& packet, float* epsilons,
+        Intersection* intersections, IntersectFilter f) const {
+        int size = packet.getSize();
+        uint64_t activeMask = size == RayPacket::MaxSize ?
+            ~(uint64_t)0 : ((uint64_t)1 << size) - 1;
+        uint64_t hitMask = mAggregate->intersectPacket(packet, activeMask,
+            epsilons, intersections, f);
+        for(int i = 0; i < size; ++i) {
+            if(hitMask & ((uint64_t)1 << i)) {
+                const MaterialPtr& material = intersections[i].getMaterial();
+                material->perturb(&intersections[i].fragment);
+            }
+        }
+        return hitMask;
+    }
+
     Color Scene::evalEnvironmentLight(const Ray& ray) const {
         Color Lenv(0.0f);
         for(size_t i = 0; i < mLights.size(); ++i) {
@@ -97,6 +119,8 @@ namespace Goblin {
         initDefault();
     }
 
+    SceneCache::~SceneCache() {}
+
     void SceneCache::initDefault() {
         Color errorColor = Color::Magenta;
         ColorTexturePtr errorCTexture(new ConstantTexture<Color>(errorColor));
@@ -125,6 +149,11 @@ namespace Goblin {
     void SceneCache::addPrimitive(const string& name, const Primitive* p) {
         std::pair<string, const Primitive*> pair(name, p);
         mPrimitiveMap.insert(pair); 
+        // models that refine into several primitives come wrapped in BVH
+        const BVH* bvh = dynamic_cast<const BVH*>(p);
+        if(bvh) {
+            mModelBVHStats.add(bvh->getBuildStats());
+        }
     }
 
     void SceneCache::addMaterial(const string& name, const MaterialPtr& m) {
@@ -218,6 +247,26 @@ namespace Goblin {
         return mInstances;
     }
 
+    void SceneCache::setAcceleratorParams(const ParamSet& params) {
+        mAcceleratorParams = params;
+    }
+
+    const ParamSet& SceneCache::getAcceleratorParams() const {
+        return mAcceleratorParams;
+    }
+
+    ThreadPool* SceneCache::getBuildThreadPool() const {
+        if(!mBuildThreadPool) {
+            mBuildThreadPool.reset(new ThreadPool(
+                max(mAcceleratorParams.getInt("build_thread_num", 0), 0)));
+        }
+        return mBuildThreadPool.get();
+    }
+
+    const BVHBuildStats& SceneCache::getModelBVHStats() const {
+        return mModelBVHStats;
+    }
+
     const vector<Light*>& SceneCache::getLights() const {
         return mLights;
     }
@@ -1,19 +1,24 @@
 #ifndef GOBLIN_SCENE_H
 #define GOBLIN_SCENE_H
 
+#include "GoblinBVH.h"
 #include "GoblinLight.h"
 #include "GoblinMaterial.h"
+#include "GoblinParamSet.h"
 #include "GoblinPrimitive.h"
 #include "GoblinTexture.h"
 #include "GoblinUtils.h"
 
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include <vector>
 
 namespace Goblin {
     class CDF1D;
     class Ray;
+    class RayPacket;
+    class ThreadPool;
     class VolumeRegion;
 
     class Scene {
@@ -25,6 +30,10 @@ namespace Goblin {
 
         const CameraPtr getCamera() const;
 
+        // swap the camera (and its film) between renders of a resident
+        // scene, the lights and the acceleration structure stay as is
+        void setCamera(const CameraPtr& camera);
+
         const vector<Light*>& getLights() const;
 
         const VolumeRegion* getVolumeRegion() const;
@@ -36,6 +45,11 @@ namespace Goblin {
         bool intersect(const Ray& ray, float* epsilon, 
             Intersection* intersection, IntersectFilter f = NULL) const;
 
+        // closest hit test for all the rays in packet, return the mask
+        // of rays that hit something
+        uint64_t intersect(const RayPacket& packet, float* epsilons,
+            Intersection* intersections, IntersectFilter f = NULL) const;
+
         Color evalEnvironmentLight(const Ray& ray) const;
 
         void getBoundingSphere(Vector3* center, float* radius) const;
@@ -55,6 +69,7 @@ namespace Goblin {
     class SceneCache {
     public:
         SceneCache(const path& sceneRoot);
+        ~SceneCache();
         void addGeometry(const string& name, const Geometry* g);
         void addPrimitive(const string& name, const Primitive* p);
         void addMaterial(const string& name, const MaterialPtr& m);
@@ -63,6 +78,7 @@ namespace Goblin {
         void addAreaLight(const string& name, const AreaLight* l);
         void addInstance(const Primitive* i);
         void addLight(Light* l);
+        void setAcceleratorParams(const ParamSet& params);
         const Geometry* getGeometry(const string& name) const;
         const Primitive* getPrimitive(const string& name) const;
         const MaterialPtr& getMaterial(const string& name) const;
@@ -71,6 +87,12 @@ namespace Goblin {
         const AreaLight* getAreaLight(const string& name) const;
         const PrimitiveList& getInstances() const;
         const vector<Light*>& getLights() const;
+        const ParamSet& getAcceleratorParams() const;
+        // one pool of build_thread_num workers for all the model BVHs of
+        // the scene, spun up on first call and joined with the cache
+        ThreadPool* getBuildThreadPool() const;
+        // added up over the model BVHs added so far
+        const BVHBuildStats& getModelBVHStats() const;
         string resolvePath(const string& filename) const;
 
     private:
@@ -91,6 +113,9 @@ namespace Goblin {
         AreaLightMap mAreaLightMap;
         PrimitiveList mInstances;
         vector<Light*> mLights;
+        ParamSet mAcceleratorParams;
+        mutable boost::scoped_ptr<ThreadPool> mBuildThreadPool;
+        BVHBuildStats mModelBVHStats;
         path mSceneRoot;
         string mErrorCode;
     };
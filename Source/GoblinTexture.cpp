@@ -303,6 +303,11 @@ namespace Goblin{
         tc->dtdy = mScale[1] * f.getDVDY();
     }
 
+    bool UVMapping::getUVScale(Vector2* scale) const {
+        *scale = mScale;
+        return true;
+    }
+
     SphericalMapping::SphericalMapping(const Transform& toTex): 
         mToTex(toTex) {}
 
@@ -451,6 +456,17 @@ namespace Goblin{
         return mMIPMap->lookup(tc, mFilter, mAddressMode);
     }
 
+    template<typename T>
+    float ImageTexture<T>::getTexelSize() const {
+        Vector2 scale;
+        if(!mMapping->getUVScale(&scale)) {
+            return 0.0f;
+        }
+        float sSize = 1.0f / (fabs(scale.x) * mMIPMap->getWidth());
+        float tSize = 1.0f / (fabs(scale.y) * mMIPMap->getHeight());
+        return min(sSize, tSize);
+    }
+
     template<typename T>
     MIPMap<T>* ImageTexture<T>::getMIPMap(const TextureId& id) {
         if(imageCache.find(id) != imageCache.end()) {
@@ -99,13 +99,21 @@ namespace Goblin {
     public:
         virtual ~TextureMapping() {}
         virtual void map(const Fragment& f, TextureCoordinate* tc) const = 0;
+        // fill in the scale from uv to st and return true if
+        // this mapping is a linear function of the uv
+        virtual bool getUVScale(Vector2* scale) const;
     };
 
+    inline bool TextureMapping::getUVScale(Vector2* scale) const {
+        return false;
+    }
+
 
     class UVMapping : public TextureMapping {
     public:
         UVMapping(const Vector2& scale, const Vector2& offset);
         void map(const Fragment& f, TextureCoordinate* tc) const;
+        bool getUVScale(Vector2* scale) const;
     private:
         Vector2 mScale;
         Vector2 mOffset;
@@ -128,8 +136,14 @@ namespace Goblin {
     public:
         virtual ~Texture() {}
         virtual T lookup(const Fragment& f) const = 0;
+        // size of the smallest detail in uv space for the ones that get
+        // baked at load time, 0 if there isn't a fixed one
+        virtual float getTexelSize() const;
     };
 
+    template<typename T>
+    float Texture<T>::getTexelSize() const { return 0.0f; }
+
     typedef boost::shared_ptr<Texture<Color> > ColorTexturePtr;
     typedef boost::shared_ptr<Texture<float> > FloatTexturePtr;
 
@@ -199,6 +213,7 @@ namespace Goblin {
             ImageChannel channel = ChannelAll, float maxAnisotropy = 10.0f);
         ~ImageTexture();
         T lookup(const Fragment& f) const;
+        float getTexelSize() const;
         static void clearImageCache();
     private:
         MIPMap<T>* getMIPMap(const TextureId& id);
@@ -25,22 +25,18 @@ namespace Goblin {
 
     class RenderingTLS : public ThreadLocalStorage {
     public:
-        RenderingTLS(const Film& film): mTile(NULL), mSampleCount(0) {
-            ImageRect r;
-            film.getImageRect(r);
-            const FilterTable& filterTable = film.getFilterTable();
-            mTile = new ImageTile(r, filterTable);
-        }
+        RenderingTLS(const Film& film): mFilm(film),
+            mLocalTile(film.getFilterTable()), mSampleCount(0) {}
 
-        ~RenderingTLS() {
-            if (mTile) {
-                delete mTile;
-                mTile = NULL;
-            }
+        // tile covering sampleRange plus the filter apron, the task
+        // merges it into film once it's done with the range
+        ImageTile* getLocalTile(const SampleRange& sampleRange) {
+            ImageRect r;
+            mFilm.getImageRect(r);
+            mLocalTile.reset(sampleRange, r);
+            return &mLocalTile;
         }
 
-        ImageTile* getTile() { return mTile; }
-
         void addSampleCount(uint64_t sampleCount) {
             mSampleCount += sampleCount;
         }
@@ -50,7 +46,8 @@ namespace Goblin {
         DebugData& getDebugData() { return mDebugData; }
 
     private:
-        ImageTile* mTile;
+        const Film& mFilm;
+        ImageTile mLocalTile;
         uint64_t mSampleCount;
         DebugData mDebugData;
     };
@@ -69,7 +66,6 @@ namespace Goblin {
                 boost::lock_guard<boost::mutex> lk(mMergeTLSMutex);
                 RenderingTLS* renderingTLS =
                     static_cast<RenderingTLS*>(tlsPtr.get());
-                mFilm->mergeTile(*renderingTLS->getTile());
                 mTotalSampleCount += renderingTLS->getSampleCount();
 
                 const DebugData& debugData = renderingTLS->getDebugData();
@@ -89,6 +85,13 @@ namespace Goblin {
 
         uint64_t getTotalSampleCount() const { return mTotalSampleCount; }
 
+        // samples done before resuming from a checkpoint
+        void setTotalSampleCount(uint64_t count) {
+            mTotalSampleCount = count;
+        }
+
+        Film* getFilm() const { return mFilm; }
+
         const DebugData& getDebugData() const { return mDebugData; }
 
     private:
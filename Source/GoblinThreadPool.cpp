@@ -1,87 +1,210 @@
 #include "GoblinThreadPool.h"
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 namespace Goblin {
+    // idle workers poll for split off tasks til the pass ends, after
+    // this many misses they start napping between polls
+    static const int sMaxIdleSpins = 256;
+
+    // the pool doesn't belong to the thread, don't delete it on exit
+    static void keepThreadPool(ThreadPool* threadPool) {}
+
+    static boost::thread_specific_ptr<ThreadPool> sCurrentPool(
+        keepThreadPool);
+
+    WorkQueue::WorkQueue(): mTop(0), mBottom(0) {}
+
+    void WorkQueue::push(Task* task) {
+        int64_t bottom = mBottom.load();
+        // drained in previous round, start over from the buffer head
+        if(bottom == mTop.load()) {
+            bottom = 0;
+            mTop.store(0);
+        }
+        mTasks.resize(bottom);
+        mTasks.push_back(task);
+        mBottom.store(bottom + 1);
+    }
+
+    Task* WorkQueue::pop() {
+        int64_t bottom = mBottom.load() - 1;
+        mBottom.store(bottom);
+        int64_t top = mTop.load();
+        if(top > bottom) {
+            mBottom.store(top);
+            return NULL;
+        }
+        Task* task = mTasks[bottom];
+        if(top == bottom) {
+            // last one, race with thieves for it
+            if(!mTop.compare_exchange_strong(top, top + 1)) {
+                task = NULL;
+            }
+            mBottom.store(bottom + 1);
+        }
+        return task;
+    }
+
+    Task* WorkQueue::steal() {
+        int64_t top = mTop.load();
+        int64_t bottom = mBottom.load();
+        if(top >= bottom) {
+            return NULL;
+        }
+        Task* task = mTasks[top];
+        if(!mTop.compare_exchange_strong(top, top + 1)) {
+            return NULL;
+        }
+        return task;
+    }
+
+    bool WorkQueue::empty() const {
+        return mTop.load() >= mBottom.load();
+    }
+
 
     ThreadPool::ThreadPool(unsigned int coreNum,
         TLSManager* tlsManager):
-        mTasksNum(0), mStartWork(false), mTLSManager(tlsManager) {
+        mPendingNum(0), mTasksNum(0), mBusyWorkersNum(0), mPassIndex(0),
+        mShutdown(false), mTLSManager(tlsManager) {
         mCoreNum = coreNum == 0 ?
-            boost::thread::hardware_concurrency() : 
+            boost::thread::hardware_concurrency() :
             min(boost::thread::hardware_concurrency(), coreNum);
+        if(mCoreNum > 1) {
+            for(size_t i = 0; i < mCoreNum; ++i) {
+                mQueues.push_back(new WorkQueue);
+            }
+        }
     }
 
+    ThreadPool::~ThreadPool() {
+        cleanup();
+        for(size_t i = 0; i < mQueues.size(); ++i) {
+            delete mQueues[i];
+        }
+        mQueues.clear();
+    }
 
     void ThreadPool::initWorkers() {
         if(mCoreNum == 1) {
             return;
         }
-        for(size_t i = 0; i < mCoreNum; ++i) {
+        for(unsigned int i = 0; i < mCoreNum; ++i) {
             mWorkers.push_back(
-                new boost::thread(&ThreadPool::taskEntry, this));
+                new boost::thread(&ThreadPool::taskEntry, this, i,
+                mPassIndex));
         }
     }
 
-    void ThreadPool::taskEntry() {
-        static TLSPtr tlsPtr;
-        {
-            boost::unique_lock<boost::mutex> lk(mStartMutex);
-            while(!mStartWork) {
-                mStartCondition.wait(lk);
+    Task* ThreadPool::stealTask(unsigned int workerIndex, uint32_t* seed) {
+        // xorshift to pick the first victim so thieves spread out
+        *seed ^= *seed << 13;
+        *seed ^= *seed >> 17;
+        *seed ^= *seed << 5;
+        size_t queuesNum = mQueues.size();
+        size_t start = *seed % queuesNum;
+        for(size_t i = 0; i < queuesNum; ++i) {
+            size_t victim = (start + i) % queuesNum;
+            if(victim == workerIndex) {
+                continue;
+            }
+            Task* task = mQueues[victim]->steal();
+            if(task) {
+                return task;
             }
         }
-        if (mTLSManager) {
-            mTLSManager->initialize(tlsPtr);
-        }
+        return NULL;
+    }
+
+    void ThreadPool::taskEntry(unsigned int workerIndex,
+        uint64_t passIndex) {
+        static TLSPtr tlsPtr;
+        sCurrentPool.reset(this);
+        uint32_t seed = 2654435761u * (workerIndex + 1);
+        WorkQueue* queue = mQueues[workerIndex];
         while(true) {
-            Task* task = NULL;
+            // park til next pass
             {
-                boost::lock_guard<boost::mutex> lk(mTaskQueueMutex);
-                if(mTasks.size() == 0) {
+                boost::unique_lock<boost::mutex> lk(mStartMutex);
+                while(mPassIndex == passIndex && !mShutdown) {
+                    mStartCondition.wait(lk);
+                }
+                if(mShutdown) {
                     break;
                 }
-                task= mTasks.back();
-                mTasks.pop_back();
+                passIndex = mPassIndex;
             }
-
-            if(task) {
-                task->run(tlsPtr);
+            if (mTLSManager) {
+                mTLSManager->initialize(tlsPtr);
             }
-
-            {
-                boost::unique_lock<boost::mutex> lk(mTaskQueueMutex);
-                if(--mTasksNum == 0) {
-                    mTasksCondition.notify_all();
-                    break;
+            int idleSpins = 0;
+            while(mTasksNum.load() != 0) {
+                bool spawned = false;
+                Task* task = queue->pop();
+                if(task == NULL) {
+                    task = stealTask(workerIndex, &seed);
+                }
+                if(task == NULL && mPendingNum.load() != 0) {
+                    task = popSpawnedTask();
+                    spawned = task != NULL;
+                }
+                if(task == NULL) {
+                    // the rest is either running or about to be grabbed
+                    // by someone else, stick around in case the running
+                    // ones split
+                    if(++idleSpins < sMaxIdleSpins) {
+                        boost::this_thread::yield();
+                    } else {
+                        boost::this_thread::sleep(
+                            boost::posix_time::microseconds(50));
+                    }
+                    continue;
+                }
+                idleSpins = 0;
+                mPendingNum.fetch_sub(1);
+                task->run(tlsPtr);
+                if(spawned) {
+                    delete task;
                 }
+                mTasksNum.fetch_sub(1);
+            }
+            if (mTLSManager) {
+                mTLSManager->finalize(tlsPtr);
+            }
+            tlsPtr.reset();
+            if(mBusyWorkersNum.fetch_sub(1) == 1) {
+                // lock so the notify can't slip in between waitForAll
+                // checking the counter and going to sleep
+                boost::lock_guard<boost::mutex> lk(mPassDoneMutex);
+                mPassDoneCondition.notify_all();
             }
-        }
-        if (mTLSManager) {
-            mTLSManager->finalize(tlsPtr);
         }
     }
 
     void ThreadPool::enqueue(const vector<Task*>& tasks) {
         if(mCoreNum == 1) {
             TLSPtr tlsPtr;
-            mTLSManager->initialize(tlsPtr);
+            if(mTLSManager) {
+                mTLSManager->initialize(tlsPtr);
+            }
             for(size_t i = 0; i < tasks.size(); ++i) {
                 tasks[i]->run(tlsPtr);
             }
-            mTLSManager->finalize(tlsPtr);
+            if(mTLSManager) {
+                mTLSManager->finalize(tlsPtr);
+            }
             return;
         }
 
-        if(mWorkers.size() == 0) {
-            initWorkers();
-        }
-    
-        {
-            boost::lock_guard<boost::mutex> lk(mTaskQueueMutex);
-            for(size_t i = 0; i < tasks.size(); ++i) {
-                mTasks.push_back(tasks[i]);
-            }
-            mTasksNum += mTasks.size();
+        // workers are still parked at this point. hand out contiguous
+        // runs so neighbor tiles stay on the same worker, thieves take
+        // from the far end of a run
+        size_t tasksNum = tasks.size();
+        for(size_t i = 0; i < tasksNum; ++i) {
+            mQueues[i * mCoreNum / tasksNum]->push(tasks[i]);
         }
+        mPendingNum.fetch_add(tasksNum);
+        mTasksNum.fetch_add(tasksNum);
     };
 
     void ThreadPool::waitForAll() {
@@ -89,24 +212,70 @@ namespace Goblin {
             return;
         }
 
-        // let the worker start working
+        if(mWorkers.size() == 0) {
+            initWorkers();
+        }
+        // start the pass, this works as a barrier: every worker has to
+        // check out before the next pass can begin
         {
             boost::unique_lock<boost::mutex> lk(mStartMutex);
-            mStartWork = true;
+            mBusyWorkersNum.store(mCoreNum);
+            ++mPassIndex;
         }
         mStartCondition.notify_all();
 
-        // wake me up til all the taks finish
-        { 
-            boost::unique_lock<boost::mutex> lk(mTaskQueueMutex);
-            while(mTasksNum != 0) {
-                mTasksCondition.wait(lk);
+        // wake me up til all the workers finish the pass
+        {
+            boost::unique_lock<boost::mutex> lk(mPassDoneMutex);
+            while(mBusyWorkersNum.load() != 0) {
+                mPassDoneCondition.wait(lk);
             }
-        } 
-        cleanup();
+        }
+    }
+
+    unsigned int ThreadPool::getCoreNum() const {
+        return mCoreNum;
+    }
+
+    bool ThreadPool::isStarving() const {
+        return mPendingNum.load() == 0;
+    }
+
+    void ThreadPool::spawn(Task* task) {
+        // the spawning task is still running so mTasksNum can't hit zero
+        // before the spawned one gets counted
+        mTasksNum.fetch_add(1);
+        {
+            boost::lock_guard<boost::mutex> lk(mSpawnedTasksMutex);
+            mSpawnedTasks.push_back(task);
+        }
+        mPendingNum.fetch_add(1);
+    }
+
+    Task* ThreadPool::popSpawnedTask() {
+        boost::lock_guard<boost::mutex> lk(mSpawnedTasksMutex);
+        if(mSpawnedTasks.empty()) {
+            return NULL;
+        }
+        Task* task = mSpawnedTasks.back();
+        mSpawnedTasks.pop_back();
+        return task;
+    }
+
+    ThreadPool* ThreadPool::getCurrent() {
+        return sCurrentPool.get();
+    }
+
+    void ThreadPool::setTLSManager(TLSManager* tlsManager) {
+        mTLSManager = tlsManager;
     }
 
     void ThreadPool::cleanup() {
+        {
+            boost::unique_lock<boost::mutex> lk(mStartMutex);
+            mShutdown = true;
+        }
+        mStartCondition.notify_all();
         for(size_t i = 0; i < mWorkers.size(); ++i) {
             if(mWorkers[i]->joinable()) {
                 mWorkers[i]->join();
@@ -116,8 +285,97 @@ namespace Goblin {
         mWorkers.clear();
         {
             boost::unique_lock<boost::mutex> lk(mStartMutex);
-            mStartWork = false;
+            mShutdown = false;
         }
+    }
+
 
+    // does nothing, measures the pure scheduling cost
+    class EmptyTask : public Task {
+    public:
+        void run(TLSPtr& tls) {}
+    };
+
+    // a few microseconds of arithmetic, roughly a cheap 8x8 tile
+    class BusyTask : public Task {
+    public:
+        BusyTask(): mResult(0.0f) {}
+        void run(TLSPtr& tls) {
+            float x = mResult;
+            for(int i = 0; i < sIterationsNum; ++i) {
+                x = x * 0.999f + 0.5f;
+            }
+            mResult = x;
+        }
+        float getResult() const { return mResult; }
+    private:
+        static const int sIterationsNum = 1024;
+        float mResult;
+    };
+
+    static float timeTasks(ThreadPool& threadPool,
+        const vector<Task*>& tasks, int passesNum = 1) {
+        boost::posix_time::ptime start =
+            boost::posix_time::microsec_clock::local_time();
+        for(int i = 0; i < passesNum; ++i) {
+            threadPool.enqueue(tasks);
+            threadPool.waitForAll();
+        }
+        boost::posix_time::time_duration elapsed =
+            boost::posix_time::microsec_clock::local_time() - start;
+        return 1e-6f * elapsed.total_microseconds();
+    }
+
+    void benchmarkThreadPool(unsigned int maxCoreNum, size_t tasksNum) {
+        unsigned int hardwareNum = boost::thread::hardware_concurrency();
+        maxCoreNum = maxCoreNum == 0 ?
+            hardwareNum : min(maxCoreNum, hardwareNum);
+        vector<EmptyTask> emptyTasks(tasksNum);
+        vector<BusyTask> busyTasks(tasksNum);
+        vector<Task*> emptyTaskPtrs(tasksNum);
+        vector<Task*> busyTaskPtrs(tasksNum);
+        for(size_t i = 0; i < tasksNum; ++i) {
+            emptyTaskPtrs[i] = &emptyTasks[i];
+            busyTaskPtrs[i] = &busyTasks[i];
+        }
+        const int passesNum = 1000;
+        cout << "thread pool benchmark: " << tasksNum << " tasks, " <<
+            passesNum << " passes" << endl;
+        float busyBaseline = 0.0f;
+        for(unsigned int coreNum = 1; coreNum <= maxCoreNum; ) {
+            ThreadPool threadPool(coreNum);
+            // the first pass spawns the workers
+            boost::posix_time::ptime spawnStart =
+                boost::posix_time::microsec_clock::local_time();
+            threadPool.waitForAll();
+            float spawnSeconds = 1e-6f * (
+                boost::posix_time::microsec_clock::local_time() -
+                spawnStart).total_microseconds();
+            float emptySeconds = timeTasks(threadPool, emptyTaskPtrs);
+            float busySeconds = timeTasks(threadPool, busyTaskPtrs);
+            // one tiny task per worker, measures pass sequencing latency
+            vector<Task*> passTasks(emptyTaskPtrs.begin(),
+                emptyTaskPtrs.begin() + min((size_t)coreNum, tasksNum));
+            float passSeconds = timeTasks(threadPool, passTasks, passesNum);
+            if(coreNum == 1) {
+                busyBaseline = busySeconds;
+            }
+            cout << "threads " << coreNum <<
+                ": spawn " << 1e6f * spawnSeconds <<
+                " us, empty " << 1e-6f * tasksNum / max(emptySeconds, 1e-6f) <<
+                " Mtasks/s, busy " << busySeconds <<
+                " s, speedup " << busyBaseline / max(busySeconds, 1e-6f) <<
+                ", pass " << 1e6f * passSeconds / passesNum << " us" << endl;
+            coreNum = coreNum == maxCoreNum ?
+                coreNum + 1 : min(2 * coreNum, maxCoreNum);
+        }
+        // keep the busy work from being optimized away
+        float sink = 0.0f;
+        for(size_t i = 0; i < tasksNum; ++i) {
+            sink += busyTasks[i].getResult();
+        }
+        if(sink == 0.0f) {
+            cout << endl;
+        }
     }
 }
@@ -3,6 +3,7 @@
 
 #include "GoblinThreadLocalStorage.h"
 #include "GoblinUtils.h"
+#include <boost/atomic.hpp>
 #include <boost/thread.hpp>
 
 namespace Goblin {
@@ -13,30 +14,82 @@ namespace Goblin {
         virtual ~Task() {};
     };
 
+    // per worker task deque. the owner pops from the bottom while the
+    // other workers steal from the top, only the last task needs a CAS
+    // to settle who gets it. tasks are only pushed while workers are
+    // parked so the buffer never grows under their feet
+    class WorkQueue {
+    public:
+        WorkQueue();
+        void push(Task* task);
+        Task* pop();
+        Task* steal();
+        bool empty() const;
+    private:
+        vector<Task*> mTasks;
+        boost::atomic<int64_t> mTop;
+        boost::atomic<int64_t> mBottom;
+    };
+
     class ThreadPool {
     public:
         ThreadPool(unsigned int coreNum = 0,
             TLSManager* tlsManager = NULL);
+        ~ThreadPool();
+        // only call this between passes, when workers are parked
+        void setTLSManager(TLSManager* tlsManager);
         void enqueue(const vector<Task*>& tasks);
+        // run the enqueued tasks as one pass, returns when every worker
+        // finalized its thread local storage and parked again
         void waitForAll();
+        // stop and join the workers, next enqueue spawns new ones
         void cleanup();
+        unsigned int getCoreNum() const;
+        // tasks running on a worker can split off part of their work
+        // with spawn when the pool is starving (nothing left queued
+        // while others still run). the pool takes the task ownership
+        // and runs it within current pass
+        bool isStarving() const;
+        void spawn(Task* task);
+        // pool of the calling worker thread, NULL outside of workers
+        static ThreadPool* getCurrent();
     private:
         void initWorkers();
-        void taskEntry();
+        void taskEntry(unsigned int workerIndex, uint64_t passIndex);
+        Task* stealTask(unsigned int workerIndex, uint32_t* seed);
+        Task* popSpawnedTask();
     private:
         vector<boost::thread*> mWorkers;
         unsigned int mCoreNum;
 
-        boost::condition_variable mTasksCondition;
-        boost::mutex mTaskQueueMutex;
-        vector<Task*> mTasks;
-        size_t mTasksNum;
+        vector<WorkQueue*> mQueues;
+        // tasks not picked up by any worker yet
+        boost::atomic<size_t> mPendingNum;
+        // tasks not finished yet, spawned ones included, pass ends on zero
+        boost::atomic<size_t> mTasksNum;
+        // split off while the pass runs, rare enough for a lock
+        vector<Task*> mSpawnedTasks;
+        boost::mutex mSpawnedTasksMutex;
+        // workers not done with current pass yet, the one hits zero
+        // wakes up waitForAll
+        boost::atomic<unsigned int> mBusyWorkersNum;
+        boost::condition_variable mPassDoneCondition;
+        boost::mutex mPassDoneMutex;
 
+        // workers park on this between passes, a new pass index
+        // (or shutdown) wakes them up
         boost::condition_variable mStartCondition;
         boost::mutex mStartMutex;
-        bool mStartWork;
+        uint64_t mPassIndex;
+        bool mShutdown;
         TLSManager* mTLSManager;
     };
+
+    // run batches of synthetic tasks with 1, 2, 4... up to maxCoreNum
+    // threads and report the scheduling throughput, speedup and the
+    // latency of a pass on the parked workers
+    void benchmarkThreadPool(unsigned int maxCoreNum = 0,
+        size_t tasksNum = 65536);
 }
 
 #endif //GOBLIN_THREAD_POOL_H
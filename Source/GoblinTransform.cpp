@@ -118,7 +118,9 @@ namespace Goblin {
         }
 
         Ray Transform::onRay(const Ray& r) const {
-            return Ray(onPoint(r.o), onVector(r.d), r.mint, r.maxt, r.depth);
+            Ray ray(onPoint(r.o), onVector(r.d), r.mint, r.maxt, r.depth);
+            ray.mask = r.mask;
+            return ray;
         }
 
         BBox Transform::onBBox(const BBox& b) const {
@@ -158,8 +160,10 @@ namespace Goblin {
         }
 
         Ray Transform::invertRay(const Ray& r) const {
-            return Ray(invertPoint(r.o), invertVector(r.d), 
+            Ray ray(invertPoint(r.o), invertVector(r.d), 
                 r.mint, r.maxt, r.depth);
+            ray.mask = r.mask;
+            return ray;
         }
 
         BBox Transform::invertBBox(const BBox& b) const {
@@ -174,6 +178,12 @@ namespace Goblin {
             return rv;
         }
 
+        Ray AffineTransform::onRay(const Ray& r) const {
+            Ray ray(onPoint(r.o), onVector(r.d), r.mint, r.maxt, r.depth);
+            ray.mask = r.mask;
+            return ray;
+        }
+
         bool Transform::isUpdated() const {
             return mIsUpdated;
         }
@@ -58,6 +58,50 @@ namespace Goblin {
         Vector3 mScale;
         mutable bool mIsUpdated;
     };
+
+    // the upper 3x4 part of an affine matrix. unlike Transform there is
+    // no lazy update check and no projective row to deal with, used to
+    // cache transforms applied on hot paths like instance intersection
+    class AffineTransform {
+    public:
+        AffineTransform();
+        AffineTransform(const Matrix4& m);
+        Vector3 onPoint(const Vector3& p) const;
+        Vector3 onVector(const Vector3& v) const;
+        Ray onRay(const Ray& ray) const;
+    private:
+        float m[3][4];
+    };
+
+    inline AffineTransform::AffineTransform() {
+        for(int i = 0; i < 3; ++i) {
+            for(int j = 0; j < 4; ++j) {
+                m[i][j] = i == j ? 1.0f : 0.0f;
+            }
+        }
+    }
+
+    inline AffineTransform::AffineTransform(const Matrix4& M) {
+        for(int i = 0; i < 3; ++i) {
+            for(int j = 0; j < 4; ++j) {
+                m[i][j] = M[i][j];
+            }
+        }
+    }
+
+    inline Vector3 AffineTransform::onPoint(const Vector3& p) const {
+        return Vector3(
+            m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+            m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+            m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    inline Vector3 AffineTransform::onVector(const Vector3& v) const {
+        return Vector3(
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
 }
 
 #endif //GOBLIN_TRANSFORM_H
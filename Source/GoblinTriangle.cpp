@@ -115,9 +115,29 @@ namespace Goblin {
             return false;
         }
 
-        float b0 = 1.0f - b1 - b2;
         ray.maxt = t;
         *epsilon = 1e-3f * t;
+        fillFragment(ray, t, b1, b2, v0, v1, v2, fragment);
+        return true;
+    }
+
+    bool Triangle::getTriangleFragment(const Ray& ray, float t, float b1,
+        float b2, float* epsilon, Fragment* fragment) const {
+        const TriangleIndex* ti = mParentMesh->getFacePtr(mIndex);
+        const Vertex& v0 = *mParentMesh->getVertexPtr(ti->v[0]);
+        const Vertex& v1 = *mParentMesh->getVertexPtr(ti->v[1]);
+        const Vertex& v2 = *mParentMesh->getVertexPtr(ti->v[2]);
+        *epsilon = 1e-3f * t;
+        fillFragment(ray, t, b1, b2, v0, v1, v2, fragment);
+        return true;
+    }
+
+    void Triangle::fillFragment(const Ray& ray, float t, float b1, float b2,
+        const Vertex& v0, const Vertex& v1, const Vertex& v2,
+        Fragment* fragment) const {
+        Vector3 e1 = v1.position - v0.position;
+        Vector3 e2 = v2.position - v0.position;
+        float b0 = 1.0f - b1 - b2;
         // start collect intersection geometry info:
         // position, normal, uv, dpdu, dpdv....
         Vector3 position(ray(t));
@@ -160,7 +180,6 @@ namespace Goblin {
             dpdv = invDet * (-du2 * e1 + du1 * e2);
         }
         *fragment = Fragment(position, normal, uv, dpdu, dpdv);
-        return true;
     }
 
     Vector3 Triangle::sample(float u1, float u2, Vector3* normal) const {
@@ -205,6 +224,30 @@ namespace Goblin {
         return rv;
     }
 
+    bool Triangle::getTriangle(Vector3* p0, Vector3* p1, Vector3* p2) const {
+        TriangleIndex* ti = (TriangleIndex*)mParentMesh->getFacePtr(mIndex);
+        *p0 = mParentMesh->getVertexPtr(ti->v[0])->position;
+        *p1 = mParentMesh->getVertexPtr(ti->v[1])->position;
+        *p2 = mParentMesh->getVertexPtr(ti->v[2])->position;
+        return true;
+    }
+
+    bool Triangle::getTriangleUV(Vector2* uv0, Vector2* uv1, 
+        Vector2* uv2) const {
+        // same default uvs as what intersect uses
+        if(!mParentMesh->hasTexCoord()) {
+            *uv0 = Vector2(0.0f, 0.0f);
+            *uv1 = Vector2(1.0f, 0.0f);
+            *uv2 = Vector2(0.0f, 1.0f);
+            return true;
+        }
+        TriangleIndex* ti = (TriangleIndex*)mParentMesh->getFacePtr(mIndex);
+        *uv0 = mParentMesh->getVertexPtr(ti->v[0])->texC;
+        *uv1 = mParentMesh->getVertexPtr(ti->v[1])->texC;
+        *uv2 = mParentMesh->getVertexPtr(ti->v[2])->texC;
+        return true;
+    }
+
     inline const Vertex* Triangle::getVertexPtr(size_t index) const {
         return mParentMesh->getVertexPtr(mIndex);
     }
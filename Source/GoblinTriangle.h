@@ -21,7 +21,16 @@ namespace Goblin {
         Vector3 sample(float u1, float u2, Vector3* normal) const;
         float area() const;
         BBox getObjectBound() const;
+        bool getTriangle(Vector3* p0, Vector3* p1, Vector3* p2) const;
+        bool getTriangleUV(Vector2* uv0, Vector2* uv1, Vector2* uv2) const;
+        bool getTriangleFragment(const Ray& ray, float t, float b1,
+            float b2, float* epsilon, Fragment* fragment) const;
     private:
+        // position, normal, uv and tangents of the hit at t, b1, b2
+        void fillFragment(const Ray& ray, float t, float b1, float b2,
+            const Vertex& v0, const Vertex& v1, const Vertex& v2,
+            Fragment* fragment) const;
+
         const ObjMesh* mParentMesh;
         size_t mIndex;
     };
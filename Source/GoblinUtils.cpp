@@ -25,6 +25,7 @@ namespace Goblin {
         ~RNGImp();
         float randomFloat() const;
         uint32_t randomUInt() const;
+        void seed(uint32_t s);
     private:
         RNGType* mEngine;
         RealDist* mRealDist;
@@ -58,6 +59,13 @@ namespace Goblin {
         return (*mUInt32Generator)();
     }
 
+    void RNGImp::seed(uint32_t s) {
+        // the generators hold their own copies of the engine
+        mEngine->seed(s);
+        mRealGenerator->engine().seed(s);
+        mUInt32Generator->engine().seed(s);
+    }
+
     RNG::RNG() {
         mRNGImp = new RNGImp();
     }
@@ -77,6 +85,10 @@ namespace Goblin {
         return mRNGImp->randomUInt();
     }
 
+    void RNG::seed(uint32_t s) {
+        mRNGImp->seed(s);
+    }
+
     void coordinateAxises(const Vector3& a1, Vector3* a2, Vector3* a3) {
         // in case you throw in case like a1 = Vector3(0, 1, 0)
         if(fabsf(a1.x) > fabsf(a1.y)) {
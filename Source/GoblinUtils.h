@@ -213,10 +213,22 @@ namespace Goblin {
         ~RNG();
         float randomFloat() const;
         uint32_t randomUInt() const;
+        void seed(uint32_t s);
     private:
         RNGImp* mRNGImp;
     };
 
+    // 64 bit FNV-1a, pass the last hash back in to chain the calls
+    inline uint64_t hashBytes(const void* data, size_t size,
+        uint64_t hash = 0xcbf29ce484222325ULL) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for(size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
     class NullType {};
 
     // get first N prime numbers sequence
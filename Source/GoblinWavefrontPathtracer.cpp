@@ -0,0 +1,557 @@
+#include "GoblinWavefrontPathtracer.h"
+#include "GoblinBBox.h"
+#include "GoblinCamera.h"
+#include "GoblinFilm.h"
+#include "GoblinParamSet.h"
+#include "GoblinRay.h"
+
+#include <algorithm>
+
+namespace Goblin {
+
+    typedef vector<pair<uint64_t, uint32_t> > SortKeys;
+
+    // path states of a wavefront in structure of arrays layout,
+    // the stages walk through queues of indexes into them
+    struct PathStates {
+        void resize(size_t pathsNum);
+        // current ray of the path and its closest hit
+        vector<RayDifferential> rays;
+        vector<Intersection> intersections;
+        vector<float> epsilons;
+        vector<char> hits;
+        vector<Color> throughputs;
+        vector<Color> L;
+        vector<char> firstBounce;
+        // camera ray weight, transmittance and volume radiance
+        vector<float> weights;
+        vector<Color> cameraTr;
+        vector<Color> cameraLv;
+        // direct lighting of the current bounce
+        vector<Color> Ld;
+        vector<const Light*> lights;
+        vector<float> pickLightPdfs;
+        // light sample shadow ray and its contribution when unoccluded
+        vector<Ray> shadowRays;
+        vector<Color> shadowWeights;
+        // bsdf sampled ray that may reach the picked light
+        vector<Ray> lightRays;
+        vector<Intersection> lightIntersections;
+        vector<float> lightEpsilons;
+        vector<char> lightHits;
+        vector<Color> lightWeights;
+        vector<float> lightCosines;
+        // throughput scale for the next bounce, black ends the path
+        vector<Color> bsdfWeights;
+        vector<char> nullSampled;
+
+        vector<uint32_t> activeQueue;
+        vector<uint32_t> nextQueue;
+        vector<uint32_t> shadowQueue;
+        vector<uint32_t> lightQueue;
+        SortKeys sortKeys;
+    };
+
+    void PathStates::resize(size_t pathsNum) {
+        if(rays.size() >= pathsNum) {
+            return;
+        }
+        rays.resize(pathsNum);
+        intersections.resize(pathsNum);
+        epsilons.resize(pathsNum);
+        hits.resize(pathsNum);
+        throughputs.resize(pathsNum);
+        L.resize(pathsNum);
+        firstBounce.resize(pathsNum);
+        weights.resize(pathsNum);
+        cameraTr.resize(pathsNum);
+        cameraLv.resize(pathsNum);
+        Ld.resize(pathsNum);
+        lights.resize(pathsNum);
+        pickLightPdfs.resize(pathsNum);
+        shadowRays.resize(pathsNum);
+        shadowWeights.resize(pathsNum);
+        lightRays.resize(pathsNum);
+        lightIntersections.resize(pathsNum);
+        lightEpsilons.resize(pathsNum);
+        lightHits.resize(pathsNum);
+        lightWeights.resize(pathsNum);
+        lightCosines.resize(pathsNum);
+        bsdfWeights.resize(pathsNum);
+        nullSampled.resize(pathsNum);
+        activeQueue.reserve(pathsNum);
+        nextQueue.reserve(pathsNum);
+        shadowQueue.reserve(pathsNum);
+        lightQueue.reserve(pathsNum);
+        sortKeys.reserve(pathsNum);
+    }
+
+    // path states and samples are kept per thread and reused across
+    // tasks so the queues only get allocated once
+    class WavefrontTLS : public RenderingTLS {
+    public:
+        WavefrontTLS(const Film& film): RenderingTLS(film),
+            mSamples(NULL), mSamplesNum(0) {}
+
+        ~WavefrontTLS() {
+            if(mSamples) {
+                delete [] mSamples;
+                mSamples = NULL;
+            }
+        }
+
+        PathStates& getPathStates() { return mPathStates; }
+
+        Sample* getSamples(Sampler& sampler, size_t samplesNum) {
+            if(samplesNum > mSamplesNum) {
+                delete [] mSamples;
+                mSamples = sampler.allocateSampleBuffer(samplesNum);
+                mSamplesNum = samplesNum;
+            }
+            return mSamples;
+        }
+
+    private:
+        PathStates mPathStates;
+        Sample* mSamples;
+        size_t mSamplesNum;
+    };
+
+    class WavefrontTLSManager : public RenderingTLSManager {
+    public:
+        WavefrontTLSManager(Film* film): RenderingTLSManager(film),
+            mFilm(film) {}
+
+        void initialize(TLSPtr& tlsPtr) {
+            tlsPtr.reset(new WavefrontTLS(*mFilm));
+        }
+
+    private:
+        Film* mFilm;
+    };
+
+    class WavefrontTask : public RenderTask {
+    public:
+        WavefrontTask(WavefrontPathTracer* pathTracer,
+            const CameraPtr& camera, const ScenePtr& scene,
+            const SampleRange& sampleRange, const SampleQuota& sampleQuota,
+            int samplePerPixel, RenderProgress* renderProgress);
+        void run(TLSPtr& tls);
+    private:
+        void renderWavefront(const Sample* samples, size_t samplesNum,
+            PathStates& s, ImageTile* tile);
+        void generateCameraRays(const Sample* samples, size_t pathsNum,
+            PathStates& s);
+        void shade(const Sample* samples, int bounces, PathStates& s);
+        void traceShadowRays(PathStates& s);
+        void traceLightRays(PathStates& s);
+        void extendPaths(PathStates& s);
+    private:
+        const WavefrontPathTracer* mPathTracer;
+    };
+
+    // interleave the lower 10 bits of v with 2 zero bits each
+    static inline uint32_t expandBits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    static void applySortKeys(vector<uint32_t>& queue, SortKeys& keys) {
+        std::sort(keys.begin(), keys.end());
+        for(size_t k = 0; k < keys.size(); ++k) {
+            queue[k] = keys[k].second;
+        }
+    }
+
+    // group the rays by direction octant then by the morton code of
+    // their origins in the queue bound
+    template<typename RayType>
+    static void sortByRay(vector<uint32_t>& queue,
+        const vector<RayType>& rays, SortKeys& keys) {
+        if(queue.size() < 2) {
+            return;
+        }
+        BBox bound;
+        for(size_t k = 0; k < queue.size(); ++k) {
+            bound.expand(rays[queue[k]].o);
+        }
+        Vector3 extent = bound.pMax - bound.pMin;
+        keys.resize(queue.size());
+        for(size_t k = 0; k < queue.size(); ++k) {
+            const Ray& ray = rays[queue[k]];
+            uint64_t octant = (ray.d.x < 0.0f ? 1 : 0) |
+                (ray.d.y < 0.0f ? 2 : 0) | (ray.d.z < 0.0f ? 4 : 0);
+            uint32_t morton = 0;
+            for(int axis = 0; axis < 3; ++axis) {
+                float t = extent[axis] > 0.0f ?
+                    (ray.o[axis] - bound.pMin[axis]) / extent[axis] : 0.0f;
+                uint32_t q = (uint32_t)clamp(t * 1024.0f, 0.0f, 1023.0f);
+                morton |= expandBits(q) << (2 - axis);
+            }
+            keys[k] = std::make_pair((octant << 30) | morton, queue[k]);
+        }
+        applySortKeys(queue, keys);
+    }
+
+    // group the hits by material then by primitive
+    static void sortByMaterial(vector<uint32_t>& queue,
+        const vector<Intersection>& intersections, SortKeys& keys) {
+        if(queue.size() < 2) {
+            return;
+        }
+        keys.resize(queue.size());
+        for(size_t k = 0; k < queue.size(); ++k) {
+            const Intersection& intersection = intersections[queue[k]];
+            keys[k] = std::make_pair(
+                (uint64_t)(size_t)intersection.getMaterial().get(), queue[k]);
+        }
+        applySortKeys(queue, keys);
+    }
+
+    // closest hit test for the rays in queue order, sorted queues
+    // put coherent rays next to each other so they go in packets
+    template<typename RayType>
+    static void intersectClosest(const ScenePtr& scene,
+        const vector<uint32_t>& queue, vector<RayType>& rays,
+        vector<float>& epsilons, vector<Intersection>& intersections,
+        vector<char>& hits) {
+        RayPacket packet;
+        float packetEpsilons[RayPacket::MaxSize];
+        Intersection packetIntersections[RayPacket::MaxSize];
+        for(size_t first = 0; first < queue.size();
+            first += RayPacket::MaxSize) {
+            int packetSize = (int)min(queue.size() - first,
+                (size_t)RayPacket::MaxSize);
+            packet.clear();
+            for(int k = 0; k < packetSize; ++k) {
+                packet.addRay(&rays[queue[first + k]]);
+            }
+            uint64_t hitMask = scene->intersect(packet, packetEpsilons,
+                packetIntersections);
+            for(int k = 0; k < packetSize; ++k) {
+                uint32_t i = queue[first + k];
+                hits[i] = (hitMask >> k) & 1;
+                if(hits[i]) {
+                    epsilons[i] = packetEpsilons[k];
+                    intersections[i] = packetIntersections[k];
+                }
+            }
+        }
+    }
+
+    WavefrontTask::WavefrontTask(WavefrontPathTracer* pathTracer,
+        const CameraPtr& camera, const ScenePtr& scene,
+        const SampleRange& sampleRange, const SampleQuota& sampleQuota,
+        int samplePerPixel, RenderProgress* renderProgress):
+        RenderTask(pathTracer, camera, scene, sampleRange, sampleQuota,
+        samplePerPixel, renderProgress), mPathTracer(pathTracer) {}
+
+    void WavefrontTask::run(TLSPtr& tls) {
+        WavefrontTLS* wavefrontTLS = static_cast<WavefrontTLS*>(tls.get());
+        ImageTile* tile = wavefrontTLS->getLocalTile(mSampleRange);
+        PathStates& s = wavefrontTLS->getPathStates();
+
+        Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, mRNG);
+        // the sample range goes in wavefronts of at most wavefront_size
+        // paths, the samples of one pixel are never split between two
+        size_t pixelSamples = (size_t)sampler.maxSamplesPerRequest();
+        size_t pathsNum = (size_t)min(sampler.maxTotalSamples(),
+            (uint64_t)max(mPathTracer->mWavefrontSize / pixelSamples,
+            (size_t)1) * pixelSamples);
+        Sample* samples = wavefrontTLS->getSamples(sampler, pathsNum);
+        s.resize(pathsNum);
+        while(true) {
+            size_t samplesNum = 0;
+            int sampleNum = 0;
+            while(samplesNum + pixelSamples <= pathsNum && (sampleNum = 
+                sampler.requestSamples(samples + samplesNum)) > 0) {
+                samplesNum += sampleNum;
+            }
+            if(samplesNum == 0) {
+                break;
+            }
+            renderWavefront(samples, samplesNum, s, tile);
+        }
+        mCamera->getFilm()->mergeTile(*tile);
+        mRenderProgress->update();
+    }
+
+    void WavefrontTask::renderWavefront(const Sample* samples,
+        size_t samplesNum, PathStates& s, ImageTile* tile) {
+        generateCameraRays(samples, samplesNum, s);
+        for(int bounces = 0; bounces < mPathTracer->mMaxRayDepth &&
+            !s.activeQueue.empty(); ++bounces) {
+            shade(samples, bounces, s);
+            traceShadowRays(s);
+            traceLightRays(s);
+            extendPaths(s);
+        }
+        // accumulation
+        for(size_t i = 0; i < samplesNum; ++i) {
+            tile->addSample(samples[i].imageX, samples[i].imageY,
+                s.weights[i] * (s.cameraTr[i] * s.L[i] + s.cameraLv[i]));
+        }
+    }
+
+    void WavefrontTask::generateCameraRays(const Sample* samples,
+        size_t pathsNum, PathStates& s) {
+        s.activeQueue.clear();
+        for(size_t i = 0; i < pathsNum; ++i) {
+            s.rays[i] = RayDifferential();
+            s.weights[i] = mCamera->generateRay(samples[i], &s.rays[i]);
+            s.throughputs[i] = Color(1.0f);
+            s.L[i] = Color(0.0f);
+            s.firstBounce[i] = true;
+            s.activeQueue.push_back((uint32_t)i);
+        }
+        sortByRay(s.activeQueue, s.rays, s.sortKeys);
+        intersectClosest(mScene, s.activeQueue, s.rays, s.epsilons,
+            s.intersections, s.hits);
+        // the camera ray maxt is clamped to its closest hit by now
+        for(size_t k = 0; k < s.activeQueue.size(); ++k) {
+            uint32_t i = s.activeQueue[k];
+            s.cameraTr[i] = mPathTracer->transmittance(mScene, s.rays[i]);
+            s.cameraLv[i] = mPathTracer->Lv(mScene, s.rays[i], *mRNG);
+        }
+        if(mScene->getLights().size() == 0) {
+            s.activeQueue.clear();
+            return;
+        }
+        size_t activeNum = 0;
+        for(size_t k = 0; k < s.activeQueue.size(); ++k) {
+            uint32_t i = s.activeQueue[k];
+            if(!s.hits[i]) {
+                // get image based lighting if ray didn't hit anything
+                s.L[i] += mScene->evalEnvironmentLight(s.rays[i]);
+                continue;
+            }
+            // if intersect an area light
+            s.L[i] += s.intersections[i].Le(-s.rays[i].d);
+            // subsurface scattering
+            s.L[i] += mPathTracer->Lsubsurface(mScene, s.intersections[i],
+                -s.rays[i].d, samples[i], &mPathTracer->mBSSRDFSampleIndex);
+            s.activeQueue[activeNum++] = i;
+        }
+        s.activeQueue.resize(activeNum);
+    }
+
+    void WavefrontTask::shade(const Sample* samples, int bounces,
+        PathStates& s) {
+        sortByMaterial(s.activeQueue, s.intersections, s.sortKeys);
+        s.shadowQueue.clear();
+        s.lightQueue.clear();
+        for(size_t k = 0; k < s.activeQueue.size(); ++k) {
+            uint32_t i = s.activeQueue[k];
+            Intersection& intersection = s.intersections[i];
+            intersection.computeUVDifferential(s.rays[i]);
+            const Sample& sample = samples[i];
+            LightSample ls(sample, mPathTracer->mLightSampleIndexes[bounces],
+                0);
+            BSDFSample bs(sample, mPathTracer->mBSDFSampleIndexes[bounces], 0);
+            float pickSample = sample.u1D[
+                mPathTracer->mPickLightSampleIndexes[bounces].offset][0];
+            const Light* light = mScene->sampleLight(pickSample,
+                &s.pickLightPdfs[i]);
+            s.lights[i] = light;
+            s.Ld[i] = Color(0.0f);
+
+            const MaterialPtr& material = intersection.getMaterial();
+            const Fragment& fragment = intersection.fragment;
+            float epsilon = s.epsilons[i];
+            Vector3 wo = -s.rays[i].d;
+            Vector3 p = fragment.getPosition();
+            Vector3 n = fragment.getNormal();
+            // bsdf sample goes first since the light sample gets
+            // thrown away when it punches through index-matched surface
+            Vector3 wi;
+            float bsdfPdf;
+            BSDFType sampledType;
+            Color f = material->sampleBSDF(fragment, wo, bs,
+                &wi, &bsdfPdf, BSDFAll, &sampledType);
+            bool sampled = f != Color::Black && bsdfPdf > 0.0f;
+            s.nullSampled[i] = sampled && sampledType == BSDFNull;
+            if(s.nullSampled[i]) {
+                s.throughputs[i] *= (f / bsdfPdf);
+                s.rays[i] = RayDifferential(p, wi, epsilon);
+                continue;
+            }
+            // lighting sample
+            Vector3 wiLight;
+            float lightPdf;
+            Color L = light->sampleL(p, epsilon, ls, &wiLight, &lightPdf,
+                &s.shadowRays[i]);
+            if(L != Color::Black && lightPdf > 0.0f) {
+                Color fLight = material->bsdf(fragment, wo, wiLight);
+                if(fLight != Color::Black) {
+                    // we don't do MIS for delta distribution light
+                    // since there is only one sample need for it
+                    float lWeight = 1.0f;
+                    if(!light->isDelta()) {
+                        float pdf = material->pdf(fragment, wo, wiLight);
+                        lWeight = powerHeuristic(1, lightPdf, 1, pdf);
+                    }
+                    s.shadowRays[i].mask = RayFlagOpaque;
+                    s.shadowWeights[i] = fLight * L *
+                        absdot(n, wiLight) * lWeight / lightPdf;
+                    s.shadowQueue.push_back(i);
+                }
+            }
+            if(!sampled) {
+                s.bsdfWeights[i] = Color::Black;
+                continue;
+            }
+            // calculate the misWeight if it's not a specular material
+            float fWeight = 1.0f;
+            if(!(sampledType & BSDFSpecular)) {
+                lightPdf = light->pdf(p, wi);
+                fWeight = powerHeuristic(1, bsdfPdf, 1, lightPdf);
+            }
+            s.lightRays[i] = Ray(p, wi, epsilon);
+            s.lightRays[i].mask = RayFlagOpaque;
+            s.lightWeights[i] = f * fWeight / bsdfPdf;
+            s.lightCosines[i] = absdot(wi, n);
+            s.lightQueue.push_back(i);
+
+            s.bsdfWeights[i] = f * absdot(wi, n) / bsdfPdf;
+            s.rays[i] = RayDifferential(p, wi, epsilon);
+        }
+    }
+
+    void WavefrontTask::traceShadowRays(PathStates& s) {
+        sortByRay(s.shadowQueue, s.shadowRays, s.sortKeys);
+        for(size_t k = 0; k < s.shadowQueue.size(); ++k) {
+            uint32_t i = s.shadowQueue[k];
+            if(!mScene->intersect(s.shadowRays[i])) {
+                // calculate the transmittance alone index-matched material
+                Color tr = mPathTracer->evalAttenuation(mScene,
+                    s.shadowRays[i], BSDFSample(*mRNG));
+                s.Ld[i] += tr * s.shadowWeights[i];
+            }
+        }
+    }
+
+    void WavefrontTask::traceLightRays(PathStates& s) {
+        sortByRay(s.lightQueue, s.lightRays, s.sortKeys);
+        intersectClosest(mScene, s.lightQueue, s.lightRays,
+            s.lightEpsilons, s.lightIntersections, s.lightHits);
+        for(size_t k = 0; k < s.lightQueue.size(); ++k) {
+            uint32_t i = s.lightQueue[k];
+            const Ray& r = s.lightRays[i];
+            if(s.lightHits[i]) {
+                Intersection& lightIntersect = s.lightIntersections[i];
+                if(lightIntersect.primitive->getAreaLight() == s.lights[i]) {
+                    Color Li = lightIntersect.Le(-r.d);
+                    if(Li != Color::Black) {
+                        Color tr = mPathTracer->evalAttenuation(mScene, r,
+                            BSDFSample(*mRNG));
+                        s.Ld[i] += s.lightWeights[i] * tr * Li *
+                            s.lightCosines[i];
+                    }
+                }
+            } else {
+                // the radiance contribution from IBL
+                Color tr = mPathTracer->evalAttenuation(mScene, r,
+                    BSDFSample(*mRNG));
+                s.Ld[i] += s.lightWeights[i] * tr * s.lights[i]->Le(r);
+            }
+        }
+    }
+
+    void WavefrontTask::extendPaths(PathStates& s) {
+        s.nextQueue.clear();
+        for(size_t k = 0; k < s.activeQueue.size(); ++k) {
+            uint32_t i = s.activeQueue[k];
+            if(s.nullSampled[i]) {
+                s.nextQueue.push_back(i);
+                continue;
+            }
+            s.L[i] += s.throughputs[i] * s.Ld[i] / s.pickLightPdfs[i];
+            if(s.bsdfWeights[i] != Color::Black) {
+                s.throughputs[i] *= s.bsdfWeights[i];
+                s.nextQueue.push_back(i);
+            }
+        }
+        sortByRay(s.nextQueue, s.rays, s.sortKeys);
+        intersectClosest(mScene, s.nextQueue, s.rays, s.epsilons,
+            s.intersections, s.hits);
+        s.activeQueue.clear();
+        for(size_t k = 0; k < s.nextQueue.size(); ++k) {
+            uint32_t i = s.nextQueue[k];
+            if(!s.hits[i]) {
+                // primary ray punching through index-matched surface
+                // need to evaluate image based lighting
+                if(s.nullSampled[i] && s.firstBounce[i]) {
+                    s.L[i] += s.throughputs[i] *
+                        mScene->evalEnvironmentLight(s.rays[i]);
+                }
+                continue;
+            }
+            if(!s.nullSampled[i]) {
+                s.firstBounce[i] = false;
+            }
+            s.activeQueue.push_back(i);
+        }
+    }
+
+    WavefrontPathTracer::WavefrontPathTracer(int samplePerPixel,
+        int threadNum, int maxRayDepth, int bssrdfSampleNum,
+        int wavefrontSize):
+        PathTracer(samplePerPixel, threadNum, maxRayDepth, bssrdfSampleNum),
+        mWavefrontSize(wavefrontSize) {}
+
+    WavefrontPathTracer::~WavefrontPathTracer() {}
+
+    void WavefrontPathTracer::render(const ScenePtr& scene) {
+        const CameraPtr camera = scene->getCamera();
+        Film* film = camera->getFilm();
+        SampleQuota sampleQuota;
+        querySampleQuota(scene, &sampleQuota);
+
+        // pick the tile size that fills up a wavefront, while leaving
+        // enough tiles around to keep all the threads busy. the tasks
+        // cap their wavefronts at wavefront_size anyway
+        SampleRange fullRange;
+        film->getSampleRange(fullRange);
+        int pixelsNum = (fullRange.xEnd - fullRange.xStart) *
+            (fullRange.yEnd - fullRange.yStart);
+        int passSamples = mRenderBudget.getPassSamples(mSamplePerPixel);
+        int step = (int)sqrt((float)mWavefrontSize / passSamples);
+        int maxStep = (int)sqrt((float)pixelsNum / (4 * getWorkerNum()));
+        step = max(min(step, maxStep), 1);
+
+        vector<SampleRange> sampleRanges;
+        getSampleRanges(film, sampleRanges, step);
+        vector<Task*> renderTasks;
+        RenderProgress progress((int)sampleRanges.size());
+        for(size_t i = 0; i < sampleRanges.size(); ++i) {
+            renderTasks.push_back(new WavefrontTask(this,
+                camera, scene, sampleRanges[i], sampleQuota, mSamplePerPixel,
+                &progress));
+        }
+
+        WavefrontTLSManager tlsManager(film);
+        renderPasses(renderTasks, &tlsManager, &progress);
+        //clean up
+        for(size_t i = 0; i < renderTasks.size(); ++i) {
+            delete renderTasks[i];
+        }
+        renderTasks.clear();
+        drawDebugData(tlsManager.getDebugData(), camera);
+        outputFilm(film, tlsManager);
+    }
+
+    Renderer* WavefrontPathTracerCreator::create(
+        const ParamSet& params) const {
+        int samplePerPixel = params.getInt("sample_per_pixel", 1);
+        int threadNum = params.getInt("thread_num",
+            boost::thread::hardware_concurrency());
+        int maxRayDepth = params.getInt("max_ray_depth", 5);
+        int bssrdfSampleNum = params.getInt("bssrdf_sample_num", 4);
+        int wavefrontSize = params.getInt("wavefront_size", 4096);
+        return new WavefrontPathTracer(samplePerPixel, threadNum,
+            maxRayDepth, bssrdfSampleNum, wavefrontSize);
+    }
+}
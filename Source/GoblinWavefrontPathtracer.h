@@ -0,0 +1,33 @@
+#ifndef GOBLIN_WAVEFRONT_PATHTRACER_H
+#define GOBLIN_WAVEFRONT_PATHTRACER_H
+
+#include "GoblinFactory.h"
+#include "GoblinPathtracer.h"
+
+namespace Goblin {
+    // path tracer that advances a whole tile of paths one stage at a time
+    // (camera ray generation, closest hit, shading, shadow rays and
+    // accumulation) instead of tracing them one by one. queued rays get
+    // sorted by direction and origin, hits by material before each stage
+    // so the traversal and shading work on coherent batches. comes up
+    // with the same estimator as PathTracer::Li
+    class WavefrontPathTracer : public PathTracer {
+    public:
+        WavefrontPathTracer(int samplePerPixel = 1, int threadNum = 1,
+            int maxRayDepth = 5, int bssrdfSampleNum = 4,
+            int wavefrontSize = 4096);
+        ~WavefrontPathTracer();
+        void render(const ScenePtr& scene);
+    private:
+        int mWavefrontSize;
+    friend class WavefrontTask;
+    };
+
+    class WavefrontPathTracerCreator : public
+        Creator<Renderer , const ParamSet&> {
+    public:
+        Renderer* create(const ParamSet& params) const;
+    };
+}
+
+#endif //GOBLIN_WAVEFRONT_PATHTRACER_H
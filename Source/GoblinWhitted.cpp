@@ -15,10 +15,22 @@ namespace Goblin {
         const RayDifferential& ray, 
         const Sample& sample, const RNG& rng,
         RenderingTLS* tls) const {
-        Color Li = Color::Black;
         float epsilon;
         Intersection intersection;
-        if(scene->intersect(ray, &epsilon, &intersection)) {
+        bool hit = scene->intersect(ray, &epsilon, &intersection);
+        return shade(scene, ray, hit, epsilon, intersection, sample, rng, tls);
+    }
+
+    bool WhittedRenderer::supportRayPacket() const {
+        return true;
+    }
+
+    Color WhittedRenderer::shade(const ScenePtr& scene, 
+        const RayDifferential& ray, bool hit, float epsilon, 
+        Intersection& intersection, const Sample& sample, const RNG& rng,
+        RenderingTLS* tls) const {
+        Color Li = Color::Black;
+        if(hit) {
             intersection.computeUVDifferential(ray);
             // if intersect an area light
             Li += intersection.Le(-ray.d);
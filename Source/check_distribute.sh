@@ -0,0 +1,97 @@
+#!/bin/sh
+# render a small built in scene in one process, then again split across
+# worker processes with g_ray --distribute in crop and samples mode, and
+# check the merged images against the single process one
+#
+# usage: check_distribute.sh path/to/g_ray [parts] [render_method...]
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 path/to/g_ray [parts] [render_method...]"
+    exit 1
+fi
+G_RAY=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+PARTS=${2:-3}
+shift
+[ $# -gt 0 ] && shift
+METHODS=${*:-path_tracing wavefront_path_tracing bdpt light_tracing sppm}
+# spp for the tile renderers, iterations for sppm
+SPP=256
+# means over a few rows are still noisy, a seam between two parts or
+# a double counted filter apron is well above it
+TOLERANCE=0.05
+# parts repeating each other's samples are 40% or more above it
+NOISE_TOLERANCE=0.15
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+scene() {
+cat <<EOF
+{
+"render_setting": {"string":{"render_method":"$1"},"int":{"sample_per_pixel":$SPP,"max_ray_depth":5}},
+"filter": {"string":{"type":"gaussian"}},
+"film": {"vec2":{"resolution":[96,72]},"string":{"file":"$2"}},
+"camera": {"string":{"type":"perspective"},"vec3":{"position":[0,1,-8]},"float":{"fov":50}},
+"geometry": {"string":{"type":"sphere","name":"ball"},"float":{"radius":1}},
+"geometry": {"string":{"type":"sphere","name":"ground"},"float":{"radius":100}},
+"geometry": {"string":{"type":"sphere","name":"bulb"},"float":{"radius":0.5}},
+"texture": {"string":{"type":"constant","name":"red"},"color":{"color":[0.8,0.2,0.2]}},
+"texture": {"string":{"type":"constant","name":"grey"},"color":{"color":[0.6,0.6,0.6]}},
+"texture": {"string":{"type":"constant","name":"white"},"color":{"color":[1,1,1]}},
+"material": {"string":{"type":"lambert","name":"diffuse","Kd":"red"}},
+"material": {"string":{"type":"lambert","name":"floor","Kd":"grey"}},
+"material": {"string":{"type":"mirror","name":"mirror","Kr":"white"}},
+"material": {"string":{"type":"transparent","name":"glass","Kr":"white","Kt":"white"}},
+"primitive": {"string":{"type":"model","name":"diffuse_ball","geometry":"ball","material":"diffuse"}},
+"primitive": {"string":{"type":"model","name":"mirror_ball","geometry":"ball","material":"mirror"}},
+"primitive": {"string":{"type":"model","name":"glass_ball","geometry":"ball","material":"glass"}},
+"primitive": {"string":{"type":"model","name":"ground","geometry":"ground","material":"floor"}},
+"primitive": {"string":{"type":"instance","name":"i0","model":"diffuse_ball"},"vec3":{"position":[-2.2,0,0]}},
+"primitive": {"string":{"type":"instance","name":"i1","model":"mirror_ball"},"vec3":{"position":[0,0,0]}},
+"primitive": {"string":{"type":"instance","name":"i2","model":"glass_ball"},"vec3":{"position":[2.2,0,0]}},
+"primitive": {"string":{"type":"instance","name":"i3","model":"ground"},"vec3":{"position":[0,-101,0]}},
+"light": {"string":{"type":"point","name":"point"},"color":{"intensity":[20,20,20]},"vec3":{"position":[3,5,4]}},
+"light": {"string":{"type":"area","name":"area","geometry":"bulb"},"color":{"radiance":[8,8,8]},"vec3":{"position":[-2,4,2]}}
+}
+EOF
+}
+
+FAILED=0
+for METHOD in $METHODS; do
+    scene "$METHOD" reference.png > "$METHOD.json"
+    if ! "$G_RAY" "$METHOD.json" > "$METHOD.log" 2>&1; then
+        echo "$METHOD: single process render failed"
+        FAILED=1
+        continue
+    fi
+    for MODE in crop samples; do
+        scene "$METHOD" "$MODE.png" > "${METHOD}_$MODE.json"
+        if ! "$G_RAY" --distribute "$PARTS" "$MODE" \
+            "${METHOD}_$MODE.json" > "${METHOD}_$MODE.log" 2>&1
+        then
+            echo "$METHOD $MODE: distributed render failed"
+            FAILED=1
+            continue
+        fi
+        printf "%s %s x%s: " "$METHOD" "$MODE" "$PARTS"
+        if ! "$G_RAY" --compare "$MODE.png" "reference.png" \
+            "$TOLERANCE"; then
+            FAILED=1
+        fi
+    done
+    # parts drawing the samples of each other keep the mean but leave the
+    # merged image with the noise of a single part. the crop parts render
+    # disjoint pixels, their merged image is as far from the reference as
+    # an independent render with the same samples is
+    if [ -f crop.png ] && [ -f samples.png ]; then
+        printf "%s samples x%s noise: " "$METHOD" "$PARTS"
+        if ! "$G_RAY" --compare_noise samples.png crop.png reference.png 1 \
+            "$NOISE_TOLERANCE"; then
+            FAILED=1
+        fi
+    fi
+    rm -f crop.png samples.png
+done
+[ $FAILED -eq 0 ] && echo "all merged renders match" || echo "mismatch"
+exit $FAILED
@@ -0,0 +1,91 @@
+#!/bin/sh
+# render a small built in scene halfway into a checkpoint, resume it to
+# the full sample count, and check the resumed image against one rendered
+# straight through with a lot more samples. a resume that draws fresh
+# samples has the noise of twice the samples of the checkpoint, one that
+# redraws the samples already in the film keeps the mean but not the
+# noise drop. the film has fewer tiles than threads, so the tiles split
+# their tails off to the idle threads and the check covers the seeding
+# of the split off tasks too, the default methods are the tile
+# renderers that split them
+#
+# usage: check_resume.sh path/to/g_ray [render_method...]
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 path/to/g_ray [render_method...]"
+    exit 1
+fi
+G_RAY=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+METHODS=${*:-path_tracing ao bdpt}
+# low enough for the noise to stand well above the 8 bit quantization
+SPP=8
+REFERENCE_SPP=1024
+THREADS=16
+# a box filter over the pixel alone, a wider one weighs the samples of the
+# neighbor pixels in and at low sample counts that biases the half and
+# the resumed render alike, which reads as shared noise
+# redrawn samples leave the noise about 40% above the expected one
+TOLERANCE=0.15
+# the rows of an 8 spp film are noisy, a resume that loses or double
+# counts the checkpointed film is off by a lot more
+MEAN_TOLERANCE=0.1
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+# method, spp, image file, extra render_setting string keys
+scene() {
+cat <<EOF2
+{
+"render_setting": {"string":{"render_method":"$1"$4},"bool":{"resume":true},"int":{"sample_per_pixel":$2,"max_ray_depth":5,"thread_num":$THREADS}},
+"filter": {"string":{"type":"box"},"vec2":{"width":[0.5,0.5]}},
+"film": {"vec2":{"resolution":[24,16]},"string":{"file":"$3"}},
+"camera": {"string":{"type":"perspective"},"vec3":{"position":[0,1,-8]},"float":{"fov":50}},
+"geometry": {"string":{"type":"sphere","name":"ball"},"float":{"radius":1}},
+"geometry": {"string":{"type":"sphere","name":"ground"},"float":{"radius":100}},
+"geometry": {"string":{"type":"sphere","name":"bulb"},"float":{"radius":1.5}},
+"texture": {"string":{"type":"constant","name":"red"},"color":{"color":[0.8,0.2,0.2]}},
+"texture": {"string":{"type":"constant","name":"grey"},"color":{"color":[0.6,0.6,0.6]}},
+"material": {"string":{"type":"lambert","name":"diffuse","Kd":"red"}},
+"material": {"string":{"type":"lambert","name":"floor","Kd":"grey"}},
+"primitive": {"string":{"type":"model","name":"diffuse_ball","geometry":"ball","material":"diffuse"}},
+"primitive": {"string":{"type":"model","name":"ground","geometry":"ground","material":"floor"}},
+"primitive": {"string":{"type":"instance","name":"i0","model":"diffuse_ball"},"vec3":{"position":[0,0,0]}},
+"primitive": {"string":{"type":"instance","name":"i1","model":"ground"},"vec3":{"position":[0,-101,0]}},
+"light": {"string":{"type":"area","name":"area","geometry":"bulb"},"color":{"radiance":[4,4,4]},"vec3":{"position":[-2,9,2]}}
+}
+EOF2
+}
+
+FAILED=0
+for METHOD in $METHODS; do
+    CHECKPOINT=",\"checkpoint\":\"$METHOD.ckpt\""
+    scene "$METHOD" $REFERENCE_SPP reference.png > "${METHOD}_ref.json"
+    scene "$METHOD" $((SPP / 2)) half.png "$CHECKPOINT" > \
+        "${METHOD}_half.json"
+    scene "$METHOD" $SPP resumed.png "$CHECKPOINT" > \
+        "${METHOD}_resumed.json"
+    for RUN in ref half resumed; do
+        if ! "$G_RAY" "${METHOD}_$RUN.json" > "${METHOD}_$RUN.log" 2>&1
+        then
+            echo "$METHOD: $RUN render failed"
+            FAILED=1
+            continue 2
+        fi
+    done
+    if ! grep -q "resume at" "${METHOD}_resumed.log"; then
+        echo "$METHOD: the second run did not resume"
+        FAILED=1
+        continue
+    fi
+    printf "%s resumed: " "$METHOD"
+    if ! "$G_RAY" --compare resumed.png reference.png "$MEAN_TOLERANCE" ||
+        ! "$G_RAY" --compare_noise resumed.png half.png reference.png 2 \
+        "$TOLERANCE"; then
+        FAILED=1
+    fi
+done
+[ $FAILED -eq 0 ] && echo "all resumed renders match" || echo "mismatch"
+exit $FAILED
@@ -1,25 +1,315 @@
 #include "GoblinRenderContext.h"
 #include "GoblinContextLoader.h"
-#include <ctime>
+#include "GoblinImageIO.h"
+#include "GoblinPropertyTree.h"
+#include <cstdlib>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
 
 using namespace Goblin;
 
+static void usage() {
+    cout << "Usage: g_ray scene.json" << endl;
+    cout << "       g_ray scene.json --part index count crop|samples "
+        "part_file" << endl;
+    cout << "       g_ray --merge scene.json part_file..." << endl;
+    cout << "       g_ray --distribute count crop|samples scene.json" <<
+        endl;
+    cout << "       g_ray --server scene.json < jobs" << endl;
+    cout << "       g_ray --sequence scene.json" << endl;
+    cout << "       g_ray --compare image reference [tolerance]" << endl;
+    cout << "       g_ray --compare_noise image baseline reference "
+        "ratio [tolerance]" << endl;
+    cout << "       g_ray --benchmark_threads [max_threads]" << endl;
+}
+
+static bool parsePartitionMode(const string& s, RenderPartition::Mode* m) {
+    if(s == "crop") {
+        *m = RenderPartition::Crop;
+    } else if(s == "samples") {
+        *m = RenderPartition::Samples;
+    } else {
+        cout << "unknown partition mode " << s << endl;
+        return false;
+    }
+    return true;
+}
+
+static void runCommand(const string& command, int* result) {
+    *result = system(command.c_str());
+}
+
+// render the parts in local worker processes then merge them, the same
+// thing a farm scheduler does across machines
+static int distribute(const string& program, int count,
+    const string& mode, const string& scene) {
+    vector<string> parts(count);
+    vector<int> results(count, 0);
+    boost::thread_group workers;
+    for(int i = 0; i < count; ++i) {
+        std::ostringstream part;
+        part << scene << ".part" << i;
+        parts[i] = part.str();
+        std::ostringstream command;
+        command << "\"" << program << "\" \"" << scene << "\" --part " <<
+            i << " " << count << " " << mode << " \"" << parts[i] <<
+            "\" > \"" << parts[i] << ".log\" 2>&1";
+        workers.create_thread(boost::bind(runCommand, command.str(),
+            &results[i]));
+    }
+    workers.join_all();
+    for(int i = 0; i < count; ++i) {
+        if(results[i] != 0) {
+            cout << "part " << i << " failed, see " << parts[i] <<
+                ".log" << endl;
+            return 1;
+        }
+    }
+    boost::scoped_ptr<RenderContext> renderContext(
+        ContextLoader().load(scene));
+    if(!renderContext || !renderContext->mergeParts(parts)) {
+        return 1;
+    }
+    boost::system::error_code error;
+    for(int i = 0; i < count; ++i) {
+        boost::filesystem::remove(parts[i], error);
+        boost::filesystem::remove(parts[i] + ".log", error);
+    }
+    return 0;
+}
+
+static double renderTimed(RenderContext* renderContext) {
+    boost::posix_time::ptime beforeRender =
+        boost::posix_time::microsec_clock::universal_time();
+    renderContext->render();
+    boost::posix_time::time_duration renderTime =
+        boost::posix_time::microsec_clock::universal_time() -
+        beforeRender;
+    return 1e-3 * renderTime.total_milliseconds();
+}
+
+// load the scene once and render the jobs coming in on stdin, one json
+// object per line, until the input ends. a job overrides the
+// render_setting, filter, film and camera of the scene file, e.g.
+// {"camera":{"vec3":{"position":[0,1,-6]}},"film":{"string":{"file":"a.png"}}}
+// and {} renders the scene file as is. a named pipe or socat turns this
+// into a local socket server
+static int serve(const string& scene) {
+    ContextLoader contextLoader;
+    boost::scoped_ptr<RenderContext> renderContext(
+        contextLoader.load(scene));
+    if(!renderContext) {
+        return 1;
+    }
+    cout << "server ready" << endl;
+    string line;
+    int jobIndex = 0;
+    while(std::getline(cin, line)) {
+        if(line.find_first_not_of(" \t\r") == string::npos) {
+            continue;
+        }
+        PropertyTree job;
+        if(!job.parse(line) ||
+            !contextLoader.loadJob(job, renderContext.get())) {
+            cout << "job " << jobIndex++ << " failed" << endl;
+            continue;
+        }
+        double seconds = renderTimed(renderContext.get());
+        cout << "job " << jobIndex++ << " done in " << seconds <<
+            " seconds" << endl;
+    }
+    return 0;
+}
+
+// render the frame nodes of the scene file in order. the scene loads
+// once, frames only move instances and swap the camera, and each frame
+// gets written out while the next one renders
+static int renderSequence(const string& scene) {
+    ImageWriter imageWriter;
+    ContextLoader contextLoader;
+    boost::scoped_ptr<RenderContext> renderContext(
+        contextLoader.load(scene));
+    if(!renderContext) {
+        return 1;
+    }
+    int framesNum = contextLoader.getFramesNum();
+    if(framesNum == 0) {
+        cout << "no frame in " << scene << endl;
+        return 1;
+    }
+    double totalSeconds = 0.0;
+    for(int i = 0; i < framesNum; ++i) {
+        if(!contextLoader.loadFrame(i, renderContext.get())) {
+            cout << "frame " << i << " failed" << endl;
+            return 1;
+        }
+        renderContext->mScene->getCamera()->getFilm()->setImageWriter(
+            &imageWriter);
+        double seconds = renderTimed(renderContext.get());
+        totalSeconds += seconds;
+        cout << "frame " << i << " done in " << seconds << " seconds" <<
+            endl;
+    }
+    cout << "sequence of " << framesNum << " frames complete in " <<
+        totalSeconds << " seconds!" << endl;
+    return 0;
+}
+
+// rows averaged together by --compare, fewer rows are too noisy to tell
+// a seam from the variance
+static const int sCompareRows = 4;
+
+// check a render against a reference of the same scene, e.g. a merged
+// distributed render against a single process one. the noise keeps them
+// from matching pixel by pixel, so this compares the image mean and the
+// mean of each few rows, where a seam between two parts would show up.
+// fails when one is off by more than tolerance of the reference mean
+static int compareImages(const string& image, const string& reference,
+    float tolerance) {
+    int width, height, refWidth, refHeight;
+    boost::scoped_array<Color> pixels(loadImage(image, &width, &height));
+    boost::scoped_array<Color> refPixels(
+        loadImage(reference, &refWidth, &refHeight));
+    if(!pixels || !refPixels) {
+        return 1;
+    }
+    if(width != refWidth || height != refHeight) {
+        cout << image << " and " << reference <<
+            " have different resolutions" << endl;
+        return 1;
+    }
+    double sum = 0.0, refSum = 0.0, maxRowDiff = 0.0;
+    int worstRow = 0;
+    for(int y0 = 0; y0 < height; y0 += sCompareRows) {
+        int y1 = min(y0 + sCompareRows, height);
+        double rows = 0.0, refRows = 0.0;
+        for(int i = y0 * width; i < y1 * width; ++i) {
+            rows += pixels[i].luminance();
+            refRows += refPixels[i].luminance();
+        }
+        sum += rows;
+        refSum += refRows;
+        double rowDiff = fabs(rows - refRows) / ((y1 - y0) * width);
+        if(rowDiff > maxRowDiff) {
+            maxRowDiff = rowDiff;
+            worstRow = y0;
+        }
+    }
+    double refMean = max(refSum / (width * height), 1e-6);
+    double meanDiff = fabs(sum - refSum) / (width * height) / refMean;
+    double rowDiff = maxRowDiff / refMean;
+    cout << "mean differs by " << 100.0 * meanDiff << "%, rows from " <<
+        worstRow << " by " << 100.0 * rowDiff << "%" << endl;
+    return meanDiff <= tolerance && rowDiff <= tolerance ? 0 : 1;
+}
+
+// root mean square luminance difference of two images, relative to the
+// mean luminance of the second one. -1 when they can't be compared
+static double rmsDifference(const string& image, const string& reference) {
+    int width, height, refWidth, refHeight;
+    boost::scoped_array<Color> pixels(loadImage(image, &width, &height));
+    boost::scoped_array<Color> refPixels(
+        loadImage(reference, &refWidth, &refHeight));
+    if(!pixels || !refPixels) {
+        return -1.0;
+    }
+    if(width != refWidth || height != refHeight) {
+        cout << image << " and " << reference <<
+            " have different resolutions" << endl;
+        return -1.0;
+    }
+    double squareSum = 0.0, refSum = 0.0;
+    for(int i = 0; i < width * height; ++i) {
+        double d = pixels[i].luminance() - refPixels[i].luminance();
+        squareSum += d * d;
+        refSum += refPixels[i].luminance();
+    }
+    double refMean = max(refSum / (width * height), 1e-6);
+    return sqrt(squareSum / (width * height)) / refMean;
+}
+
+// check that image has the noise of a render with ratio times the samples
+// of baseline, both measured against a reference with a lot more samples.
+// a render drawing the same samples twice keeps the mean but not the
+// noise drop, --compare can't tell. fails when the noise of image is more
+// than tolerance above baseline noise / sqrt(ratio)
+static int compareNoise(const string& image, const string& baseline,
+    const string& reference, float ratio, float tolerance) {
+    double noise = rmsDifference(image, reference);
+    double baselineNoise = rmsDifference(baseline, reference);
+    if(noise < 0.0 || baselineNoise < 0.0 || ratio <= 0.0f) {
+        return 1;
+    }
+    double expectedNoise = baselineNoise / sqrt(ratio);
+    cout << "noise " << 100.0 * noise << "%, expected " <<
+        100.0 * expectedNoise << "%" << endl;
+    return noise <= (1.0 + tolerance) * expectedNoise ? 0 : 1;
+}
+
 int main(int argc, char** argv) {
-    if(argc != 2) {
-        cout << "Usage: g_ray scene.json" << endl;
+    if(argc >= 2 && string(argv[1]) == "--benchmark_threads") {
+        unsigned int maxCoreNum = argc > 2 ? atoi(argv[2]) : 0;
+        benchmarkThreadPool(maxCoreNum);
+        return 0;
+    }
+    if(argc == 3 && string(argv[1]) == "--server") {
+        return serve(argv[2]);
+    }
+    if(argc == 3 && string(argv[1]) == "--sequence") {
+        return renderSequence(argv[2]);
+    }
+    if((argc == 4 || argc == 5) && string(argv[1]) == "--compare") {
+        float tolerance = argc == 5 ? (float)atof(argv[4]) : 0.05f;
+        return compareImages(argv[2], argv[3], tolerance);
+    }
+    if((argc == 6 || argc == 7) && string(argv[1]) == "--compare_noise") {
+        float tolerance = argc == 7 ? (float)atof(argv[6]) : 0.15f;
+        return compareNoise(argv[2], argv[3], argv[4], (float)atof(argv[5]),
+            tolerance);
+    }
+    if(argc >= 4 && string(argv[1]) == "--merge") {
+        boost::scoped_ptr<RenderContext> renderContext(
+            ContextLoader().load(argv[2]));
+        vector<string> parts(argv + 3, argv + argc);
+        return renderContext && renderContext->mergeParts(parts) ? 0 : 1;
+    }
+    if(argc == 5 && string(argv[1]) == "--distribute") {
+        RenderPartition::Mode mode;
+        int count = atoi(argv[2]);
+        if(count < 1 || !parsePartitionMode(argv[3], &mode)) {
+            usage();
+            return 1;
+        }
+        return distribute(argv[0], count, argv[3], argv[4]);
+    }
+    RenderPartition partition;
+    if(argc == 7 && string(argv[2]) == "--part") {
+        partition.index = atoi(argv[3]);
+        partition.count = atoi(argv[4]);
+        partition.output = argv[6];
+        if(partition.count < 1 || partition.index < 0 ||
+            partition.index >= partition.count ||
+            !parsePartitionMode(argv[5], &partition.mode)) {
+            usage();
+            return 1;
+        }
+    } else if(argc != 2) {
+        usage();
         return 0;
     }
     boost::scoped_ptr<RenderContext> renderContext(
         ContextLoader().load(argv[1]));
-    if(renderContext) {
-        cout << "\nsuccessfully loaded scene, start rendering...\n"; 
-        time_t beforeRender;
-        time(&beforeRender);
-        renderContext->render();
-        time_t afterRender;
-        time(&afterRender);
-        double seconds = difftime(afterRender, beforeRender);
-        cout << "render complete in " << seconds << " seconds!" << endl; 
+    if(!renderContext) {
+        return 1;
+    }
+    if(partition.isPartial()) {
+        renderContext->setPartition(partition);
     }
+    cout << "\nsuccessfully loaded scene, start rendering...\n";
+    double seconds = renderTimed(renderContext.get());
+    cout << "render complete in " << seconds << " seconds!" << endl;
     return 0;
 }